@@ -0,0 +1,607 @@
+/*
+ * Copyright 2021-2022 Xilinx Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * defect-detect-bench: runs the kernel libraries the way vvas_xfilter does,
+ * without GStreamer pipelines or the FPGA. Every library is dlopen'ed and
+ * driven through a mock VVASKernel handle whose config comes from the same
+ * JSON files the application uses, with the backend forced to "cpu".
+ * Frames are synthetic mangos or GRAY8 frames read from a recording.
+ * Per stage and for the whole chain it reports latency percentiles,
+ * throughput and heap allocations per frame. --crosscheck checks the
+ * strip-parallel and bit mask forms of the CPU kernels instead.
+ */
+
+#include <gst/gst.h>
+#include <vvas/vvas_kernel.h>
+#include <jansson.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "gstdefectmeta.h"
+#include "dd_cpu_kernels.h"
+
+#define PRE_PROCESS_JSON_FILE        "preprocess-accelarator.json"
+#define OTSU_ACC_JSON_FILE           "otsu-accelarator.json"
+#define CCA_ACC_JSON_FILE            "cca-accelarator.json"
+#define FUSED_JSON_FILE              "fused-accelarator.json"
+#define TEXT_2_OVERLAY_JSON_FILE     "text2overlay.json"
+#define FRAME_ALIGN                  64
+#define MAX_RECORDED_FRAMES          64
+#define SYNTHETIC_FRAMES             16
+#define WARMUP_FRAMES                10
+#define SPECKLE_FRAMES               4
+#define DEFECT_PAINT_VALUE           128
+#define MAX_REPORTED_DIFFS           20
+
+typedef int32_t  (*KernelInitFunc) (VVASKernel *handle);
+typedef uint32_t (*KernelDeinitFunc) (VVASKernel *handle);
+typedef int32_t  (*KernelStartFunc) (VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT],
+                                     VVASFrame *output[MAX_NUM_OBJECT]);
+typedef int32_t  (*KernelDoneFunc) (VVASKernel *handle);
+
+typedef struct _BenchStage {
+    const gchar *name;
+    const gchar *json_file;
+    gboolean inplace;
+    json_t *root;
+    void *lib;
+    KernelInitFunc init;
+    KernelDeinitFunc deinit;
+    KernelStartFunc start;
+    KernelDoneFunc done;
+    VVASKernel handle;
+    VVASFrame out;
+    std::vector<guint64> lat_ns;
+    guint64 allocs;
+} BenchStage;
+
+static gchar* config_path  = (gchar *)"/opt/xilinx/kv260-defect-detect/share/vvas/";
+static gchar* lib_path = NULL;
+static gchar* in_file = NULL;
+static guint width = 1280;
+static guint height = 800;
+static guint num_frames = 1000;
+static gboolean fused = FALSE;
+static gboolean cross_check = FALSE;
+
+static GOptionEntry entries[] =
+{
+    { "infile",       'i', 0, G_OPTION_ARG_FILENAME, &in_file, "GRAY8 recording to read frames from, synthetic frames otherwise", "file path"},
+    { "width",        'w', 0, G_OPTION_ARG_INT, &width, "Resolution width of the frames", "1280"},
+    { "height",       'h', 0, G_OPTION_ARG_INT, &height, "Resolution height of the frames", "800"},
+    { "frames",       'n', 0, G_OPTION_ARG_INT, &num_frames, "Number of frames to measure", "1000"},
+    { "cfgpath",      'c', 0, G_OPTION_ARG_STRING, &config_path, "JSON config file path", "/opt/xilinx/kv260-defect-detect/share/vvas/"},
+    { "libpath",      'l', 0, G_OPTION_ARG_STRING, &lib_path, "Directory of the kernel libraries, vvas-library-repo of the JSON files by default", "path"},
+    { "fused",        'f', 0, G_OPTION_ARG_INT, &fused, "Measure the fused element instead of otsu, pre-process and CCA, value must be 1", "0"},
+    { "crosscheck",   'x', 0, G_OPTION_ARG_INT, &cross_check, "Check the tiled and bit mask CPU kernels against the whole-frame byte path instead of measuring, fails on any difference, value must be 1", "0"},
+    { NULL }
+};
+
+/*
+ * Heap allocations are counted by wrapping the glibc allocator; -rdynamic
+ * makes the wrappers visible to the dlopen'ed kernel libraries as well.
+ */
+extern "C" {
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t n, size_t size);
+void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 alloc_count;
+
+void *
+malloc (size_t size) {
+    __atomic_add_fetch (&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size) {
+    __atomic_add_fetch (&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr, size_t size) {
+    __atomic_add_fetch (&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc (ptr, size);
+}
+}
+
+static guint64
+allocs_now (void) {
+    return __atomic_load_n (&alloc_count, __ATOMIC_RELAXED);
+}
+
+/* Frame memory plus the GstBuffer the kernels find their meta on */
+static gboolean
+frame_init (VVASFrame *frame) {
+    memset (frame, 0, sizeof (VVASFrame));
+    frame->props.width = width;
+    frame->props.height = height;
+    frame->props.stride = (width + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+    frame->props.fmt = VVAS_VMFT_Y8;
+    frame->n_planes = 1;
+    frame->size[0] = frame->props.stride * height;
+    frame->vaddr[0] = aligned_alloc (FRAME_ALIGN, frame->size[0]);
+    frame->app_priv = gst_buffer_new ();
+    if (!frame->vaddr[0] || !frame->app_priv)
+        return FALSE;
+    memset (frame->vaddr[0], 0, frame->size[0]);
+    return TRUE;
+}
+
+static void
+frame_clear (VVASFrame *frame) {
+    free (frame->vaddr[0]);
+    if (frame->app_priv)
+        gst_buffer_unref ((GstBuffer *) frame->app_priv);
+}
+
+/* A bright ellipse on a dark belt with a few dark spots, moving with @seed */
+static void
+synth_frame (VVASFrame *frame, guint seed) {
+    uint8_t *p = (uint8_t *) frame->vaddr[0];
+    guint32 rng = 0x9e3779b9u * (seed + 1);
+    double cx = width * (0.45 + 0.01 * (seed % 10));
+    double cy = height * 0.5;
+    double rx = width * 0.25, ry = height * 0.3;
+    guint x, y, i;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *row = p + (size_t) y * frame->props.stride;
+        for (x = 0; x < width; x++) {
+            double dx = (x - cx) / rx, dy = (y - cy) / ry;
+            rng = rng * 1664525u + 1013904223u;
+            row[x] = (dx * dx + dy * dy <= 1.0 ? 170 : 30) + (rng >> 28);
+        }
+    }
+    for (i = 0; i < 1 + seed % 4; i++) {
+        gint sx = cx - rx / 2 + (i * 97 + seed * 31) % (guint) rx;
+        gint sy = cy - ry / 2 + (i * 53 + seed * 17) % (guint) ry;
+        gint r = 4 + (i + seed) % 12;
+        for (gint dy = -r; dy < r; dy++)
+            for (gint dx = -r; dx < r; dx++)
+                if (dx * dx + dy * dy < r * r && sx + dx >= 0 && sx + dx < (gint) width
+                    && sy + dy >= 0 && sy + dy < (gint) height)
+                    p[(size_t) (sy + dy) * frame->props.stride + sx + dx] = 50;
+    }
+}
+
+static gint
+load_frames (std::vector<VVASFrame> &frames) {
+    FILE *fp = NULL;
+    guint i, n = SYNTHETIC_FRAMES;
+
+    if (in_file) {
+        fp = fopen (in_file, "rb");
+        if (!fp) {
+            g_printerr ("Unable to open %s\n", in_file);
+            return -1;
+        }
+        n = MAX_RECORDED_FRAMES;
+    }
+    for (i = 0; i < n; i++) {
+        VVASFrame frame;
+        if (!frame_init (&frame)) {
+            g_printerr ("Unable to allocate frames\n");
+            if (fp)
+                fclose (fp);
+            return -1;
+        }
+        if (fp) {
+            guint y, got = 1;
+            for (y = 0; y < height && got; y++)
+                got = fread ((uint8_t *) frame.vaddr[0] + (size_t) y * frame.props.stride, width, 1, fp);
+            if (!got) {
+                frame_clear (&frame);
+                break;
+            }
+        } else {
+            synth_frame (&frame, i);
+        }
+        frames.push_back (frame);
+    }
+    if (fp)
+        fclose (fp);
+    if (frames.empty ()) {
+        g_printerr ("%s holds no complete %ux%u frame\n", in_file, width, height);
+        return -1;
+    }
+    return 0;
+}
+
+/* Noise of dark and bright pixels: many small holes, most of them cut by strip seams */
+static void
+speckle_frame (VVASFrame *frame, guint seed) {
+    guint32 rng = 0x85ebca6bu * (seed + 1);
+    guint x, y;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *row = (uint8_t *) frame->vaddr[0] + (size_t) y * frame->props.stride;
+        for (x = 0; x < width; x++) {
+            rng = rng * 1664525u + 1013904223u;
+            row[x] = (rng >> 24) < 64 + seed * 32 ? 20 : 220;
+        }
+    }
+}
+
+/* Pixel counts and defects of one CCA path */
+typedef struct _CcaResult {
+    uint32_t mango_pix;
+    uint32_t defect_pix;
+    std::vector<DDBlob> blobs;
+} CcaResult;
+
+static guint check_failures;
+
+static void
+check (gboolean same, guint frame, const gchar *what, const gchar *path) {
+    if (same)
+        return;
+    if (check_failures++ < MAX_REPORTED_DIFFS)
+        g_printerr ("frame %u: %s of %s differs from the whole-frame byte path\n", frame, what, path);
+}
+
+static gboolean
+same_rows (const uint8_t *a, const uint8_t *b, guint stride, guint row_bytes) {
+    guint y;
+    for (y = 0; y < height; y++) {
+        if (memcmp (a + (size_t) y * stride, b + (size_t) y * stride, row_bytes))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+cca_result (DDCcaCtx *ctx, gint ret, CcaResult *result) {
+    const DDBlob *blobs = NULL;
+    guint n = ret < 0 ? 0 : dd_cpu_cca_blobs (ctx, 0, &blobs);
+
+    result->blobs.assign (blobs, blobs + n);
+    /* blobs of the same area may come in any order */
+    std::sort (result->blobs.begin (), result->blobs.end (), [] (const DDBlob &a, const DDBlob &b) {
+        return a.area != b.area ? a.area > b.area : a.y0 != b.y0 ? a.y0 < b.y0 : a.x0 < b.x0;
+    });
+}
+
+static gboolean
+same_cca (const CcaResult &a, const CcaResult &b) {
+    size_t i;
+    if (a.mango_pix != b.mango_pix || a.defect_pix != b.defect_pix || a.blobs.size () != b.blobs.size ())
+        return FALSE;
+    for (i = 0; i < a.blobs.size (); i++) {
+        const DDBlob &p = a.blobs[i], &q = b.blobs[i];
+        if (p.area != q.area || p.x0 != q.x0 || p.y0 != q.y0 || p.x1 != q.x1 || p.y1 != q.y1 ||
+            fabsf (p.cx - q.cx) > 1e-3f || fabsf (p.cy - q.cy) > 1e-3f)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Runs blur and histogram, threshold and CCA of every frame whole on one
+ * thread with byte masks, then bit masks and strips on tilers of several
+ * sizes, and compares every output. Returns the number of differences.
+ */
+static guint
+cross_check_frames (std::vector<VVASFrame> &frames) {
+    /* threads, rows per strip: one strip per thread, single-row and odd strips */
+    static const guint tilings[][2] = { { 2, 0 }, { 3, 1 }, { 4, 7 }, { 8, 64 } };
+    guint stride = frames[0].props.stride, bits_stride = DD_MASK_BITS_STRIDE (width);
+    size_t size = (size_t) stride * height;
+    std::vector<uint8_t> blur (size), mask (size), out (size), blur_t (size), mask_t (size), out_t (size);
+    std::vector<uint8_t> scratch (dd_cpu_blur_scratch_size (width));
+    /* whole words, 8-byte aligned */
+    std::vector<uint64_t> bits (bits_stride / 8 * height), bits_t (bits_stride / 8 * height);
+    DDCcaCtx *ctx = dd_cpu_cca_new ();
+    guint32 hist[DD_HIST_BINS], hist_t[DD_HIST_BINS];
+    guint f, t, x, y, thr;
+
+    if (!ctx) {
+        g_printerr ("Unable to allocate the CCA context\n");
+        return 1;
+    }
+    for (f = 0; f < frames.size (); f++) {
+        const uint8_t *src = (const uint8_t *) frames[f].vaddr[0];
+        CcaResult ref, res;
+        gint ret;
+
+        dd_cpu_gaussian_hist (src, stride, blur.data (), stride, width, height, scratch.data (), hist);
+        thr = dd_cpu_otsu_threshold (hist);
+        dd_cpu_threshold (blur.data (), stride, mask.data (), stride, width, height, thr, 255);
+        ret = dd_cpu_cca (ctx, mask.data (), stride, out.data (), stride, width, height, DEFECT_PAINT_VALUE,
+                          &ref.mango_pix, &ref.defect_pix);
+        check (ret == 0, f, "labelling", "the byte mask");
+        cca_result (ctx, ret, &ref);
+
+        dd_cpu_threshold_bits (blur.data (), stride, (uint8_t *) bits.data (), bits_stride, width, height, thr);
+        for (y = 0; y < height; y++) {
+            const uint8_t *b = (const uint8_t *) bits.data () + (size_t) y * bits_stride;
+            for (x = 0; x < width && !(b[x / 8] >> (x % 8) & 1) == !mask[(size_t) y * stride + x]; x++)
+                ;
+            if (x < width)
+                break;
+        }
+        check (y == height, f, "the mask", "the bit threshold");
+        ret = dd_cpu_cca_bits (ctx, (const uint8_t *) bits.data (), bits_stride, out_t.data (), stride,
+                               width, height, 255, DEFECT_PAINT_VALUE, &res.mango_pix, &res.defect_pix);
+        cca_result (ctx, ret, &res);
+        check (ret == 0 && same_cca (ref, res), f, "counts and blobs", "the bit mask CCA");
+        check (same_rows (out.data (), out_t.data (), stride, width), f, "the output", "the bit mask CCA");
+
+        for (t = 0; t < G_N_ELEMENTS (tilings); t++) {
+            DDTiler *tiler = dd_tiler_new (tilings[t][0], tilings[t][1]);
+            gchar *path;
+
+            if (!tiler) {
+                g_printerr ("Unable to start a tiler\n");
+                check_failures++;
+                break;
+            }
+            path = g_strdup_printf ("%u threads, tile_rows %u", tilings[t][0], tilings[t][1]);
+
+            ret = dd_tiler_gaussian_hist (tiler, src, stride, blur_t.data (), stride, width, height, hist_t);
+            check (ret == 0 && same_rows (blur.data (), blur_t.data (), stride, width), f, "the blur", path);
+            check (ret == 0 && !memcmp (hist, hist_t, sizeof (hist)), f, "the blur histogram", path);
+            ret = dd_tiler_histogram (tiler, blur.data (), stride, width, height, hist_t);
+            check (ret == 0 && !memcmp (hist, hist_t, sizeof (hist)), f, "the histogram", path);
+
+            dd_tiler_threshold (tiler, blur.data (), stride, mask_t.data (), stride, width, height, thr, 255);
+            check (same_rows (mask.data (), mask_t.data (), stride, width), f, "the mask", path);
+            dd_tiler_threshold_bits (tiler, blur.data (), stride, (uint8_t *) bits_t.data (), bits_stride,
+                                     width, height, thr);
+            check (bits == bits_t, f, "the bit mask", path);
+
+            ret = dd_cpu_cca_tiled (ctx, tiler, mask.data (), stride, out_t.data (), stride, width, height,
+                                    DEFECT_PAINT_VALUE, &res.mango_pix, &res.defect_pix);
+            cca_result (ctx, ret, &res);
+            check (ret == 0 && same_cca (ref, res), f, "counts and blobs of the CCA", path);
+            check (same_rows (out.data (), out_t.data (), stride, width), f, "the CCA output", path);
+            ret = dd_cpu_cca_tiled_bits (ctx, tiler, (const uint8_t *) bits.data (), bits_stride, out_t.data (),
+                                         stride, width, height, 255, DEFECT_PAINT_VALUE,
+                                         &res.mango_pix, &res.defect_pix);
+            cca_result (ctx, ret, &res);
+            check (ret == 0 && same_cca (ref, res), f, "counts and blobs of the bit mask CCA", path);
+            check (same_rows (out.data (), out_t.data (), stride, width), f, "the bit mask CCA output", path);
+
+            g_free (path);
+            dd_tiler_free (tiler);
+        }
+    }
+    dd_cpu_cca_free (ctx);
+    return check_failures;
+}
+
+static gint
+stage_open (BenchStage *stage) {
+    std::string file = std::string (config_path) + "/" + stage->json_file;
+    std::string lib;
+    json_error_t error;
+    json_t *kernel, *config, *val;
+
+    stage->root = json_load_file (file.c_str (), JSON_DECODE_ANY, &error);
+    if (!stage->root) {
+        g_printerr ("Unable to load %s: %s\n", file.c_str (), error.text);
+        return -1;
+    }
+    kernel = json_array_get (json_object_get (stage->root, "kernels"), 0);
+    val = json_object_get (kernel, "library-name");
+    if (!kernel || !json_is_string (val)) {
+        g_printerr ("%s has no kernel library\n", file.c_str ());
+        return -1;
+    }
+    if (lib_path)
+        lib = lib_path;
+    else if (json_is_string (json_object_get (stage->root, "vvas-library-repo")))
+        lib = json_string_value (json_object_get (stage->root, "vvas-library-repo"));
+    lib += std::string ("/") + json_string_value (val);
+
+    config = json_object_get (kernel, "config");
+    if (!config) {
+        config = json_object ();
+        json_object_set_new (kernel, "config", config);
+    }
+    /* the mock handle has no device behind it */
+    json_object_set_new (config, "backend", json_string ("cpu"));
+
+    stage->lib = dlopen (lib.c_str (), RTLD_NOW | RTLD_LOCAL);
+    if (!stage->lib) {
+        g_printerr ("Unable to load %s: %s\n", lib.c_str (), dlerror ());
+        return -1;
+    }
+    stage->init = (KernelInitFunc) dlsym (stage->lib, "xlnx_kernel_init");
+    stage->deinit = (KernelDeinitFunc) dlsym (stage->lib, "xlnx_kernel_deinit");
+    stage->start = (KernelStartFunc) dlsym (stage->lib, "xlnx_kernel_start");
+    stage->done = (KernelDoneFunc) dlsym (stage->lib, "xlnx_kernel_done");
+    if (!stage->init || !stage->deinit || !stage->start || !stage->done) {
+        g_printerr ("%s does not export the vvas kernel interface\n", lib.c_str ());
+        return -1;
+    }
+
+    memset (&stage->handle, 0, sizeof (VVASKernel));
+    stage->handle.kernel_config = config;
+    stage->handle.name = (uint8_t *) stage->name;
+    if (stage->init (&stage->handle) < 0) {
+        g_printerr ("%s: xlnx_kernel_init failed\n", stage->name);
+        return -1;
+    }
+    if (!stage->inplace && !frame_init (&stage->out)) {
+        g_printerr ("Unable to allocate frames\n");
+        return -1;
+    }
+    stage->lat_ns.reserve (num_frames);
+    return 0;
+}
+
+static void
+stage_close (BenchStage *stage) {
+    if (stage->handle.kernel_priv)
+        stage->deinit (&stage->handle);
+    if (stage->lib)
+        dlclose (stage->lib);
+    if (!stage->inplace)
+        frame_clear (&stage->out);
+    if (stage->root)
+        json_decref (stage->root);
+}
+
+/* Runs one stage on @in, returns the frame the next stage consumes */
+static VVASFrame *
+stage_run (BenchStage *stage, VVASFrame *in, gboolean measure) {
+    VVASFrame *input[MAX_NUM_OBJECT] = { in };
+    VVASFrame *output[MAX_NUM_OBJECT] = { stage->inplace ? in : &stage->out };
+    guint64 allocs, start_ns;
+
+    /* vvas_xfilter copies the upstream meta onto the output buffer */
+    if (!stage->inplace)
+        gst_buffer_copy_into ((GstBuffer *) stage->out.app_priv, (GstBuffer *) in->app_priv,
+                              GST_BUFFER_COPY_META, 0, -1);
+    allocs = allocs_now ();
+    start_ns = gst_defect_meta_clock_ns ();
+    if (stage->start (&stage->handle, 0, input, output) < 0 || stage->done (&stage->handle) < 0) {
+        g_printerr ("%s failed\n", stage->name);
+        return NULL;
+    }
+    if (measure) {
+        stage->lat_ns.push_back (gst_defect_meta_clock_ns () - start_ns);
+        stage->allocs += allocs_now () - allocs;
+    }
+    return output[0];
+}
+
+static void
+report (const gchar *name, std::vector<guint64> &lat_ns, guint64 allocs) {
+    guint64 total = 0;
+    size_t n = lat_ns.size ();
+
+    if (!n)
+        return;
+    std::sort (lat_ns.begin (), lat_ns.end ());
+    for (guint64 v : lat_ns)
+        total += v;
+    printf ("%-14s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %12.2f\n", name,
+            total / 1000.0 / n, lat_ns[n / 2] / 1000.0, lat_ns[n * 9 / 10] / 1000.0,
+            lat_ns[n * 99 / 100] / 1000.0, lat_ns[n - 1] / 1000.0,
+            n * 1e9 / total, (double) allocs / n);
+}
+
+gint
+main (int argc, char **argv) {
+    BenchStage stages[] = {
+        { "otsu",          OTSU_ACC_JSON_FILE,        FALSE },
+        { "pre-process",   PRE_PROCESS_JSON_FILE,     FALSE },
+        { "cca",           CCA_ACC_JSON_FILE,         FALSE },
+        { "fused",         FUSED_JSON_FILE,           FALSE },
+        { "text2overlay",  TEXT_2_OVERLAY_JSON_FILE,  TRUE  },
+    };
+    const guint num_stages = G_N_ELEMENTS (stages);
+    std::vector<VVASFrame> frames;
+    std::vector<guint64> chain_ns;
+    guint64 chain_allocs = 0;
+    GOptionContext *optctx;
+    GError *error = NULL;
+    gint ret = 0;
+    guint i, s;
+
+    gst_init (&argc, &argv);
+    optctx = g_option_context_new ("- Benchmark of the defect-detect kernel libraries on the CPU");
+    g_option_context_add_main_entries (optctx, entries, NULL);
+    if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (optctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (optctx);
+
+    if (!width || !height || !num_frames) {
+        g_printerr ("Width, height and frames must not be 0\n");
+        return -1;
+    }
+    if (load_frames (frames) < 0)
+        return -1;
+
+    if (cross_check) {
+        guint failures, n = frames.size ();
+        for (i = 0; i < SPECKLE_FRAMES; i++) {
+            VVASFrame frame;
+            if (!frame_init (&frame)) {
+                g_printerr ("Unable to allocate frames\n");
+                ret = -1;
+                goto CLOSE;
+            }
+            speckle_frame (&frame, i);
+            frames.push_back (frame);
+        }
+        failures = cross_check_frames (frames);
+        printf ("%u frames of %ux%u, %u speckled, cpu simd %s: %u differences\n", n, width, height,
+                SPECKLE_FRAMES, dd_cpu_simd_name (), failures);
+        ret = failures ? -1 : 0;
+        goto CLOSE;
+    }
+
+    /* either the three separate stages or the fused one, then the overlay */
+    for (s = 0; s < num_stages; s++) {
+        gboolean is_fused = !strcmp (stages[s].name, "fused");
+        if (is_fused != (gboolean) !!fused && strcmp (stages[s].name, "text2overlay"))
+            continue;
+        if (stage_open (&stages[s]) < 0) {
+            ret = -1;
+            goto CLOSE;
+        }
+    }
+
+    chain_ns.reserve (num_frames);
+    for (i = 0; i < WARMUP_FRAMES + num_frames; i++) {
+        gboolean measure = i >= WARMUP_FRAMES;
+        VVASFrame *frame = &frames[i % frames.size ()];
+        guint64 allocs = allocs_now ();
+        guint64 start_ns = gst_defect_meta_clock_ns ();
+        for (s = 0; s < num_stages && frame; s++) {
+            if (stages[s].lib)
+                frame = stage_run (&stages[s], frame, measure);
+        }
+        if (!frame) {
+            ret = -1;
+            goto CLOSE;
+        }
+        if (measure) {
+            chain_ns.push_back (gst_defect_meta_clock_ns () - start_ns);
+            chain_allocs += allocs_now () - allocs;
+        }
+    }
+
+    printf ("%u frames of %ux%u, %s input\n", num_frames, width, height, in_file ? in_file : "synthetic");
+    printf ("%-14s %10s %10s %10s %10s %10s %10s %12s\n", "stage", "mean_us", "p50_us", "p90_us",
+            "p99_us", "max_us", "fps", "allocs/frame");
+    for (s = 0; s < num_stages; s++)
+        report (stages[s].name, stages[s].lat_ns, stages[s].allocs);
+    report ("chain", chain_ns, chain_allocs);
+
+CLOSE:
+    for (s = 0; s < num_stages; s++)
+        stage_close (&stages[s]);
+    for (VVASFrame &frame : frames)
+        frame_clear (&frame);
+    return ret;
+}
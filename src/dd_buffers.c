@@ -0,0 +1,153 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <vvas/xrt_utils.h>
+#include "dd_buffers.h"
+#include "dd_stats.h"
+
+typedef struct {
+    /* handed out, its address stays put when the table grows */
+    VVASFrame *frame;
+    xrt_buffer xbuf;
+    uint32_t size;
+    uint16_t bank;
+    int in_use;
+} DDBufferEntry;
+
+/* a handful of buffers per element, linear scans are fine */
+static pthread_mutex_t dd_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static DDBufferEntry *dd_entries;
+static int dd_num_entries, dd_cap_entries;
+/* owns every buffer of the pool, open while there are users */
+static xclDeviceHandle dd_device;
+static int dd_users;
+
+int
+dd_buffers_attach (void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock (&dd_buffers_lock);
+    if (!dd_users && vvas_xrt_open_device (DD_BUFFERS_DEVICE, &dd_device) < 0)
+        ret = -1;
+    else
+        dd_users++;
+    pthread_mutex_unlock (&dd_buffers_lock);
+    return ret;
+}
+
+void
+dd_buffers_detach (void)
+{
+    int i;
+
+    pthread_mutex_lock (&dd_buffers_lock);
+    if (!dd_users || --dd_users > 0) {
+        pthread_mutex_unlock (&dd_buffers_lock);
+        return;
+    }
+    for (i = 0; i < dd_num_entries; i++) {
+        DDBufferEntry *e = &dd_entries[i];
+        if (e->in_use)
+            dd_stats_buffer_return (e->size);
+        dd_stats_buffer_free (e->size);
+        vvas_xrt_free_xrt_buffer (&e->xbuf);
+        free (e->frame);
+    }
+    dd_num_entries = 0;
+    vvas_xrt_close_device (dd_device);
+    dd_device = NULL;
+    pthread_mutex_unlock (&dd_buffers_lock);
+}
+
+VVASFrame *
+dd_buffer_get (uint32_t size, uint16_t bank)
+{
+    DDBufferEntry *best = NULL, *e;
+    VVASFrame *frame;
+    int i;
+
+    pthread_mutex_lock (&dd_buffers_lock);
+    if (!dd_users) {
+        pthread_mutex_unlock (&dd_buffers_lock);
+        return NULL;
+    }
+    for (i = 0; i < dd_num_entries; i++) {
+        e = &dd_entries[i];
+        if (e->in_use || e->bank != bank || e->size < size || e->size / 2 > size)
+            continue;
+        if (!best || e->size < best->size)
+            best = e;
+    }
+    if (best) {
+        best->in_use = 1;
+        dd_stats_buffer_lease (best->size, 1);
+        pthread_mutex_unlock (&dd_buffers_lock);
+        return best->frame;
+    }
+
+    if (dd_num_entries == dd_cap_entries) {
+        int cap = dd_cap_entries ? 2 * dd_cap_entries : 16;
+        DDBufferEntry *entries = (DDBufferEntry *) realloc (dd_entries, cap * sizeof (DDBufferEntry));
+        if (!entries) {
+            pthread_mutex_unlock (&dd_buffers_lock);
+            return NULL;
+        }
+        dd_entries = entries;
+        dd_cap_entries = cap;
+    }
+    e = &dd_entries[dd_num_entries];
+    frame = (VVASFrame *) calloc (1, sizeof (VVASFrame));
+    if (!frame || vvas_xrt_alloc_xrt_buffer (dd_device, size, XCL_BO_FLAGS_NONE, bank, &e->xbuf) < 0) {
+        free (frame);
+        pthread_mutex_unlock (&dd_buffers_lock);
+        return NULL;
+    }
+    frame->vaddr[0] = e->xbuf.user_ptr;
+    frame->paddr[0] = e->xbuf.phy_addr;
+    frame->size[0] = size;
+    frame->n_planes = 1;
+    frame->mem_type = VVAS_INTERNAL_MEMORY;
+    e->frame = frame;
+    e->size = size;
+    e->bank = bank;
+    e->in_use = 1;
+    dd_num_entries++;
+    dd_stats_buffer_alloc (size);
+    dd_stats_buffer_lease (size, 0);
+    pthread_mutex_unlock (&dd_buffers_lock);
+    return frame;
+}
+
+void
+dd_buffer_put (VVASFrame *buf)
+{
+    int i;
+
+    if (!buf)
+        return;
+    pthread_mutex_lock (&dd_buffers_lock);
+    for (i = 0; i < dd_num_entries; i++) {
+        if (dd_entries[i].frame == buf && dd_entries[i].in_use) {
+            dd_entries[i].in_use = 0;
+            dd_stats_buffer_return (dd_entries[i].size);
+            break;
+        }
+    }
+    pthread_mutex_unlock (&dd_buffers_lock);
+}
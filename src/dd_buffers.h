@@ -0,0 +1,70 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Process-wide pool of device buffers for the kernel libraries.
+ *
+ * libdd_buffers.so is shared by every element of every stream, like
+ * libdd_stats.so. Each vvas_xfilter opens a device handle of its own, so
+ * the pool opens one as well, DD_BUFFERS_DEVICE, and allocates every
+ * buffer on it from an explicit memory bank. The accelerators are given
+ * physical addresses, so a buffer serves commands of any element. Buffers
+ * are never freed while an element uses the pool: dd_buffer_put() only
+ * returns them, and the next dd_buffer_get() of the same bank with a size
+ * that fits takes them again. Scratch that is leased for one command only,
+ * between the submit and the wait, is then bounded by the number of
+ * commands in flight rather than by the number of elements.
+ * Allocations and leases are counted in the "buffers" entry of
+ * dd_stats_dump().
+ */
+
+#ifndef __DD_BUFFERS_H__
+#define __DD_BUFFERS_H__
+
+#include <stdint.h>
+#include <vvas/vvas_kernel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The xclbin runs on the one device of the board, vvas_xfilter's default dev-idx */
+#define DD_BUFFERS_DEVICE   0
+
+/*
+ * Counts a user of the pool and opens its device handle for the first.
+ * Returns -1 when the device cannot be opened, the caller is not counted.
+ */
+int dd_buffers_attach (void);
+
+/* Frees the pooled buffers and closes the device handle when the last user goes */
+void dd_buffers_detach (void);
+
+/*
+ * Leases a buffer of at least @size bytes in @bank, reusing a returned one
+ * when its size is within twice @size. The frame has the one plane
+ * vaddr[0]/paddr[0]. Returns NULL when device memory is exhausted.
+ */
+VVASFrame *dd_buffer_get (uint32_t size, uint16_t bank);
+
+/* Returns a buffer of dd_buffer_get() to the pool, NULL is ignored */
+void dd_buffer_put (VVASFrame *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DD_BUFFERS_H__ */
@@ -0,0 +1,606 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dd_capture.h"
+
+#define DD_CAPTURE_MAGIC        "DDCAPv1"
+#define DD_CAPTURE_INDEX_MAGIC  "DDCAPidx"
+#define DD_CAPTURE_FRAME_MAGIC  0x4d415246      /* "FRAM" */
+#define DD_CAPTURE_HEADER_SIZE  32
+#define DD_CAPTURE_RECORD_SIZE  56
+#define DD_CAPTURE_TRAILER_SIZE 24
+/* stdio buffer of the file, records go out in few large writes */
+#define DD_CAPTURE_FILE_BUFFER  (4 << 20)
+
+/* LZ4 block format, see lz4_Block_format.md of the LZ4 project */
+#define LZ_HASH_BITS            14
+#define LZ_MIN_MATCH            4
+#define LZ_LAST_LITERALS        5
+#define LZ_MFLIMIT              12
+#define LZ_MAX_OFFSET           65535
+
+static void
+put32 (uint8_t *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void
+put64 (uint8_t *p, uint64_t v)
+{
+    put32 (p, (uint32_t) v);
+    put32 (p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t
+get32 (const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+get64 (const uint8_t *p)
+{
+    return get32 (p) | ((uint64_t) get32 (p + 4) << 32);
+}
+
+size_t
+dd_capture_bound (size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static uint32_t
+read32 (const uint8_t *p)
+{
+    uint32_t v;
+    memcpy (&v, p, 4);
+    return v;
+}
+
+static uint8_t *
+lz_put_length (uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+/* One sequence: literals, then a match unless @match_len is 0 (the last one) */
+static uint8_t *
+lz_sequence (uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = (uint8_t) (((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15)
+        op = lz_put_length (op, lit_len - 15);
+    memcpy (op, lit, lit_len);
+    op += lit_len;
+    if (!match_len)
+        return op;
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    if (ml >= 15)
+        op = lz_put_length (op, ml - 15);
+    return op;
+}
+
+/*
+ * Greedy single-probe matcher. Misses make the step grow with the distance
+ * to the last match, so noisy frames are skimmed rather than searched.
+ */
+size_t
+dd_capture_lz_encode (const uint8_t *src, size_t n, uint8_t *dst)
+{
+    int32_t table[1 << LZ_HASH_BITS];
+    size_t ip = 0, anchor = 0;
+    uint8_t *op = dst;
+
+    if (n > LZ_MFLIMIT) {
+        size_t mflimit = n - LZ_MFLIMIT, match_end = n - LZ_LAST_LITERALS;
+        memset (table, 0xff, sizeof (table));
+        while (ip < mflimit) {
+            uint32_t seq = read32 (src + ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+            int32_t ref = table[h];
+            size_t len = LZ_MIN_MATCH;
+
+            table[h] = (int32_t) ip;
+            if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32 (src + ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip + len < match_end && src[ref + len] == src[ip + len])
+                len++;
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+                len++;
+            }
+            op = lz_sequence (op, src + anchor, ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+    }
+    return lz_sequence (op, src + anchor, n - anchor, 0, 0) - dst;
+}
+
+static int
+lz_get_length (const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    unsigned b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+size_t
+dd_capture_lz_decode (const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *end = src + n;
+    size_t o = 0;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, len = token & 15, offset;
+
+        if (lit == 15 && lz_get_length (&ip, end, &lit) < 0)
+            return 0;
+        if (lit > (size_t) (end - ip) || lit > cap - o)
+            return 0;
+        memcpy (dst + o, ip, lit);
+        ip += lit;
+        o += lit;
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return 0;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (len == 15 && lz_get_length (&ip, end, &len) < 0)
+            return 0;
+        len += LZ_MIN_MATCH;
+        if (!offset || offset > o || len > cap - o)
+            return 0;
+        if (offset >= len) {
+            memcpy (dst + o, dst + o - offset, len);
+        } else {
+            size_t i;
+            for (i = 0; i < len; i++)
+                dst[o + i] = dst[o - offset + i];
+        }
+        o += len;
+    }
+    return o;
+}
+
+/* A queued frame, the pixels are a packed copy owned by the writer */
+typedef struct {
+    uint8_t *pixels;
+    DDCaptureRecord record;
+} DDCaptureJob;
+
+struct _DDCaptureWriter {
+    FILE *fp;
+    uint32_t width, height;
+    DDCaptureCodec codec;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* ring of queued frames, pixels of all slots in one allocation */
+    DDCaptureJob *jobs;
+    uint8_t *slots;
+    uint32_t cap, head, count;
+    int stop, failed;
+    /* writer thread only */
+    uint8_t *out;
+    uint64_t *offsets;
+    size_t n_offsets, cap_offsets;
+    uint64_t pos;
+    DDCaptureStats stats;
+};
+
+static void
+encode_record (uint8_t *p, uint32_t codec, uint32_t size, uint32_t raw_size, const DDCaptureRecord *r)
+{
+    put32 (p, DD_CAPTURE_FRAME_MAGIC);
+    put32 (p + 4, codec);
+    put32 (p + 8, size);
+    put32 (p + 12, raw_size);
+    put64 (p + 16, r->index);
+    put64 (p + 24, r->pts_ns);
+    put64 (p + 32, r->capture_ns);
+    put32 (p + 40, r->flags);
+    put32 (p + 44, r->otsu_thr);
+    put32 (p + 48, r->mango_pix);
+    put32 (p + 52, r->defect_pix);
+}
+
+static void
+decode_record (const uint8_t *p, DDCaptureRecord *r)
+{
+    r->index = get64 (p + 16);
+    r->pts_ns = get64 (p + 24);
+    r->capture_ns = get64 (p + 32);
+    r->flags = get32 (p + 40);
+    r->otsu_thr = get32 (p + 44);
+    r->mango_pix = get32 (p + 48);
+    r->defect_pix = get32 (p + 52);
+}
+
+static int
+write_frame (DDCaptureWriter *w, const DDCaptureJob *job)
+{
+    size_t raw_size = (size_t) w->width * w->height, size;
+    const uint8_t *src = job->pixels;
+    uint8_t header[DD_CAPTURE_RECORD_SIZE];
+    uint32_t codec = w->codec;
+
+    if (codec == DD_CAPTURE_LZ)
+        size = dd_capture_lz_encode (src, raw_size, w->out);
+    else
+        size = raw_size;
+    if (size >= raw_size) {
+        codec = DD_CAPTURE_STORE;
+        size = raw_size;
+    } else {
+        src = w->out;
+    }
+
+    if (w->n_offsets == w->cap_offsets) {
+        size_t cap = w->cap_offsets ? 2 * w->cap_offsets : 1024;
+        uint64_t *offsets = (uint64_t *) realloc (w->offsets, cap * sizeof (uint64_t));
+        if (!offsets)
+            return -1;
+        w->offsets = offsets;
+        w->cap_offsets = cap;
+    }
+    encode_record (header, codec, (uint32_t) size, (uint32_t) raw_size, &job->record);
+    if (fwrite (header, sizeof (header), 1, w->fp) != 1 || fwrite (src, size, 1, w->fp) != 1)
+        return -1;
+    w->offsets[w->n_offsets++] = w->pos;
+    w->pos += sizeof (header) + size;
+    w->stats.raw_bytes += raw_size;
+    w->stats.written_bytes += sizeof (header) + size;
+    w->stats.frames++;
+    return 0;
+}
+
+static void *
+writer_thread (void *arg)
+{
+    DDCaptureWriter *w = (DDCaptureWriter *) arg;
+    DDCaptureJob job;
+    int failed = 0;
+
+    for (;;) {
+        pthread_mutex_lock (&w->lock);
+        while (!w->count && !w->stop)
+            pthread_cond_wait (&w->cond, &w->lock);
+        if (!w->count) {
+            pthread_mutex_unlock (&w->lock);
+            break;
+        }
+        job = w->jobs[w->head];
+        pthread_mutex_unlock (&w->lock);
+
+        if (!failed && write_frame (w, &job) < 0)
+            failed = 1;
+
+        /* the slot is free only now, push() does not overwrite a frame being written */
+        pthread_mutex_lock (&w->lock);
+        w->head = (w->head + 1) % w->cap;
+        w->count--;
+        w->failed = failed;
+        pthread_mutex_unlock (&w->lock);
+    }
+    return NULL;
+}
+
+DDCaptureWriter *
+dd_capture_writer_new (const char *path, uint32_t width, uint32_t height, DDCaptureCodec codec,
+                       uint32_t queue_frames)
+{
+    DDCaptureWriter *w = (DDCaptureWriter *) calloc (1, sizeof (DDCaptureWriter));
+    uint8_t header[DD_CAPTURE_HEADER_SIZE];
+    size_t raw_size = (size_t) width * height;
+    uint32_t i;
+
+    if (!w)
+        return NULL;
+    w->width = width;
+    w->height = height;
+    w->codec = codec;
+    w->cap = queue_frames ? queue_frames : 1;
+    w->jobs = (DDCaptureJob *) calloc (w->cap, sizeof (DDCaptureJob));
+    w->slots = (uint8_t *) malloc (w->cap * raw_size);
+    w->out = (uint8_t *) malloc (dd_capture_bound (raw_size));
+    w->fp = fopen (path, "wb");
+    if (!w->jobs || !w->slots || !w->out || !w->fp)
+        goto fail;
+    for (i = 0; i < w->cap; i++)
+        w->jobs[i].pixels = w->slots + i * raw_size;
+    setvbuf (w->fp, NULL, _IOFBF, DD_CAPTURE_FILE_BUFFER);
+
+    memset (header, 0, sizeof (header));
+    memcpy (header, DD_CAPTURE_MAGIC, sizeof (DD_CAPTURE_MAGIC));
+    put32 (header + 8, width);
+    put32 (header + 12, height);
+    put32 (header + 16, codec);
+    if (fwrite (header, sizeof (header), 1, w->fp) != 1)
+        goto fail;
+    w->pos = sizeof (header);
+
+    pthread_mutex_init (&w->lock, NULL);
+    pthread_cond_init (&w->cond, NULL);
+    if (pthread_create (&w->thread, NULL, writer_thread, w) != 0) {
+        pthread_cond_destroy (&w->cond);
+        pthread_mutex_destroy (&w->lock);
+        goto fail;
+    }
+    return w;
+
+fail:
+    if (w->fp)
+        fclose (w->fp);
+    free (w->out);
+    free (w->slots);
+    free (w->jobs);
+    free (w);
+    return NULL;
+}
+
+int
+dd_capture_writer_push (DDCaptureWriter *w, const uint8_t *pixels, uint32_t stride,
+                        const DDCaptureRecord *record)
+{
+    DDCaptureJob *job;
+    uint32_t y;
+
+    pthread_mutex_lock (&w->lock);
+    if (w->count == w->cap || w->failed) {
+        w->stats.dropped++;
+        pthread_mutex_unlock (&w->lock);
+        return -1;
+    }
+    job = &w->jobs[(w->head + w->count) % w->cap];
+    pthread_mutex_unlock (&w->lock);
+
+    /* the slot past the queued ones is not touched by the writer thread */
+    for (y = 0; y < w->height; y++)
+        memcpy (job->pixels + (size_t) y * w->width, pixels + (size_t) y * stride, w->width);
+    job->record = *record;
+
+    pthread_mutex_lock (&w->lock);
+    w->count++;
+    pthread_cond_signal (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+    return 0;
+}
+
+int
+dd_capture_writer_free (DDCaptureWriter *w, DDCaptureStats *stats)
+{
+    uint8_t trailer[DD_CAPTURE_TRAILER_SIZE], entry[8];
+    size_t i;
+    int ret;
+
+    if (!w)
+        return 0;
+    pthread_mutex_lock (&w->lock);
+    w->stop = 1;
+    pthread_cond_signal (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+    pthread_join (w->thread, NULL);
+
+    ret = w->failed ? -1 : 0;
+    for (i = 0; i < w->n_offsets && ret == 0; i++) {
+        put64 (entry, w->offsets[i]);
+        if (fwrite (entry, sizeof (entry), 1, w->fp) != 1)
+            ret = -1;
+    }
+    put64 (trailer, w->pos);
+    put64 (trailer + 8, w->n_offsets);
+    memcpy (trailer + 16, DD_CAPTURE_INDEX_MAGIC, 8);
+    if (ret == 0 && fwrite (trailer, sizeof (trailer), 1, w->fp) != 1)
+        ret = -1;
+    if (fclose (w->fp) != 0)
+        ret = -1;
+    if (stats)
+        *stats = w->stats;
+
+    pthread_cond_destroy (&w->cond);
+    pthread_mutex_destroy (&w->lock);
+    free (w->offsets);
+    free (w->out);
+    free (w->slots);
+    free (w->jobs);
+    free (w);
+    return ret;
+}
+
+struct _DDCaptureReader {
+    FILE *fp;
+    uint32_t width, height;
+    uint64_t *offsets;
+    uint64_t frames;
+    uint8_t *in;
+    size_t in_size;
+};
+
+static int
+read_index (DDCaptureReader *r, uint64_t file_size)
+{
+    uint8_t trailer[DD_CAPTURE_TRAILER_SIZE], entry[8];
+    uint64_t index, frames, i;
+
+    if (file_size < DD_CAPTURE_HEADER_SIZE + DD_CAPTURE_TRAILER_SIZE ||
+        fseeko (r->fp, (off_t) (file_size - DD_CAPTURE_TRAILER_SIZE), SEEK_SET) != 0 ||
+        fread (trailer, sizeof (trailer), 1, r->fp) != 1 ||
+        memcmp (trailer + 16, DD_CAPTURE_INDEX_MAGIC, 8) != 0)
+        return -1;
+    index = get64 (trailer);
+    frames = get64 (trailer + 8);
+    if (index < DD_CAPTURE_HEADER_SIZE || index + frames * 8 + DD_CAPTURE_TRAILER_SIZE != file_size ||
+        fseeko (r->fp, (off_t) index, SEEK_SET) != 0)
+        return -1;
+    r->offsets = (uint64_t *) malloc ((frames ? frames : 1) * sizeof (uint64_t));
+    if (!r->offsets)
+        return -1;
+    for (i = 0; i < frames; i++) {
+        if (fread (entry, sizeof (entry), 1, r->fp) != 1)
+            return -1;
+        r->offsets[i] = get64 (entry);
+    }
+    r->frames = frames;
+    return 0;
+}
+
+/* A capture cut short has no index, the complete records are found by walking them */
+static int
+scan_records (DDCaptureReader *r, uint64_t file_size)
+{
+    uint8_t header[DD_CAPTURE_RECORD_SIZE];
+    uint64_t pos = DD_CAPTURE_HEADER_SIZE, cap = 0;
+
+    free (r->offsets);
+    r->offsets = NULL;
+    r->frames = 0;
+    while (pos + sizeof (header) <= file_size) {
+        uint64_t next;
+        if (fseeko (r->fp, (off_t) pos, SEEK_SET) != 0 || fread (header, sizeof (header), 1, r->fp) != 1 ||
+            get32 (header) != DD_CAPTURE_FRAME_MAGIC)
+            break;
+        next = pos + sizeof (header) + get32 (header + 8);
+        if (next > file_size)
+            break;
+        if (r->frames == cap) {
+            uint64_t *offsets;
+            cap = cap ? 2 * cap : 1024;
+            offsets = (uint64_t *) realloc (r->offsets, cap * sizeof (uint64_t));
+            if (!offsets)
+                return -1;
+            r->offsets = offsets;
+        }
+        r->offsets[r->frames++] = pos;
+        pos = next;
+    }
+    return 0;
+}
+
+DDCaptureReader *
+dd_capture_reader_open (const char *path)
+{
+    DDCaptureReader *r = (DDCaptureReader *) calloc (1, sizeof (DDCaptureReader));
+    uint8_t header[DD_CAPTURE_HEADER_SIZE];
+    uint64_t file_size;
+
+    if (!r)
+        return NULL;
+    r->fp = fopen (path, "rb");
+    if (!r->fp || fread (header, sizeof (header), 1, r->fp) != 1 ||
+        memcmp (header, DD_CAPTURE_MAGIC, sizeof (DD_CAPTURE_MAGIC)) != 0 ||
+        fseeko (r->fp, 0, SEEK_END) != 0)
+        goto fail;
+    r->width = get32 (header + 8);
+    r->height = get32 (header + 12);
+    file_size = (uint64_t) ftello (r->fp);
+    if (read_index (r, file_size) < 0 && scan_records (r, file_size) < 0)
+        goto fail;
+    return r;
+
+fail:
+    dd_capture_reader_close (r);
+    return NULL;
+}
+
+void
+dd_capture_reader_close (DDCaptureReader *r)
+{
+    if (!r)
+        return;
+    if (r->fp)
+        fclose (r->fp);
+    free (r->offsets);
+    free (r->in);
+    free (r);
+}
+
+uint64_t
+dd_capture_reader_frames (const DDCaptureReader *r)
+{
+    return r->frames;
+}
+
+void
+dd_capture_reader_size (const DDCaptureReader *r, uint32_t *width, uint32_t *height)
+{
+    *width = r->width;
+    *height = r->height;
+}
+
+int
+dd_capture_reader_read (DDCaptureReader *r, uint64_t n, uint8_t *pixels, DDCaptureRecord *record)
+{
+    uint8_t header[DD_CAPTURE_RECORD_SIZE];
+    size_t raw_size = (size_t) r->width * r->height, size;
+    uint32_t codec;
+
+    if (n >= r->frames || fseeko (r->fp, (off_t) r->offsets[n], SEEK_SET) != 0 ||
+        fread (header, sizeof (header), 1, r->fp) != 1 || get32 (header) != DD_CAPTURE_FRAME_MAGIC ||
+        get32 (header + 12) != raw_size)
+        return -1;
+    codec = get32 (header + 4);
+    size = get32 (header + 8);
+    if (size > r->in_size) {
+        uint8_t *in = (uint8_t *) realloc (r->in, size);
+        if (!in)
+            return -1;
+        r->in = in;
+        r->in_size = size;
+    }
+    if (size && fread (r->in, size, 1, r->fp) != 1)
+        return -1;
+    switch (codec) {
+        case DD_CAPTURE_STORE:
+            if (size != raw_size)
+                return -1;
+            memcpy (pixels, r->in, size);
+            break;
+        case DD_CAPTURE_LZ:
+            if (dd_capture_lz_decode (r->in, size, pixels, raw_size) != raw_size)
+                return -1;
+            break;
+        default:
+            return -1;
+    }
+    if (record)
+        decode_record (header, record);
+    return 0;
+}
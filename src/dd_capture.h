@@ -0,0 +1,117 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Capture files of the raw, pre-process and final outputs.
+ *
+ * A capture file is a 32 byte header, one record per frame and, once the
+ * writer is closed, an index of the record offsets with a trailer at the
+ * very end. Every record holds the frame's verdicts and its pixels
+ * compressed on their own, so any frame can be read back alone. A file
+ * whose writer did not close has no index; the reader then finds the
+ * records by scanning. All fields are little endian.
+ *
+ *   header   "DDCAPv1\0", u32 width, u32 height, u32 codec, u32 0, u64 0
+ *   record   u32 "FRAM", u32 codec, u32 size, u32 raw size,
+ *            DDCaptureRecord, size bytes of pixels
+ *   index    u64 record offset per frame
+ *   trailer  u64 index offset, u64 frames, "DDCAPidx"
+ *
+ * Frames are compressed and written on a thread of the writer. The
+ * streaming thread only copies the frame into the writer's queue, so no
+ * buffer of the pipeline is held; when the queue is full the frame is
+ * dropped from the capture rather than holding up the pipeline.
+ */
+
+#ifndef __DD_CAPTURE_H__
+#define __DD_CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    DD_CAPTURE_STORE,       /* uncompressed */
+    DD_CAPTURE_LZ,          /* LZ4 block format */
+} DDCaptureCodec;
+
+/* Per-frame record, flags and counts as in the GstDefectMeta of the frame */
+typedef struct _DDCaptureRecord {
+    uint64_t index;
+    uint64_t pts_ns;
+    uint64_t capture_ns;
+    uint32_t flags;
+    uint32_t otsu_thr;
+    uint32_t mango_pix;
+    uint32_t defect_pix;
+} DDCaptureRecord;
+
+typedef struct _DDCaptureStats {
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t raw_bytes;
+    uint64_t written_bytes;
+} DDCaptureStats;
+
+typedef struct _DDCaptureWriter DDCaptureWriter;
+typedef struct _DDCaptureReader DDCaptureReader;
+
+/*
+ * Creates @path and the writer thread. Up to @queue_frames frames wait to
+ * be written, at least 1. @codec is what the frames are compressed with; a
+ * frame that does not get smaller is stored. Returns NULL on error.
+ */
+DDCaptureWriter *dd_capture_writer_new (const char *path, uint32_t width, uint32_t height,
+                                        DDCaptureCodec codec, uint32_t queue_frames);
+
+/*
+ * Queues a copy of a frame of @stride bytes per row. Frames are pushed from
+ * one thread at a time. Returns -1 when the frame was dropped because the
+ * queue is full or writing failed.
+ */
+int dd_capture_writer_push (DDCaptureWriter *writer, const uint8_t *pixels, uint32_t stride,
+                            const DDCaptureRecord *record);
+
+/* Writes the queued frames and the index, closes the file and fills @stats when not NULL */
+int dd_capture_writer_free (DDCaptureWriter *writer, DDCaptureStats *stats);
+
+/* Opens a capture file for random access, NULL on error */
+DDCaptureReader *dd_capture_reader_open (const char *path);
+void dd_capture_reader_close (DDCaptureReader *reader);
+
+uint64_t dd_capture_reader_frames (const DDCaptureReader *reader);
+void dd_capture_reader_size (const DDCaptureReader *reader, uint32_t *width, uint32_t *height);
+
+/* Reads frame @n into @pixels, width * height bytes, and its record when @record is not NULL */
+int dd_capture_reader_read (DDCaptureReader *reader, uint64_t n, uint8_t *pixels, DDCaptureRecord *record);
+
+/*
+ * The codec on its own. The bound is the largest output for @n input
+ * bytes. Decoding returns the decoded size, or 0 when @src is malformed or
+ * does not fit @cap.
+ */
+size_t dd_capture_bound (size_t n);
+size_t dd_capture_lz_encode (const uint8_t *src, size_t n, uint8_t *dst);
+size_t dd_capture_lz_decode (const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DD_CAPTURE_H__ */
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "dd_config.h"
+
+static pthread_mutex_t dd_config_lock = PTHREAD_MUTEX_INITIALIZER;
+static json_t *dd_configs[DD_CONFIG_NUM_KERNELS];
+/* bumped under the lock, read without it on every frame */
+static uint64_t dd_generations[DD_CONFIG_NUM_KERNELS];
+
+/* What each kernel applies in its *_reload(), NULL terminated */
+static const char *dd_reloadable[DD_CONFIG_NUM_KERNELS][8] = {
+    { "debug_level", "hist_step", "otsu_alpha", "otsu_tolerance", NULL },
+    { "debug_level", "max_value", NULL },
+    { "debug_level", "max_blobs", "min_blob_area", NULL },
+    { "debug_level", "max_value", "threshold_mode", "max_blobs", "min_blob_area", NULL },
+    { "debug_level", "defect_threshold", "is_acc_result", "x_offset", "y_offset", "font", "font_size", NULL },
+};
+
+void
+dd_config_publish (DDConfigKernel kernel, json_t *config)
+{
+    json_t *old;
+
+    json_incref (config);
+    pthread_mutex_lock (&dd_config_lock);
+    old = dd_configs[kernel];
+    dd_configs[kernel] = config;
+    __atomic_store_n (&dd_generations[kernel], dd_generations[kernel] + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&dd_config_lock);
+    json_decref (old);
+}
+
+json_t *
+dd_config_update (DDConfigKernel kernel, uint64_t *generation)
+{
+    json_t *config;
+
+    if (__atomic_load_n (&dd_generations[kernel], __ATOMIC_ACQUIRE) == *generation)
+        return NULL;
+    /* every element gets its own copy, the reference counts are not shared between threads */
+    pthread_mutex_lock (&dd_config_lock);
+    config = json_deep_copy (dd_configs[kernel]);
+    *generation = dd_generations[kernel];
+    pthread_mutex_unlock (&dd_config_lock);
+    return config;
+}
+
+int
+dd_config_reloadable (DDConfigKernel kernel, const char *key)
+{
+    const char *const *k;
+
+    for (k = dd_reloadable[kernel]; *k; k++)
+        if (!strcmp (*k, key))
+            return 1;
+    return 0;
+}
+
+int
+dd_config_int (const json_t *config, const char *key, int64_t min, int64_t max, int64_t *value)
+{
+    const json_t *val = json_object_get (config, key);
+
+    if (!val)
+        return 0;
+    if (!json_is_integer (val) || json_integer_value (val) < min || json_integer_value (val) > max)
+        return -1;
+    *value = json_integer_value (val);
+    return 0;
+}
+
+int
+dd_config_number (const json_t *config, const char *key, double min, double max, double *value)
+{
+    const json_t *val = json_object_get (config, key);
+
+    if (!val)
+        return 0;
+    if (!json_is_number (val) || json_number_value (val) < min || json_number_value (val) > max)
+        return -1;
+    *value = json_number_value (val);
+    return 0;
+}
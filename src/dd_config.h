@@ -0,0 +1,74 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Kernel configuration changed while the pipeline runs.
+ *
+ * libdd_config.so is shared by the application, which reads the JSON file
+ * of a kernel again when it changes and publishes its "config" object, and
+ * the kernel libraries, which look for a newer one at the start of every
+ * frame. Looking is one atomic load. A kernel takes an update as a whole,
+ * checks every key it can change before applying any, and applies it
+ * between two frames, so no frame is processed with part of an update and
+ * none is dropped. Keys that set up devices, pools or threads keep their
+ * startup value, see dd_config_reloadable().
+ */
+
+#ifndef __DD_CONFIG_H__
+#define __DD_CONFIG_H__
+
+#include <stdint.h>
+#include <jansson.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    DD_CONFIG_OTSU,
+    DD_CONFIG_PREPROCESS,
+    DD_CONFIG_CCA,
+    DD_CONFIG_FUSED,
+    DD_CONFIG_OVERLAY,
+    DD_CONFIG_NUM_KERNELS,
+} DDConfigKernel;
+
+/* Publishes @config for the elements of @kernel of all streams, a reference is taken */
+void dd_config_publish (DDConfigKernel kernel, json_t *config);
+
+/*
+ * Returns a copy of the config published for @kernel after the one
+ * *@generation refers to and updates it, NULL when there is none.
+ * *@generation starts at 0. The caller frees the copy with json_decref().
+ */
+json_t *dd_config_update (DDConfigKernel kernel, uint64_t *generation);
+
+/* Whether @key of @kernel is applied while running */
+int dd_config_reloadable (DDConfigKernel kernel, const char *key);
+
+/*
+ * Reads @key of @config into @value when it is an integer, or for _number
+ * any number, from @min to @max. Returns 0 when it was read or is absent,
+ * leaving @value as it was, and -1 when it is invalid.
+ */
+int dd_config_int (const json_t *config, const char *key, int64_t min, int64_t max, int64_t *value);
+int dd_config_number (const json_t *config, const char *key, double min, double max, double *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DD_CONFIG_H__ */
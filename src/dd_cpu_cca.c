@@ -0,0 +1,705 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dd_cpu_kernels.h"
+
+#define DD_ONES64       0x0101010101010101ULL
+#define DD_HIGHS64      0x8080808080808080ULL
+
+/* Background run [x0, x1] of one row and the label it was given */
+typedef struct {
+    uint32_t x0, x1;
+    uint32_t label;
+} DDRun;
+
+/* Per-label accumulator, only meaningful on union-find roots */
+typedef struct {
+    uint32_t area;
+    uint32_t x0, y0, x1, y1;
+    uint64_t sum_x, sum_y;
+    uint32_t border;
+} DDAcc;
+
+struct _DDCcaCtx {
+    uint32_t width, height, y;
+    /* first row of a strip of dd_cpu_cca_tiled(), and the frame height */
+    uint32_t y_base, frame_height;
+    /* offset of the labels of a strip in the merged union-find */
+    uint32_t label_base;
+    /* rows are bit masks, see DD_MASK_BITS_STRIDE() */
+    int bits;
+    DDRun *runs;
+    uint32_t n_runs, cap_runs;
+    uint32_t *row_start;
+    uint32_t cap_rows;
+    uint32_t *parent;
+    DDAcc *acc;
+    uint32_t n_labels, cap_labels;
+    DDBlob *blobs;
+    uint32_t n_blobs, cap_blobs;
+    /* strip labellers of dd_cpu_cca_tiled() */
+    DDCcaCtx **strips;
+    uint32_t cap_strips;
+};
+
+static int
+grow (void **ptr, uint32_t *cap, uint32_t need, size_t elem)
+{
+    uint32_t ncap;
+    void *p;
+    if (need <= *cap)
+        return 0;
+    ncap = *cap ? *cap : 1024;
+    while (ncap < need)
+        ncap *= 2;
+    p = realloc (*ptr, (size_t) ncap * elem);
+    if (!p)
+        return -1;
+    *ptr = p;
+    *cap = ncap;
+    return 0;
+}
+
+DDCcaCtx *
+dd_cpu_cca_new (void)
+{
+    return (DDCcaCtx *) calloc (1, sizeof (DDCcaCtx));
+}
+
+void
+dd_cpu_cca_free (DDCcaCtx *ctx)
+{
+    uint32_t i;
+
+    if (!ctx)
+        return;
+    for (i = 0; i < ctx->cap_strips; i++)
+        dd_cpu_cca_free (ctx->strips[i]);
+    free (ctx->strips);
+    free (ctx->runs);
+    free (ctx->row_start);
+    free (ctx->parent);
+    free (ctx->acc);
+    free (ctx->blobs);
+    free (ctx);
+}
+
+static inline uint64_t
+load64 (const uint8_t *p)
+{
+    uint64_t v;
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+/* Appends the zero-valued runs of @row, skipping uniform 8-byte words */
+static int
+extract_runs (DDCcaCtx *ctx, const uint8_t *row, uint32_t width)
+{
+    uint32_t x = 0, start;
+    while (x < width) {
+        /* skip fruit: words without any zero byte */
+        while (x + 8 <= width) {
+            uint64_t v = load64 (row + x);
+            if ((v - DD_ONES64) & ~v & DD_HIGHS64)
+                break;
+            x += 8;
+        }
+        while (x < width && row[x])
+            x++;
+        if (x >= width)
+            break;
+
+        start = x;
+        while (x + 8 <= width && load64 (row + x) == 0)
+            x += 8;
+        while (x < width && !row[x])
+            x++;
+
+        if (grow ((void **) &ctx->runs, &ctx->cap_runs, ctx->n_runs + 1, sizeof (DDRun)) < 0)
+            return -1;
+        ctx->runs[ctx->n_runs].x0 = start;
+        ctx->runs[ctx->n_runs].x1 = x - 1;
+        ctx->n_runs++;
+    }
+    return 0;
+}
+
+static int
+push_run (DDCcaCtx *ctx, uint32_t x0, uint32_t x1)
+{
+    if (grow ((void **) &ctx->runs, &ctx->cap_runs, ctx->n_runs + 1, sizeof (DDRun)) < 0)
+        return -1;
+    ctx->runs[ctx->n_runs].x0 = x0;
+    ctx->runs[ctx->n_runs].x1 = x1;
+    ctx->n_runs++;
+    return 0;
+}
+
+/*
+ * Appends the zero runs of a bit mask row. A run is ended and started by
+ * counting trailing zeros of the word shifted to the current bit, so each
+ * run costs a few instructions whatever its length; words of all fruit
+ * outside a run and all scene inside one are skipped whole.
+ */
+static int
+extract_runs_bits (DDCcaCtx *ctx, const uint8_t *row, uint32_t width)
+{
+    uint32_t w, words = DD_MASK_BITS_STRIDE (width) / 8, start = 0;
+    int open = 0;
+
+    for (w = 0; w < words; w++) {
+        uint64_t fg = load64 (row + w * 8);
+        uint32_t pos = 0;
+        /* past the width counts as fruit, closing a run at the edge */
+        if ((w + 1) * 64 > width)
+            fg |= ~0ULL << (width - w * 64);
+        if (fg == (open ? 0 : ~0ULL))
+            continue;
+        while (pos < 64) {
+            uint64_t v = open ? fg >> pos : ~fg >> pos;
+            if (!v)
+                break;
+            pos += __builtin_ctzll (v);
+            if (open && push_run (ctx, start, w * 64 + pos - 1) < 0)
+                return -1;
+            start = w * 64 + pos;
+            open = !open;
+        }
+    }
+    if (open && push_run (ctx, start, width - 1) < 0)
+        return -1;
+    return 0;
+}
+
+static inline uint32_t
+find (uint32_t *parent, uint32_t i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static inline void
+acc_fold (DDAcc *ra, const DDAcc *rb)
+{
+    ra->area += rb->area;
+    ra->sum_x += rb->sum_x;
+    ra->sum_y += rb->sum_y;
+    ra->border |= rb->border;
+    if (rb->x0 < ra->x0) ra->x0 = rb->x0;
+    if (rb->y0 < ra->y0) ra->y0 = rb->y0;
+    if (rb->x1 > ra->x1) ra->x1 = rb->x1;
+    if (rb->y1 > ra->y1) ra->y1 = rb->y1;
+}
+
+static void
+merge (DDCcaCtx *ctx, uint32_t a, uint32_t b)
+{
+    a = find (ctx->parent, a);
+    b = find (ctx->parent, b);
+    if (a == b)
+        return;
+    /* keep the older label as root */
+    if (b < a) {
+        uint32_t t = a;
+        a = b;
+        b = t;
+    }
+    ctx->parent[b] = a;
+    acc_fold (&ctx->acc[a], &ctx->acc[b]);
+}
+
+static int
+new_label (DDCcaCtx *ctx)
+{
+    uint32_t need = ctx->n_labels + 1;
+    uint32_t cap = ctx->cap_labels;
+    if (grow ((void **) &ctx->parent, &cap, need, sizeof (uint32_t)) < 0)
+        return -1;
+    cap = ctx->cap_labels;
+    if (grow ((void **) &ctx->acc, &cap, need, sizeof (DDAcc)) < 0)
+        return -1;
+    ctx->cap_labels = cap;
+    ctx->parent[ctx->n_labels] = ctx->n_labels;
+    memset (&ctx->acc[ctx->n_labels], 0, sizeof (DDAcc));
+    ctx->acc[ctx->n_labels].x0 = UINT32_MAX;
+    ctx->acc[ctx->n_labels].y0 = UINT32_MAX;
+    return ctx->n_labels++;
+}
+
+static void
+add_run (DDCcaCtx *ctx, const DDRun *r, uint32_t y, uint32_t width, uint32_t height)
+{
+    DDAcc *a = &ctx->acc[find (ctx->parent, r->label)];
+    uint32_t len = r->x1 - r->x0 + 1;
+    a->area += len;
+    a->sum_x += (uint64_t) (r->x0 + r->x1) * len / 2;
+    a->sum_y += (uint64_t) y * len;
+    if (r->x0 < a->x0) a->x0 = r->x0;
+    if (r->x1 > a->x1) a->x1 = r->x1;
+    if (y < a->y0) a->y0 = y;
+    if (y > a->y1) a->y1 = y;
+    if (y == 0 || y == height - 1 || r->x0 == 0 || r->x1 == width - 1)
+        a->border = 1;
+}
+
+static int
+cmp_blob_area (const void *a, const void *b)
+{
+    const DDBlob *ba = (const DDBlob *) a, *bb = (const DDBlob *) b;
+    if (ba->area != bb->area)
+        return ba->area < bb->area ? 1 : -1;
+    if (ba->y0 != bb->y0)
+        return ba->y0 < bb->y0 ? -1 : 1;
+    return ba->x0 < bb->x0 ? -1 : (ba->x0 > bb->x0);
+}
+
+/* Labels @rows rows from @y_base on of a @frame_height row frame */
+static int
+cca_begin_strip (DDCcaCtx *ctx, uint32_t width, uint32_t frame_height, uint32_t y_base, uint32_t rows)
+{
+    ctx->width = width;
+    ctx->height = rows;
+    ctx->y_base = y_base;
+    ctx->frame_height = frame_height;
+    ctx->bits = 0;
+    ctx->y = 0;
+    ctx->n_runs = 0;
+    ctx->n_labels = 0;
+    ctx->n_blobs = 0;
+    return grow ((void **) &ctx->row_start, &ctx->cap_rows, rows + 1, sizeof (uint32_t));
+}
+
+int
+dd_cpu_cca_begin (DDCcaCtx *ctx, uint32_t width, uint32_t height)
+{
+    return cca_begin_strip (ctx, width, height, 0, height);
+}
+
+int
+dd_cpu_cca_push_row (DDCcaCtx *ctx, const uint8_t *row)
+{
+    uint32_t i, y = ctx->y;
+    uint32_t cur = ctx->n_runs;
+    uint32_t j = y ? ctx->row_start[y - 1] : 0;
+    uint32_t prev_end = cur;
+
+    ctx->row_start[y] = cur;
+    if ((ctx->bits ? extract_runs_bits (ctx, row, ctx->width) : extract_runs (ctx, row, ctx->width)) < 0)
+        return -1;
+
+    for (i = cur; i < ctx->n_runs; i++) {
+        DDRun *r = &ctx->runs[i];
+        int label = -1;
+        /* runs of the previous row overlapping [x0, x1] share the label */
+        while (j < prev_end && ctx->runs[j].x1 < r->x0)
+            j++;
+        while (j < prev_end && ctx->runs[j].x0 <= r->x1) {
+            if (label < 0)
+                label = ctx->runs[j].label;
+            else
+                merge (ctx, label, ctx->runs[j].label);
+            if (ctx->runs[j].x1 > r->x1)
+                break;
+            j++;
+        }
+        if (label < 0 && (label = new_label (ctx)) < 0)
+            return -1;
+        r->label = label;
+        add_run (ctx, r, ctx->y_base + y, ctx->width, ctx->frame_height);
+    }
+    ctx->y++;
+    return 0;
+}
+
+/* Sorts the roots into scene and holes, the holes become the blobs */
+static int
+cca_classify (DDCcaCtx *ctx, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    uint32_t i, scene = 0, holes = 0;
+
+    ctx->n_blobs = 0;
+    for (i = 0; i < ctx->n_labels; i++) {
+        DDAcc *a = &ctx->acc[i];
+        DDBlob *b;
+        if (ctx->parent[i] != i)
+            continue;
+        if (a->border) {
+            scene += a->area;
+            continue;
+        }
+        holes += a->area;
+        if (grow ((void **) &ctx->blobs, &ctx->cap_blobs, ctx->n_blobs + 1, sizeof (DDBlob)) < 0)
+            return -1;
+        b = &ctx->blobs[ctx->n_blobs++];
+        b->area = a->area;
+        b->x0 = a->x0;
+        b->y0 = a->y0;
+        b->x1 = a->x1;
+        b->y1 = a->y1;
+        b->cx = (float) ((double) a->sum_x / a->area);
+        b->cy = (float) ((double) a->sum_y / a->area);
+    }
+    qsort (ctx->blobs, ctx->n_blobs, sizeof (DDBlob), cmp_blob_area);
+
+    *mango_pix = ctx->width * ctx->frame_height - scene;
+    *defect_pix = holes;
+    return 0;
+}
+
+int
+dd_cpu_cca_end (DDCcaCtx *ctx, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    ctx->row_start[ctx->y] = ctx->n_runs;
+    /* a frame that ended early counts the rows it got */
+    ctx->frame_height = ctx->y;
+    return cca_classify (ctx, mango_pix, defect_pix);
+}
+
+/* Fills one output row from the stored runs: fruit, scene (0) and holes */
+static void
+render_row (DDCcaCtx *ctx, uint32_t y, uint8_t *d, uint8_t defect_value)
+{
+    uint32_t i;
+    for (i = ctx->row_start[y]; i < ctx->row_start[y + 1]; i++) {
+        const DDRun *r = &ctx->runs[i];
+        uint8_t v = ctx->acc[find (ctx->parent, r->label)].border ? 0 : defect_value;
+        memset (d + r->x0, v, r->x1 - r->x0 + 1);
+    }
+}
+
+void
+dd_cpu_cca_render (DDCcaCtx *ctx, uint8_t *dst, uint32_t dst_stride,
+                   uint8_t fg_value, uint8_t defect_value)
+{
+    uint32_t y;
+    for (y = 0; y < ctx->y; y++) {
+        uint8_t *d = dst + (size_t) y * dst_stride;
+        memset (d, fg_value, ctx->width);
+        render_row (ctx, y, d, defect_value);
+    }
+}
+
+int
+dd_cpu_cca (DDCcaCtx *ctx, const uint8_t *src, uint32_t src_stride,
+            uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+            uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    uint32_t y;
+
+    if (dd_cpu_cca_begin (ctx, width, height) < 0)
+        return -1;
+    for (y = 0; y < height; y++) {
+        if (dd_cpu_cca_push_row (ctx, src + (size_t) y * src_stride) < 0)
+            return -1;
+    }
+    if (dd_cpu_cca_end (ctx, mango_pix, defect_pix) < 0)
+        return -1;
+
+    if (dst) {
+        for (y = 0; y < height; y++) {
+            uint8_t *d = dst + (size_t) y * dst_stride;
+            uint32_t i;
+            memcpy (d, src + (size_t) y * src_stride, width);
+            /* scene runs are already 0 in the mask, only paint the holes */
+            for (i = ctx->row_start[y]; i < ctx->row_start[y + 1]; i++) {
+                const DDRun *r = &ctx->runs[i];
+                if (!ctx->acc[find (ctx->parent, r->label)].border)
+                    memset (d + r->x0, defect_value, r->x1 - r->x0 + 1);
+            }
+        }
+    }
+    return 0;
+}
+
+int
+dd_cpu_cca_bits (DDCcaCtx *ctx, const uint8_t *bits, uint32_t bits_stride,
+                 uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                 uint8_t fg_value, uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    uint32_t y;
+
+    if (dd_cpu_cca_begin (ctx, width, height) < 0)
+        return -1;
+    ctx->bits = 1;
+    for (y = 0; y < height; y++) {
+        if (dd_cpu_cca_push_row (ctx, bits + (size_t) y * bits_stride) < 0)
+            return -1;
+    }
+    if (dd_cpu_cca_end (ctx, mango_pix, defect_pix) < 0)
+        return -1;
+    if (dst)
+        dd_cpu_cca_render (ctx, dst, dst_stride, fg_value, defect_value);
+    return 0;
+}
+
+uint32_t
+dd_cpu_cca_blobs (DDCcaCtx *ctx, uint32_t min_area, const DDBlob **blobs)
+{
+    uint32_t n = 0;
+    /* sorted by area, so the qualifying blobs are a prefix */
+    while (n < ctx->n_blobs && ctx->blobs[n].area >= min_area)
+        n++;
+    *blobs = ctx->blobs;
+    return n;
+}
+
+typedef struct {
+    DDCcaCtx *ctx;
+    const uint8_t *src;
+    uint32_t src_stride;
+    uint8_t *dst;
+    uint32_t dst_stride;
+    uint32_t width, height, rows;
+    int bits;
+    uint8_t fg_value;
+    uint8_t defect_value;
+    int failed;
+} DDCcaTiles;
+
+static void
+label_strip (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDCcaTiles *t = (DDCcaTiles *) arg;
+    DDCcaCtx *s = t->ctx->strips[tile];
+    uint32_t y, y0 = tile * t->rows;
+    uint32_t n = y0 + t->rows < t->height ? t->rows : t->height - y0;
+
+    (void) worker;
+    if (cca_begin_strip (s, t->width, t->height, y0, n) < 0) {
+        __atomic_store_n (&t->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    s->bits = t->bits;
+    for (y = 0; y < n; y++) {
+        if (dd_cpu_cca_push_row (s, t->src + (size_t) (y0 + y) * t->src_stride) < 0) {
+            __atomic_store_n (&t->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    s->row_start[s->y] = s->n_runs;
+}
+
+/*
+ * Union-find shared by the workers merging the seams. Roots are only ever
+ * linked below a smaller label with a CAS, so parents strictly decrease
+ * along a path and there are no cycles; path halving may race with a link
+ * but always writes an ancestor.
+ */
+static inline uint32_t
+find_shared (uint32_t *parent, uint32_t i)
+{
+    for (;;) {
+        uint32_t p = __atomic_load_n (&parent[i], __ATOMIC_ACQUIRE);
+        uint32_t gp;
+        if (p == i)
+            return i;
+        gp = __atomic_load_n (&parent[p], __ATOMIC_ACQUIRE);
+        if (gp != p)
+            __atomic_compare_exchange_n (&parent[i], &p, gp, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        i = gp;
+    }
+}
+
+static void
+union_shared (uint32_t *parent, uint32_t a, uint32_t b)
+{
+    for (;;) {
+        uint32_t expected;
+        a = find_shared (parent, a);
+        b = find_shared (parent, b);
+        if (a == b)
+            return;
+        if (b < a) {
+            uint32_t t = a;
+            a = b;
+            b = t;
+        }
+        expected = b;
+        if (__atomic_compare_exchange_n (&parent[b], &expected, a, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return;
+    }
+}
+
+/* Moves the labels of a strip into the frame's union-find, flattened */
+static void
+gather_strip (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDCcaTiles *t = (DDCcaTiles *) arg;
+    DDCcaCtx *ctx = t->ctx, *s = ctx->strips[tile];
+    uint32_t i, base = s->label_base;
+
+    (void) worker;
+    for (i = 0; i < s->n_labels; i++) {
+        uint32_t root = find (s->parent, i);
+        ctx->parent[base + i] = base + root;
+        ctx->acc[base + i] = s->acc[i];
+        /* only strip roots carry an accumulator, mark the others empty */
+        if (root != i)
+            ctx->acc[base + i].area = 0;
+    }
+}
+
+/* Joins the background runs that touch across the seam above strip @tile */
+static void
+merge_seam (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDCcaTiles *t = (DDCcaTiles *) arg;
+    DDCcaCtx *ctx = t->ctx;
+    const DDCcaCtx *a = ctx->strips[tile], *b = ctx->strips[tile + 1];
+    uint32_t i = a->row_start[a->y - 1], end_a = a->row_start[a->y];
+    uint32_t j = b->row_start[0], end_b = b->row_start[1];
+
+    (void) worker;
+    while (i < end_a && j < end_b) {
+        const DDRun *ra = &a->runs[i], *rb = &b->runs[j];
+        if (ra->x0 <= rb->x1 && rb->x0 <= ra->x1)
+            union_shared (ctx->parent, a->label_base + ra->label, b->label_base + rb->label);
+        if (ra->x1 < rb->x1)
+            i++;
+        else
+            j++;
+    }
+}
+
+/* Copies the mask of a strip and paints its holes; a bit mask is rendered from the runs */
+static void
+paint_strip (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDCcaTiles *t = (DDCcaTiles *) arg;
+    DDCcaCtx *ctx = t->ctx, *s = ctx->strips[tile];
+    uint32_t y, i;
+
+    (void) worker;
+    for (y = 0; y < s->y; y++) {
+        uint8_t *d = t->dst + (size_t) (s->y_base + y) * t->dst_stride;
+        if (t->bits)
+            memset (d, t->fg_value, t->width);
+        else
+            memcpy (d, t->src + (size_t) (s->y_base + y) * t->src_stride, t->width);
+        for (i = s->row_start[y]; i < s->row_start[y + 1]; i++) {
+            const DDRun *r = &s->runs[i];
+            if (!ctx->acc[find_shared (ctx->parent, s->label_base + r->label)].border)
+                memset (d + r->x0, t->defect_value, r->x1 - r->x0 + 1);
+            else if (t->bits)
+                memset (d + r->x0, 0, r->x1 - r->x0 + 1);
+        }
+    }
+}
+
+/*
+ * Every strip is labelled on its own by a worker of the pool, with border
+ * flags set for the frame border only. The labels of all strips are then
+ * gathered in one union-find, offset by strip, and the workers merge the
+ * runs of the rows meeting at each seam without locks. The accumulators of
+ * the strip roots that got linked are folded into their frame root last,
+ * which completes the components cut by the seams before they are sorted
+ * into scene and holes.
+ */
+static int
+cca_tiled (DDCcaTiles *tp, DDTiler *tiler, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    DDCcaTiles t = *tp;
+    DDCcaCtx *ctx = t.ctx;
+    uint32_t width = t.width, height = t.height;
+    uint32_t strips = dd_tiler_strips (tiler, height, &t.rows);
+    uint32_t s, i, total = 0, cap;
+
+    if (strips < 2 && t.bits)
+        return dd_cpu_cca_bits (ctx, t.src, t.src_stride, t.dst, t.dst_stride, width, height,
+                                t.fg_value, t.defect_value, mango_pix, defect_pix);
+    if (strips < 2)
+        return dd_cpu_cca (ctx, t.src, t.src_stride, t.dst, t.dst_stride, width, height,
+                           t.defect_value, mango_pix, defect_pix);
+
+    if (strips > ctx->cap_strips) {
+        DDCcaCtx **p = (DDCcaCtx **) realloc (ctx->strips, strips * sizeof (DDCcaCtx *));
+        if (!p)
+            return -1;
+        ctx->strips = p;
+        for (; ctx->cap_strips < strips; ctx->cap_strips++) {
+            ctx->strips[ctx->cap_strips] = dd_cpu_cca_new ();
+            if (!ctx->strips[ctx->cap_strips])
+                return -1;
+        }
+    }
+    dd_tiler_run (tiler, strips, label_strip, &t);
+    if (__atomic_load_n (&t.failed, __ATOMIC_RELAXED))
+        return -1;
+
+    for (s = 0; s < strips; s++) {
+        ctx->strips[s]->label_base = total;
+        total += ctx->strips[s]->n_labels;
+    }
+    cap = ctx->cap_labels;
+    if (grow ((void **) &ctx->parent, &cap, total, sizeof (uint32_t)) < 0)
+        return -1;
+    cap = ctx->cap_labels;
+    if (grow ((void **) &ctx->acc, &cap, total, sizeof (DDAcc)) < 0)
+        return -1;
+    ctx->cap_labels = cap;
+    ctx->n_labels = total;
+
+    dd_tiler_run (tiler, strips, gather_strip, &t);
+    dd_tiler_run (tiler, strips - 1, merge_seam, &t);
+    for (i = 0; i < total; i++) {
+        uint32_t root;
+        if (!ctx->acc[i].area)
+            continue;
+        root = find (ctx->parent, i);
+        if (root != i) {
+            acc_fold (&ctx->acc[root], &ctx->acc[i]);
+            ctx->acc[i].area = 0;
+        }
+    }
+
+    /* the runs stay in the strips, dd_cpu_cca_render() has no rows to draw */
+    ctx->width = width;
+    ctx->height = ctx->frame_height = height;
+    ctx->y = ctx->y_base = 0;
+    ctx->n_runs = 0;
+    if (cca_classify (ctx, mango_pix, defect_pix) < 0)
+        return -1;
+
+    if (t.dst)
+        dd_tiler_run (tiler, strips, paint_strip, &t);
+    return 0;
+}
+
+int
+dd_cpu_cca_tiled (DDCcaCtx *ctx, DDTiler *tiler, const uint8_t *src, uint32_t src_stride,
+                  uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                  uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    DDCcaTiles t = { ctx, src, src_stride, dst, dst_stride, width, height, 0, 0, 0, defect_value, 0 };
+
+    return cca_tiled (&t, tiler, mango_pix, defect_pix);
+}
+
+int
+dd_cpu_cca_tiled_bits (DDCcaCtx *ctx, DDTiler *tiler, const uint8_t *bits, uint32_t bits_stride,
+                       uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                       uint8_t fg_value, uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix)
+{
+    DDCcaTiles t = { ctx, bits, bits_stride, dst, dst_stride, width, height, 0, 1, fg_value, defect_value, 0 };
+
+    return cca_tiled (&t, tiler, mango_pix, defect_pix);
+}
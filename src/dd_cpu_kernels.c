@@ -0,0 +1,754 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include "dd_cpu_kernels.h"
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define DD_HAVE_NEON 1
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#define DD_HAVE_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define DD_HAVE_AVX2 1
+#define DD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+typedef void (*DDBlurRowFunc) (const uint8_t *a, const uint8_t *b, const uint8_t *c,
+                               uint16_t *vrow, uint8_t *out, uint32_t width);
+typedef void (*DDThresholdRowFunc) (const uint8_t *src, uint8_t *dst, uint32_t width,
+                                    uint8_t thresh, uint8_t max_value);
+typedef void (*DDThresholdBitsRowFunc) (const uint8_t *src, uint64_t *bits, uint32_t width,
+                                        uint8_t thresh);
+
+static pthread_once_t dd_cpu_once = PTHREAD_ONCE_INIT;
+static DDBlurRowFunc dd_blur_row;
+static DDThresholdRowFunc dd_threshold_row;
+static DDThresholdBitsRowFunc dd_threshold_bits_row;
+static const char *dd_simd_name;
+
+int
+dd_backend_from_string (const char *str)
+{
+    if (!str)
+        return -1;
+    if (!strcmp (str, "fpga"))
+        return DD_BACKEND_FPGA;
+    if (!strcmp (str, "cpu"))
+        return DD_BACKEND_CPU;
+    if (!strcmp (str, "auto"))
+        return DD_BACKEND_AUTO;
+    if (!strcmp (str, "shared"))
+        return DD_BACKEND_SHARED;
+    return -1;
+}
+
+const char *
+dd_backend_to_string (DDBackend backend)
+{
+    switch (backend) {
+        case DD_BACKEND_FPGA:
+            return "fpga";
+        case DD_BACKEND_CPU:
+            return "cpu";
+        case DD_BACKEND_AUTO:
+            return "auto";
+        case DD_BACKEND_SHARED:
+            return "shared";
+    }
+    return "unknown";
+}
+
+int
+dd_cu_pool_acquire (DDCuPool *pool, DDBackend backend, int num_cu)
+{
+    int n;
+
+    if (backend == DD_BACKEND_CPU)
+        return 0;
+    if (backend != DD_BACKEND_SHARED) {
+        __atomic_add_fetch (&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+        return 1;
+    }
+    n = __atomic_load_n (&pool->in_flight, __ATOMIC_ACQUIRE);
+    do {
+        if (n >= num_cu)
+            return 0;
+    } while (!__atomic_compare_exchange_n (&pool->in_flight, &n, n + 1, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+void
+dd_cu_pool_release (DDCuPool *pool)
+{
+    __atomic_sub_fetch (&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Blur one output row. a, b and c are the source rows above, at and below
+ * the output row. The vertical [1 2 1] sum goes to vrow[1..width] and the
+ * borders are mirrored (BORDER_REFLECT_101) before the horizontal pass.
+ */
+static inline void
+blur_row_borders (uint16_t *vrow, uint32_t width)
+{
+    vrow[0] = vrow[2];
+    vrow[width + 1] = vrow[width - 1];
+}
+
+static void
+blur_row_c (const uint8_t *a, const uint8_t *b, const uint8_t *c,
+            uint16_t *vrow, uint8_t *out, uint32_t width)
+{
+    uint32_t x;
+    for (x = 0; x < width; x++)
+        vrow[x + 1] = a[x] + 2 * b[x] + c[x];
+    blur_row_borders (vrow, width);
+    for (x = 0; x < width; x++)
+        out[x] = (vrow[x] + 2 * vrow[x + 1] + vrow[x + 2] + 8) >> 4;
+}
+
+#ifdef DD_HAVE_NEON
+static void
+blur_row_neon (const uint8_t *a, const uint8_t *b, const uint8_t *c,
+               uint16_t *vrow, uint8_t *out, uint32_t width)
+{
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t va = vld1q_u8 (a + x);
+        uint8x16_t vb = vld1q_u8 (b + x);
+        uint8x16_t vc = vld1q_u8 (c + x);
+        uint16x8_t lo = vaddq_u16 (vaddl_u8 (vget_low_u8 (va), vget_low_u8 (vc)),
+                                   vshll_n_u8 (vget_low_u8 (vb), 1));
+        uint16x8_t hi = vaddq_u16 (vaddl_u8 (vget_high_u8 (va), vget_high_u8 (vc)),
+                                   vshll_n_u8 (vget_high_u8 (vb), 1));
+        vst1q_u16 (vrow + x + 1, lo);
+        vst1q_u16 (vrow + x + 9, hi);
+    }
+    for (; x < width; x++)
+        vrow[x + 1] = a[x] + 2 * b[x] + c[x];
+    blur_row_borders (vrow, width);
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t l = vld1q_u16 (vrow + x);
+        uint16x8_t m = vld1q_u16 (vrow + x + 1);
+        uint16x8_t r = vld1q_u16 (vrow + x + 2);
+        uint16x8_t s = vaddq_u16 (vaddq_u16 (l, r), vshlq_n_u16 (m, 1));
+        vst1_u8 (out + x, vrshrn_n_u16 (s, 4));
+    }
+    for (; x < width; x++)
+        out[x] = (vrow[x] + 2 * vrow[x + 1] + vrow[x + 2] + 8) >> 4;
+}
+#endif
+
+#ifdef DD_HAVE_SSE2
+static void
+blur_row_sse2 (const uint8_t *a, const uint8_t *b, const uint8_t *c,
+               uint16_t *vrow, uint8_t *out, uint32_t width)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i round = _mm_set1_epi16 (8);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128 ((const __m128i *)(a + x));
+        __m128i vb = _mm_loadu_si128 ((const __m128i *)(b + x));
+        __m128i vc = _mm_loadu_si128 ((const __m128i *)(c + x));
+        __m128i lo = _mm_add_epi16 (_mm_add_epi16 (_mm_unpacklo_epi8 (va, zero),
+                                                   _mm_unpacklo_epi8 (vc, zero)),
+                                    _mm_slli_epi16 (_mm_unpacklo_epi8 (vb, zero), 1));
+        __m128i hi = _mm_add_epi16 (_mm_add_epi16 (_mm_unpackhi_epi8 (va, zero),
+                                                   _mm_unpackhi_epi8 (vc, zero)),
+                                    _mm_slli_epi16 (_mm_unpackhi_epi8 (vb, zero), 1));
+        _mm_storeu_si128 ((__m128i *)(vrow + x + 1), lo);
+        _mm_storeu_si128 ((__m128i *)(vrow + x + 9), hi);
+    }
+    for (; x < width; x++)
+        vrow[x + 1] = a[x] + 2 * b[x] + c[x];
+    blur_row_borders (vrow, width);
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i s0 = _mm_add_epi16 (_mm_add_epi16 (_mm_loadu_si128 ((const __m128i *)(vrow + x)),
+                                                   _mm_loadu_si128 ((const __m128i *)(vrow + x + 2))),
+                                    _mm_slli_epi16 (_mm_loadu_si128 ((const __m128i *)(vrow + x + 1)), 1));
+        __m128i s1 = _mm_add_epi16 (_mm_add_epi16 (_mm_loadu_si128 ((const __m128i *)(vrow + x + 8)),
+                                                   _mm_loadu_si128 ((const __m128i *)(vrow + x + 10))),
+                                    _mm_slli_epi16 (_mm_loadu_si128 ((const __m128i *)(vrow + x + 9)), 1));
+        s0 = _mm_srli_epi16 (_mm_add_epi16 (s0, round), 4);
+        s1 = _mm_srli_epi16 (_mm_add_epi16 (s1, round), 4);
+        _mm_storeu_si128 ((__m128i *)(out + x), _mm_packus_epi16 (s0, s1));
+    }
+    for (; x < width; x++)
+        out[x] = (vrow[x] + 2 * vrow[x + 1] + vrow[x + 2] + 8) >> 4;
+}
+#endif
+
+#ifdef DD_HAVE_AVX2
+DD_TARGET_AVX2 static void
+blur_row_avx2 (const uint8_t *a, const uint8_t *b, const uint8_t *c,
+               uint16_t *vrow, uint8_t *out, uint32_t width)
+{
+    const __m256i round = _mm256_set1_epi16 (8);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i va = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(a + x)));
+        __m256i vb = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(b + x)));
+        __m256i vc = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(c + x)));
+        __m256i v = _mm256_add_epi16 (_mm256_add_epi16 (va, vc), _mm256_slli_epi16 (vb, 1));
+        _mm256_storeu_si256 ((__m256i *)(vrow + x + 1), v);
+    }
+    for (; x < width; x++)
+        vrow[x + 1] = a[x] + 2 * b[x] + c[x];
+    blur_row_borders (vrow, width);
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i l = _mm256_loadu_si256 ((const __m256i *)(vrow + x));
+        __m256i m = _mm256_loadu_si256 ((const __m256i *)(vrow + x + 1));
+        __m256i r = _mm256_loadu_si256 ((const __m256i *)(vrow + x + 2));
+        __m256i s = _mm256_add_epi16 (_mm256_add_epi16 (l, r), _mm256_slli_epi16 (m, 1));
+        s = _mm256_srli_epi16 (_mm256_add_epi16 (s, round), 4);
+        _mm_storeu_si128 ((__m128i *)(out + x),
+                          _mm_packus_epi16 (_mm256_castsi256_si128 (s),
+                                            _mm256_extracti128_si256 (s, 1)));
+    }
+    for (; x < width; x++)
+        out[x] = (vrow[x] + 2 * vrow[x + 1] + vrow[x + 2] + 8) >> 4;
+}
+#endif
+
+/* Binary threshold of one row: dst = src > thresh ? max_value : 0 */
+static void
+threshold_row_c (const uint8_t *src, uint8_t *dst, uint32_t width,
+                 uint8_t thresh, uint8_t max_value)
+{
+    uint32_t x;
+    for (x = 0; x < width; x++)
+        dst[x] = src[x] > thresh ? max_value : 0;
+}
+
+#ifdef DD_HAVE_NEON
+static void
+threshold_row_neon (const uint8_t *src, uint8_t *dst, uint32_t width,
+                    uint8_t thresh, uint8_t max_value)
+{
+    uint8x16_t vt = vdupq_n_u8 (thresh);
+    uint8x16_t vm = vdupq_n_u8 (max_value);
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32) {
+        uint8x16_t a = vld1q_u8 (src + x);
+        uint8x16_t b = vld1q_u8 (src + x + 16);
+        vst1q_u8 (dst + x, vandq_u8 (vcgtq_u8 (a, vt), vm));
+        vst1q_u8 (dst + x + 16, vandq_u8 (vcgtq_u8 (b, vt), vm));
+    }
+    for (; x + 16 <= width; x += 16)
+        vst1q_u8 (dst + x, vandq_u8 (vcgtq_u8 (vld1q_u8 (src + x), vt), vm));
+    threshold_row_c (src + x, dst + x, width - x, thresh, max_value);
+}
+#endif
+
+/*
+ * SSE2/AVX2 have no unsigned byte compare. src > thresh is evaluated as
+ * max(src, thresh + 1) == src, the caller guarantees thresh < 255.
+ */
+#ifdef DD_HAVE_SSE2
+static void
+threshold_row_sse2 (const uint8_t *src, uint8_t *dst, uint32_t width,
+                    uint8_t thresh, uint8_t max_value)
+{
+    __m128i vt = _mm_set1_epi8 ((char) (thresh + 1));
+    __m128i vm = _mm_set1_epi8 ((char) max_value);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(src + x));
+        __m128i gt = _mm_cmpeq_epi8 (_mm_max_epu8 (a, vt), a);
+        _mm_storeu_si128 ((__m128i *)(dst + x), _mm_and_si128 (gt, vm));
+    }
+    threshold_row_c (src + x, dst + x, width - x, thresh, max_value);
+}
+#endif
+
+#ifdef DD_HAVE_AVX2
+DD_TARGET_AVX2 static void
+threshold_row_avx2 (const uint8_t *src, uint8_t *dst, uint32_t width,
+                    uint8_t thresh, uint8_t max_value)
+{
+    __m256i vt = _mm256_set1_epi8 ((char) (thresh + 1));
+    __m256i vm = _mm256_set1_epi8 ((char) max_value);
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(src + x));
+        __m256i gt = _mm256_cmpeq_epi8 (_mm256_max_epu8 (a, vt), a);
+        _mm256_storeu_si256 ((__m256i *)(dst + x), _mm256_and_si256 (gt, vm));
+    }
+    threshold_row_c (src + x, dst + x, width - x, thresh, max_value);
+}
+#endif
+
+/* Binary threshold of one row into bits, see DD_MASK_BITS_STRIDE() */
+static void
+threshold_bits_row_c (const uint8_t *src, uint64_t *bits, uint32_t width, uint8_t thresh)
+{
+    uint32_t x, w;
+    for (w = 0; w * 64 < width; w++) {
+        uint32_t n = width - w * 64 < 64 ? width - w * 64 : 64;
+        uint64_t v = 0;
+        for (x = 0; x < n; x++)
+            v |= (uint64_t) (src[w * 64 + x] > thresh) << x;
+        bits[w] = v;
+    }
+}
+
+#if defined(DD_HAVE_NEON) && defined(__aarch64__)
+/*
+ * NEON has no movemask: the lanes of each compare are weighted 1 to 128 and
+ * three rounds of pairwise adds sum every 8 lanes into one byte of the word.
+ */
+static void
+threshold_bits_row_neon (const uint8_t *src, uint64_t *bits, uint32_t width, uint8_t thresh)
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t vw = vld1q_u8 (weights);
+    uint8x16_t vt = vdupq_n_u8 (thresh);
+    uint32_t w = 0;
+    for (; (w + 1) * 64 <= width; w++) {
+        const uint8_t *p = src + w * 64;
+        uint8x16_t a = vandq_u8 (vcgtq_u8 (vld1q_u8 (p), vt), vw);
+        uint8x16_t b = vandq_u8 (vcgtq_u8 (vld1q_u8 (p + 16), vt), vw);
+        uint8x16_t c = vandq_u8 (vcgtq_u8 (vld1q_u8 (p + 32), vt), vw);
+        uint8x16_t d = vandq_u8 (vcgtq_u8 (vld1q_u8 (p + 48), vt), vw);
+        uint8x16_t s = vpaddq_u8 (vpaddq_u8 (a, b), vpaddq_u8 (c, d));
+        s = vpaddq_u8 (s, s);
+        bits[w] = vgetq_lane_u64 (vreinterpretq_u64_u8 (s), 0);
+    }
+    if (w * 64 < width)
+        threshold_bits_row_c (src + w * 64, bits + w, width - w * 64, thresh);
+}
+#endif
+
+#ifdef DD_HAVE_SSE2
+static void
+threshold_bits_row_sse2 (const uint8_t *src, uint64_t *bits, uint32_t width, uint8_t thresh)
+{
+    __m128i vt = _mm_set1_epi8 ((char) (thresh + 1));
+    uint32_t w = 0, i;
+    for (; (w + 1) * 64 <= width; w++) {
+        uint64_t v = 0;
+        for (i = 0; i < 4; i++) {
+            __m128i a = _mm_loadu_si128 ((const __m128i *)(src + w * 64 + i * 16));
+            __m128i gt = _mm_cmpeq_epi8 (_mm_max_epu8 (a, vt), a);
+            v |= (uint64_t) (uint16_t) _mm_movemask_epi8 (gt) << (i * 16);
+        }
+        bits[w] = v;
+    }
+    if (w * 64 < width)
+        threshold_bits_row_c (src + w * 64, bits + w, width - w * 64, thresh);
+}
+#endif
+
+#ifdef DD_HAVE_AVX2
+DD_TARGET_AVX2 static void
+threshold_bits_row_avx2 (const uint8_t *src, uint64_t *bits, uint32_t width, uint8_t thresh)
+{
+    __m256i vt = _mm256_set1_epi8 ((char) (thresh + 1));
+    uint32_t w = 0;
+    for (; (w + 1) * 64 <= width; w++) {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(src + w * 64));
+        __m256i b = _mm256_loadu_si256 ((const __m256i *)(src + w * 64 + 32));
+        uint32_t lo = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_max_epu8 (a, vt), a));
+        uint32_t hi = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_max_epu8 (b, vt), b));
+        bits[w] = (uint64_t) hi << 32 | lo;
+    }
+    if (w * 64 < width)
+        threshold_bits_row_c (src + w * 64, bits + w, width - w * 64, thresh);
+}
+#endif
+
+static void
+dd_cpu_select (void)
+{
+    dd_blur_row = blur_row_c;
+    dd_threshold_row = threshold_row_c;
+    dd_threshold_bits_row = threshold_bits_row_c;
+    dd_simd_name = "c";
+#if defined(DD_HAVE_NEON)
+    dd_blur_row = blur_row_neon;
+    dd_threshold_row = threshold_row_neon;
+#if defined(__aarch64__)
+    dd_threshold_bits_row = threshold_bits_row_neon;
+#endif
+    dd_simd_name = "neon";
+#elif defined(DD_HAVE_SSE2)
+    dd_blur_row = blur_row_sse2;
+    dd_threshold_row = threshold_row_sse2;
+    dd_threshold_bits_row = threshold_bits_row_sse2;
+    dd_simd_name = "sse2";
+#if defined(DD_HAVE_AVX2)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        dd_blur_row = blur_row_avx2;
+        dd_threshold_row = threshold_row_avx2;
+        dd_threshold_bits_row = threshold_bits_row_avx2;
+        dd_simd_name = "avx2";
+    }
+#endif
+#endif
+}
+
+const char *
+dd_cpu_simd_name (void)
+{
+    pthread_once (&dd_cpu_once, dd_cpu_select);
+    return dd_simd_name;
+}
+
+/*
+ * Four interleaved sub-histograms break the load/increment/store
+ * dependency between neighbouring pixels of equal value, which is what
+ * limits a plain histogram loop on in-order cores like the A53.
+ */
+static inline void
+hist_row (const uint8_t *row, uint32_t width, uint32_t hist[4][DD_HIST_BINS])
+{
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        hist[0][row[x]]++;
+        hist[1][row[x + 1]]++;
+        hist[2][row[x + 2]]++;
+        hist[3][row[x + 3]]++;
+    }
+    for (; x < width; x++)
+        hist[0][row[x]]++;
+}
+
+uint32_t
+dd_cpu_blur_scratch_size (uint32_t width)
+{
+    return (width + 2) * sizeof (uint16_t) + width;
+}
+
+/* Blurs row @y of @src into @out, mirroring rows and columns at the border */
+static inline void
+blur_row_at (const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+             uint32_t y, uint16_t *vrow, uint8_t *out)
+{
+    const uint8_t *b = src + (size_t) y * src_stride;
+    if (width < 2 || height < 2) {
+        /* Nothing to mirror, pass the source through */
+        memcpy (out, b, width);
+    } else {
+        const uint8_t *a = src + (size_t) (y == 0 ? 1 : y - 1) * src_stride;
+        const uint8_t *c = src + (size_t) (y == height - 1 ? height - 2 : y + 1) * src_stride;
+        dd_blur_row (a, b, c, vrow, out, width);
+    }
+}
+
+static inline void
+threshold_row_at (const uint8_t *s, uint8_t *d, uint32_t width, int32_t thresh, uint8_t max_value)
+{
+    if (thresh < 0)
+        memset (d, max_value, width);
+    else if (thresh >= 255)
+        memset (d, 0, width);
+    else
+        dd_threshold_row (s, d, width, (uint8_t) thresh, max_value);
+}
+
+static inline void
+hist_sum (uint32_t sub[4][DD_HIST_BINS], uint32_t hist[DD_HIST_BINS])
+{
+    uint32_t i;
+    for (i = 0; i < DD_HIST_BINS; i++)
+        hist[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+void
+dd_cpu_gaussian_hist (const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                      uint32_t dst_stride, uint32_t width, uint32_t height,
+                      void *scratch, uint32_t hist[DD_HIST_BINS])
+{
+    dd_cpu_gaussian_hist_rows (src, src_stride, dst, dst_stride, width, height, 0, height,
+                               scratch, hist);
+}
+
+void
+dd_cpu_gaussian_hist_rows (const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                           uint32_t dst_stride, uint32_t width, uint32_t height,
+                           uint32_t y0, uint32_t y1, void *scratch, uint32_t hist[DD_HIST_BINS])
+{
+    uint32_t sub[4][DD_HIST_BINS];
+    uint16_t *vrow = (uint16_t *) scratch;
+    uint8_t *row = (uint8_t *) (vrow + width + 2);
+    uint32_t y;
+
+    pthread_once (&dd_cpu_once, dd_cpu_select);
+    memset (sub, 0, sizeof (sub));
+
+    for (y = y0; y < y1; y++) {
+        uint8_t *out = dst ? dst + (size_t) y * dst_stride : row;
+        blur_row_at (src, src_stride, width, height, y, vrow, out);
+        if (hist)
+            hist_row (out, width, sub);
+    }
+    if (hist)
+        hist_sum (sub, hist);
+}
+
+void
+dd_cpu_histogram (const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+                  uint32_t hist[DD_HIST_BINS])
+{
+    uint32_t sub[4][DD_HIST_BINS];
+    uint32_t y;
+
+    pthread_once (&dd_cpu_once, dd_cpu_select);
+    memset (sub, 0, sizeof (sub));
+    for (y = 0; y < height; y++)
+        hist_row (src + (size_t) y * src_stride, width, sub);
+    hist_sum (sub, hist);
+}
+
+void
+dd_cpu_histogram_step (const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+                       uint32_t step, uint32_t hist[DD_HIST_BINS])
+{
+    uint32_t x, y;
+
+    if (step <= 1) {
+        dd_cpu_histogram (src, src_stride, width, height, hist);
+        return;
+    }
+    memset (hist, 0, DD_HIST_BINS * sizeof (uint32_t));
+    for (y = step / 2; y < height; y += step) {
+        const uint8_t *row = src + (size_t) y * src_stride;
+        for (x = step / 2; x < width; x += step)
+            hist[row[x]]++;
+    }
+}
+
+void
+dd_cpu_threshold (const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                  uint32_t dst_stride, uint32_t width, uint32_t height,
+                  int32_t thresh, uint8_t max_value)
+{
+    uint32_t y;
+
+    pthread_once (&dd_cpu_once, dd_cpu_select);
+    for (y = 0; y < height; y++)
+        threshold_row_at (src + (size_t) y * src_stride, dst + (size_t) y * dst_stride,
+                          width, thresh, max_value);
+}
+
+void
+dd_cpu_threshold_bits (const uint8_t *src, uint32_t src_stride, uint8_t *bits,
+                       uint32_t bits_stride, uint32_t width, uint32_t height, int32_t thresh)
+{
+    uint32_t y;
+
+    pthread_once (&dd_cpu_once, dd_cpu_select);
+    for (y = 0; y < height; y++) {
+        uint64_t *row = (uint64_t *) (bits + (size_t) y * bits_stride);
+        if (thresh < 0 || thresh >= 255) {
+            uint32_t w, words = DD_MASK_BITS_STRIDE (width) / 8;
+            for (w = 0; w < words; w++)
+                row[w] = thresh < 0 ? ~0ULL : 0;
+            /* no bits past the width */
+            if (thresh < 0 && width % 64)
+                row[words - 1] = (1ULL << (width % 64)) - 1;
+        } else {
+            dd_threshold_bits_row (src + (size_t) y * src_stride, row, width, (uint8_t) thresh);
+        }
+    }
+}
+
+uint32_t
+dd_cpu_fused_scratch_size (uint32_t width, uint32_t band_rows)
+{
+    if (band_rows < 1)
+        band_rows = 1;
+    return (width + 2) * sizeof (uint16_t) + (band_rows + 1) * width;
+}
+
+/*
+ * The frame is walked in bands of @band_rows rows. Each band is blurred
+ * into a buffer small enough to stay in L1/L2, histogrammed, thresholded a
+ * row at a time and handed to the run-length labeller, so neither the
+ * blurred image nor the mask ever reaches DRAM. Only the source is read
+ * (twice in exact mode) and only the rendered result is written.
+ */
+int
+dd_cpu_fused_frame (DDCcaCtx *cca, const DDFusedParams *params,
+                    const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                    uint32_t dst_stride, uint32_t width, uint32_t height,
+                    void *scratch, DDFusedResult *res)
+{
+    uint32_t sub[4][DD_HIST_BINS];
+    uint32_t hist[DD_HIST_BINS];
+    uint16_t *vrow = (uint16_t *) scratch;
+    uint8_t *band = (uint8_t *) (vrow + width + 2);
+    uint32_t band_rows = params->band_rows ? params->band_rows : 1;
+    uint8_t *mask = band + (size_t) band_rows * width;
+    uint32_t y0, y, n;
+    int32_t thresh;
+
+    pthread_once (&dd_cpu_once, dd_cpu_select);
+
+    if (params->lagged) {
+        thresh = (int32_t) params->prev_otsu - params->thr_offset;
+    } else {
+        /* histogram-only pass, the blurred rows are dropped */
+        dd_cpu_gaussian_hist (src, src_stride, NULL, 0, width, height, scratch, hist);
+        res->otsu_thr = dd_cpu_otsu_threshold (hist);
+        thresh = (int32_t) res->otsu_thr - params->thr_offset;
+    }
+
+    if (dd_cpu_cca_begin (cca, width, height) < 0)
+        return -1;
+    memset (sub, 0, sizeof (sub));
+    for (y0 = 0; y0 < height; y0 += band_rows) {
+        n = height - y0 < band_rows ? height - y0 : band_rows;
+        for (y = 0; y < n; y++) {
+            uint8_t *out = band + (size_t) y * width;
+            blur_row_at (src, src_stride, width, height, y0 + y, vrow, out);
+            if (params->lagged)
+                hist_row (out, width, sub);
+        }
+        for (y = 0; y < n; y++) {
+            threshold_row_at (band + (size_t) y * width, mask, width, thresh, params->max_value);
+            if (dd_cpu_cca_push_row (cca, mask) < 0)
+                return -1;
+        }
+    }
+    if (dd_cpu_cca_end (cca, &res->mango_pix, &res->defect_pix) < 0)
+        return -1;
+
+    if (params->lagged) {
+        hist_sum (sub, hist);
+        res->otsu_thr = dd_cpu_otsu_threshold (hist);
+    }
+    res->threshold = thresh;
+
+    if (dst)
+        dd_cpu_cca_render (cca, dst, dst_stride, params->max_value, params->defect_value);
+    return 0;
+}
+
+/*
+ * With P(t) and S(t) the pixel count and intensity sum of bins 0..t, the
+ * between-class variance for a split after bin t is
+ *
+ *     (N * S(t) - S * P(t))^2 / (P(t) * (N - P(t)))     (up to a 1/N^2 factor)
+ *
+ * so the search is a branch-free map over the 256 candidates followed by a
+ * first-maximum scan.
+ */
+uint32_t
+dd_cpu_otsu_threshold (const uint32_t hist[DD_HIST_BINS])
+{
+    double p[DD_HIST_BINS], s[DD_HIST_BINS], var[DD_HIST_BINS];
+    double n, sum, best = 0.0;
+    uint32_t t, thr = 0;
+
+    n = 0.0;
+    sum = 0.0;
+    for (t = 0; t < DD_HIST_BINS; t++) {
+        n += hist[t];
+        sum += (double) t * hist[t];
+        p[t] = n;
+        s[t] = sum;
+    }
+
+    t = 0;
+#if defined(DD_HAVE_NEON) && defined(__aarch64__)
+    {
+        float64x2_t vn = vdupq_n_f64 (n), vs = vdupq_n_f64 (sum), zero = vdupq_n_f64 (0.0);
+        for (; t + 2 <= DD_HIST_BINS; t += 2) {
+            float64x2_t vp = vld1q_f64 (p + t);
+            float64x2_t d = vsubq_f64 (vmulq_f64 (vn, vld1q_f64 (s + t)), vmulq_f64 (vs, vp));
+            float64x2_t den = vmulq_f64 (vp, vsubq_f64 (vn, vp));
+            uint64x2_t valid = vcgtq_f64 (den, zero);
+            float64x2_t v = vdivq_f64 (vmulq_f64 (d, d), den);
+            vst1q_f64 (var + t, vreinterpretq_f64_u64 (vandq_u64 (vreinterpretq_u64_f64 (v), valid)));
+        }
+    }
+#elif defined(DD_HAVE_SSE2)
+    {
+        __m128d vn = _mm_set1_pd (n), vs = _mm_set1_pd (sum), zero = _mm_setzero_pd ();
+        for (; t + 2 <= DD_HIST_BINS; t += 2) {
+            __m128d vp = _mm_loadu_pd (p + t);
+            __m128d d = _mm_sub_pd (_mm_mul_pd (vn, _mm_loadu_pd (s + t)), _mm_mul_pd (vs, vp));
+            __m128d den = _mm_mul_pd (vp, _mm_sub_pd (vn, vp));
+            __m128d valid = _mm_cmpgt_pd (den, zero);
+            _mm_storeu_pd (var + t, _mm_and_pd (_mm_div_pd (_mm_mul_pd (d, d), den), valid));
+        }
+    }
+#endif
+    for (; t < DD_HIST_BINS; t++) {
+        double d = n * s[t] - sum * p[t];
+        double den = p[t] * (n - p[t]);
+        var[t] = den > 0.0 ? d * d / den : 0.0;
+    }
+
+    for (t = 0; t < DD_HIST_BINS; t++) {
+        if (var[t] > best) {
+            best = var[t];
+            thr = t;
+        }
+    }
+    return thr;
+}
+
+void
+dd_otsu_temporal_init (DDOtsuTemporal *tmp, float alpha, float tolerance)
+{
+    memset (tmp, 0, sizeof (*tmp));
+    tmp->alpha = alpha > 0.0f && alpha <= 1.0f ? alpha : 1.0f;
+    tmp->tolerance = tolerance > 0.0f ? tolerance : 0.0f;
+}
+
+uint32_t
+dd_otsu_temporal_update (DDOtsuTemporal *tmp, const uint32_t hist[DD_HIST_BINS], int *recomputed)
+{
+    uint32_t scaled[DD_HIST_BINS];
+    double n = 0.0, dist = 0.0;
+    uint32_t i;
+
+    for (i = 0; i < DD_HIST_BINS; i++)
+        n += hist[i];
+    *recomputed = 0;
+    if (n == 0.0)
+        return tmp->thr;
+
+    for (i = 0; i < DD_HIST_BINS; i++) {
+        float p = (float) (hist[i] / n);
+        tmp->ewma[i] = tmp->have ? tmp->ewma[i] + tmp->alpha * (p - tmp->ewma[i]) : p;
+        dist += fabsf (tmp->ewma[i] - tmp->ref[i]);
+    }
+    /* the L1 distance of two distributions is 0 to 2 */
+    if (tmp->have && dist <= tmp->tolerance)
+        return tmp->thr;
+
+    for (i = 0; i < DD_HIST_BINS; i++)
+        scaled[i] = (uint32_t) (tmp->ewma[i] * (float) (1 << 24) + 0.5f);
+    memcpy (tmp->ref, tmp->ewma, sizeof (tmp->ref));
+    tmp->thr = dd_cpu_otsu_threshold (scaled);
+    tmp->have = 1;
+    *recomputed = 1;
+    return tmp->thr;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * CPU reference implementations of the defect-detect accelerators.
+ *
+ * These kernels mirror the Vitis Vision functions in the xclbin so that the
+ * vvas plugins can run without the FPGA (CI, x86 replay servers, degraded
+ * mode when the bitstream is not loaded). Hot loops are vectorized with NEON
+ * on aarch64 and SSE2/AVX2 on x86; AVX2 is selected at runtime.
+ */
+
+#ifndef __DD_CPU_KERNELS_H__
+#define __DD_CPU_KERNELS_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DD_HIST_BINS                256
+
+typedef enum {
+    DD_BACKEND_FPGA,
+    DD_BACKEND_CPU,
+    DD_BACKEND_AUTO,
+    DD_BACKEND_SHARED,
+} DDBackend;
+
+/* Parses the "backend" config string, returns -1 for unknown values */
+int dd_backend_from_string (const char *str);
+const char *dd_backend_to_string (DDBackend backend);
+
+/*
+ * Frames in flight on the compute units of one accelerator, counted across
+ * all element instances of the process (one per stream). Each plugin keeps a
+ * static pool. dd_cu_pool_acquire() returns 1 when the frame should go to the
+ * accelerator: always for the fpga and auto backends, for the shared backend
+ * only while fewer than @num_cu frames are in flight, so that a busy CU sends
+ * the frame to the CPU instead of queueing it behind another stream.
+ * Every successful acquire is paired with dd_cu_pool_release().
+ */
+typedef struct _DDCuPool {
+    int in_flight;
+} DDCuPool;
+
+#define DD_CU_POOL_INIT     { 0 }
+
+int dd_cu_pool_acquire (DDCuPool *pool, DDBackend backend, int num_cu);
+void dd_cu_pool_release (DDCuPool *pool);
+
+/*
+ * Region of interest. The stages process only this rectangle and leave 0
+ * in their output around it. The accelerators take no stride or column
+ * offset, they process the full-width band of rows holding the rectangle,
+ * see dd_roi_band().
+ */
+typedef struct _DDRoi {
+    uint32_t x, y, width, height;
+} DDRoi;
+
+/* Clips @roi to a @width x @height frame, an empty ROI becomes the whole frame */
+void dd_roi_clamp (DDRoi *roi, uint32_t width, uint32_t height);
+int dd_roi_is_full (const DDRoi *roi, uint32_t width, uint32_t height);
+/* The rows of @roi at the full frame width */
+DDRoi dd_roi_band (const DDRoi *roi, uint32_t width);
+
+/* Sets the pixels of @dst outside @roi to 0 */
+void dd_cpu_clear_outside (uint8_t *dst, uint32_t stride, uint32_t width, uint32_t height,
+                           const DDRoi *roi);
+
+/*
+ * Learns the ROI from the first frames: the union of the rows and columns
+ * holding at least @min_pixels pixels above the Otsu split of their frame,
+ * i.e. where fruit went by.
+ */
+typedef struct _DDRoiDetect {
+    uint32_t frames;
+    int found;
+    uint32_t x0, y0, x1, y1;
+    uint32_t *col_hits;
+    uint32_t col_cap;
+} DDRoiDetect;
+
+int dd_roi_detect_frame (DDRoiDetect *det, const uint8_t *src, uint32_t stride, uint32_t width,
+                         uint32_t height, uint32_t thr, uint32_t min_pixels);
+/* Grows the learnt box by @margin pixels; the whole frame if nothing was found */
+void dd_roi_detect_finish (DDRoiDetect *det, uint32_t margin, uint32_t width, uint32_t height,
+                           DDRoi *roi);
+void dd_roi_detect_clear (DDRoiDetect *det);
+
+/*
+ * The "roi" setting of the first stage: a fixed rectangle, or "auto" where
+ * the first @learn_frames frames are processed whole and fed to the
+ * detector, then the learnt rectangle is used from there on.
+ */
+typedef struct _DDRoiConfig {
+    DDRoi roi;                  /* all 0 for the whole frame */
+    int auto_detect;
+    uint32_t learn_frames;
+    uint32_t margin;
+    int locked;
+    DDRoiDetect det;
+} DDRoiConfig;
+
+/* The rectangle to process a @width x @height frame with */
+DDRoi dd_roi_config_get (const DDRoiConfig *cfg, uint32_t width, uint32_t height);
+/*
+ * Feeds a blurred frame and its Otsu split to the detector while it is
+ * learning. Returns 1 when this frame completed the learning and cfg->roi
+ * now holds the rectangle, 0 otherwise, -1 on allocation failure.
+ */
+int dd_roi_config_learn (DDRoiConfig *cfg, const uint8_t *src, uint32_t stride, uint32_t width,
+                         uint32_t height, uint32_t thr);
+
+/* Name of the SIMD flavour picked at runtime, for logging */
+const char *dd_cpu_simd_name (void);
+
+/*
+ * 3x3 Gaussian blur (sigma 0, i.e. the [1 2 1] binomial kernel) fused with
+ * the 256-bin histogram of the blurred image, one row at a time. @dst may be
+ * NULL when only the histogram is needed, @hist of the _rows form NULL when
+ * only the blur is. @scratch must be at least
+ * dd_cpu_blur_scratch_size() bytes.
+ */
+uint32_t dd_cpu_blur_scratch_size (uint32_t width);
+void dd_cpu_gaussian_hist (const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                           uint32_t dst_stride, uint32_t width, uint32_t height,
+                           void *scratch, uint32_t hist[DD_HIST_BINS]);
+
+/*
+ * Rows [@y0, @y1) of dd_cpu_gaussian_hist() on the whole frame: @src and
+ * @dst point at row 0 and the rows around the range are read, so strips
+ * blurred separately join without a seam. @hist covers the range only.
+ */
+void dd_cpu_gaussian_hist_rows (const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                                uint32_t dst_stride, uint32_t width, uint32_t height,
+                                uint32_t y0, uint32_t y1, void *scratch,
+                                uint32_t hist[DD_HIST_BINS]);
+
+/* 256-bin histogram of @src */
+void dd_cpu_histogram (const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+                       uint32_t hist[DD_HIST_BINS]);
+
+/* Otsu split of a 256-bin histogram, same convention as cv::THRESH_OTSU */
+uint32_t dd_cpu_otsu_threshold (const uint32_t hist[DD_HIST_BINS]);
+
+/*
+ * Every @step-th pixel of every @step-th row, starting half a step in. The
+ * counts are those of the sample, Otsu only needs their proportions.
+ */
+void dd_cpu_histogram_step (const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+                            uint32_t step, uint32_t hist[DD_HIST_BINS]);
+
+/*
+ * Temporal Otsu: an exponentially weighted average of the normalised frame
+ * histograms, new frames weighted by @alpha. The split is recomputed only
+ * when the average has moved more than @tolerance (L1 distance, 0 to 2)
+ * from the histogram of the last recompute, so the threshold holds still
+ * under slowly changing light and Otsu runs on few frames.
+ */
+typedef struct _DDOtsuTemporal {
+    float alpha;
+    float tolerance;
+    int have;
+    uint32_t thr;
+    float ewma[DD_HIST_BINS];
+    float ref[DD_HIST_BINS];
+} DDOtsuTemporal;
+
+void dd_otsu_temporal_init (DDOtsuTemporal *tmp, float alpha, float tolerance);
+/* Folds in the histogram of a frame and returns the split, @recomputed tells whether it ran */
+uint32_t dd_otsu_temporal_update (DDOtsuTemporal *tmp, const uint32_t hist[DD_HIST_BINS], int *recomputed);
+
+/*
+ * Binary threshold, dst = src > thresh ? max_value : 0, as done by
+ * preprocess_accel. Rows are walked with their own strides so padded
+ * frames are handled; thresh outside 0..254 saturates.
+ */
+void dd_cpu_threshold (const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                       uint32_t dst_stride, uint32_t width, uint32_t height,
+                       int32_t thresh, uint8_t max_value);
+
+/*
+ * Binary masks at 1 bit per pixel, 8x less to write and read than the
+ * byte mask. Pixel x of a row is bit x % 64 of little endian 64-bit word
+ * x / 64, set for fruit; rows are DD_MASK_BITS_STRIDE() bytes apart and
+ * the bits past the width are 0.
+ */
+#define DD_MASK_BITS_STRIDE(width)  ((((width) + 63) / 64) * 8)
+
+/* dd_cpu_threshold() into a bit mask, @bits 8-byte aligned */
+void dd_cpu_threshold_bits (const uint8_t *src, uint32_t src_stride, uint8_t *bits,
+                            uint32_t bits_stride, uint32_t width, uint32_t height, int32_t thresh);
+
+/*
+ * Connected-component analysis of a binary mango mask (non-zero is fruit).
+ *
+ * Background pixels are labelled in a single pass over run-length segments
+ * with union-find (4-connectivity). Background components that touch the
+ * frame border are the scene, the remaining ones are holes in the fruit,
+ * i.e. defects. As with cca_custom_accel, mango pixels are the fruit plus
+ * its holes and defect pixels are the holes only.
+ */
+typedef struct _DDBlob {
+    uint32_t area;
+    uint32_t x0, y0, x1, y1;    /* inclusive bounding box */
+    float cx, cy;               /* centroid */
+} DDBlob;
+
+typedef struct _DDCcaCtx DDCcaCtx;
+
+DDCcaCtx *dd_cpu_cca_new (void);
+void dd_cpu_cca_free (DDCcaCtx *ctx);
+
+/*
+ * Labels @src and fills the pixel counts. When @dst is not NULL the mask is
+ * copied there with defect pixels painted as @defect_value. Returns 0, or -1
+ * if the run storage could not be grown.
+ */
+int dd_cpu_cca (DDCcaCtx *ctx, const uint8_t *src, uint32_t src_stride,
+                uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix);
+
+/*
+ * Streaming form of dd_cpu_cca(): rows are pushed top to bottom, e.g. as
+ * they are produced by an earlier stage, so the mask never needs to exist
+ * as a full frame. dd_cpu_cca_render() then writes fruit as @fg_value,
+ * scene as 0 and defects as @defect_value.
+ */
+int dd_cpu_cca_begin (DDCcaCtx *ctx, uint32_t width, uint32_t height);
+int dd_cpu_cca_push_row (DDCcaCtx *ctx, const uint8_t *row);
+int dd_cpu_cca_end (DDCcaCtx *ctx, uint32_t *mango_pix, uint32_t *defect_pix);
+void dd_cpu_cca_render (DDCcaCtx *ctx, uint8_t *dst, uint32_t dst_stride,
+                        uint8_t fg_value, uint8_t defect_value);
+
+/*
+ * dd_cpu_cca() of a bit mask. Background runs are taken a word at a time,
+ * words of fruit or scene only are skipped whole. The output is rendered
+ * with fruit as @fg_value.
+ */
+int dd_cpu_cca_bits (DDCcaCtx *ctx, const uint8_t *bits, uint32_t bits_stride,
+                     uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                     uint8_t fg_value, uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix);
+
+/* Defects of the last labelled frame, largest first, at least @min_area pixels */
+uint32_t dd_cpu_cca_blobs (DDCcaCtx *ctx, uint32_t min_area, const DDBlob **blobs);
+
+/*
+ * Tiled execution of frames larger than the accelerators of the xclbin,
+ * which take at most DD_ACCEL_MAX_WIDTH x DD_ACCEL_MAX_HEIGHT. On the CPU
+ * the frame is cut into strips of whole rows, processed in parallel and
+ * stitched: the blur reads the rows across each seam, strip histograms are
+ * summed and CCA components are merged across the seams.
+ */
+#define DD_ACCEL_MAX_WIDTH          1280
+#define DD_ACCEL_MAX_HEIGHT         800
+
+typedef struct _DDTiler DDTiler;
+typedef void (*DDTileFunc) (void *arg, uint32_t tile, uint32_t worker);
+
+/*
+ * A pool of @threads - 1 workers started here and kept until
+ * dd_tiler_free(), the caller of dd_tiler_run() being the last one. @threads
+ * 0 uses every online CPU, @tile_rows 0 gives each thread one strip. A tiler
+ * serves one caller at a time.
+ */
+DDTiler *dd_tiler_new (uint32_t threads, uint32_t tile_rows);
+void dd_tiler_free (DDTiler *tiler);
+uint32_t dd_tiler_threads (const DDTiler *tiler);
+/* Threads for each of @users tilers sharing the online CPUs, at least 1 */
+uint32_t dd_tiler_share (uint32_t users);
+/*
+ * The tile_threads key of the kernels, for a @width x @height frame on the
+ * CPU: it is cut into strips when it has more than one thread, tile_threads
+ * or for 0 an even share of the CPUs between @users elements, and always
+ * when it is larger than the accelerator. *@tiler is started for the first
+ * such frame. Returns it, NULL when the frame runs whole.
+ */
+DDTiler *dd_tiler_for (DDTiler **tiler, uint32_t tile_threads, uint32_t tile_rows, uint32_t users,
+                       uint32_t width, uint32_t height);
+/* Number of strips of a @height row frame, all @rows rows high but the last */
+uint32_t dd_tiler_strips (const DDTiler *tiler, uint32_t height, uint32_t *rows);
+/* Calls @fn for tiles 0 to @n - 1 on the workers, @worker is below dd_tiler_threads() */
+void dd_tiler_run (DDTiler *tiler, uint32_t n, DDTileFunc fn, void *arg);
+
+/*
+ * Plans the accelerator commands for @roi of a @width x @height frame. The
+ * accelerator is given @area, the full-width band of the ROI when the rows
+ * are @packed and the whole frame otherwise, in bands of at most
+ * DD_ACCEL_MAX_HEIGHT rows. Returns the number of bands, 0 when the
+ * accelerator cannot take the frame.
+ */
+uint32_t dd_accel_bands (const DDRoi *roi, uint32_t width, uint32_t height, int packed, DDRoi *area);
+DDRoi dd_accel_band_at (const DDRoi *area, uint32_t index);
+
+/* Strip-parallel forms of the kernels above, -1 if scratch could not be allocated; @hist may be NULL for the blur */
+int dd_tiler_gaussian_hist (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                            uint32_t dst_stride, uint32_t width, uint32_t height,
+                            uint32_t hist[DD_HIST_BINS]);
+int dd_tiler_histogram (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint32_t width,
+                        uint32_t height, uint32_t hist[DD_HIST_BINS]);
+void dd_tiler_threshold (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                         uint32_t dst_stride, uint32_t width, uint32_t height,
+                         int32_t thresh, uint8_t max_value);
+void dd_tiler_threshold_bits (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint8_t *bits,
+                              uint32_t bits_stride, uint32_t width, uint32_t height, int32_t thresh);
+/*
+ * dd_cpu_cca() with the strips labelled in parallel and their components
+ * merged across the seams. Counts and dd_cpu_cca_blobs() are the same as
+ * for the whole frame; dd_cpu_cca_render() is not available afterwards.
+ */
+int dd_cpu_cca_tiled (DDCcaCtx *ctx, DDTiler *tiler, const uint8_t *src, uint32_t src_stride,
+                      uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                      uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix);
+int dd_cpu_cca_tiled_bits (DDCcaCtx *ctx, DDTiler *tiler, const uint8_t *bits, uint32_t bits_stride,
+                           uint8_t *dst, uint32_t dst_stride, uint32_t width, uint32_t height,
+                           uint8_t fg_value, uint8_t defect_value, uint32_t *mango_pix, uint32_t *defect_pix);
+
+/*
+ * Fused software pipeline: blur, histogram, Otsu, threshold and CCA in one
+ * banded pass over the source, see dd_cpu_fused_frame().
+ */
+typedef struct _DDFusedParams {
+    uint32_t band_rows;         /* rows blurred and masked per band */
+    int32_t thr_offset;         /* subtracted from the Otsu split, as in preprocess */
+    uint8_t max_value;          /* mask value of the fruit */
+    uint8_t defect_value;       /* value defects are painted with in the output */
+    /*
+     * Threshold the frame with @prev_otsu, the split of the previous frame,
+     * so the source is read once. Otherwise the histogram of the frame is
+     * built first and the source is read twice.
+     */
+    int lagged;
+    uint32_t prev_otsu;
+} DDFusedParams;
+
+typedef struct _DDFusedResult {
+    uint32_t otsu_thr;          /* Otsu split of this frame */
+    int32_t threshold;          /* threshold the mask was built with */
+    uint32_t mango_pix;
+    uint32_t defect_pix;
+} DDFusedResult;
+
+uint32_t dd_cpu_fused_scratch_size (uint32_t width, uint32_t band_rows);
+
+/*
+ * Runs the whole otsu -> preprocess -> cca chain on @src. When @dst is not
+ * NULL the labelled mask is rendered there as dd_cpu_cca() would write it.
+ * Blobs of the frame are then available from @cca. Returns 0, or -1 if the
+ * run storage could not be grown.
+ */
+int dd_cpu_fused_frame (DDCcaCtx *cca, const DDFusedParams *params,
+                        const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                        uint32_t dst_stride, uint32_t width, uint32_t height,
+                        void *scratch, DDFusedResult *res);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DD_CPU_KERNELS_H__ */
@@ -0,0 +1,174 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dd_cpu_kernels.h"
+
+void
+dd_roi_clamp (DDRoi *roi, uint32_t width, uint32_t height)
+{
+    if (roi->x >= width || roi->y >= height || !roi->width || !roi->height) {
+        roi->x = roi->y = 0;
+        roi->width = width;
+        roi->height = height;
+        return;
+    }
+    if (roi->width > width - roi->x)
+        roi->width = width - roi->x;
+    if (roi->height > height - roi->y)
+        roi->height = height - roi->y;
+}
+
+int
+dd_roi_is_full (const DDRoi *roi, uint32_t width, uint32_t height)
+{
+    return roi->x == 0 && roi->y == 0 && roi->width >= width && roi->height >= height;
+}
+
+DDRoi
+dd_roi_band (const DDRoi *roi, uint32_t width)
+{
+    DDRoi band = { 0, roi->y, width, roi->height };
+    return band;
+}
+
+void
+dd_cpu_clear_outside (uint8_t *dst, uint32_t stride, uint32_t width, uint32_t height,
+                      const DDRoi *roi)
+{
+    uint32_t y, right = roi->x + roi->width;
+
+    for (y = 0; y < roi->y; y++)
+        memset (dst + (size_t) y * stride, 0, width);
+    for (y = roi->y; y < roi->y + roi->height; y++) {
+        uint8_t *row = dst + (size_t) y * stride;
+        if (roi->x)
+            memset (row, 0, roi->x);
+        if (right < width)
+            memset (row + right, 0, width - right);
+    }
+    for (y = roi->y + roi->height; y < height; y++)
+        memset (dst + (size_t) y * stride, 0, width);
+}
+
+int
+dd_roi_detect_frame (DDRoiDetect *det, const uint8_t *src, uint32_t stride, uint32_t width,
+                     uint32_t height, uint32_t thr, uint32_t min_pixels)
+{
+    uint32_t x, y;
+
+    if (width > det->col_cap) {
+        uint32_t *hits = (uint32_t *) realloc (det->col_hits, width * sizeof (uint32_t));
+        if (!hits)
+            return -1;
+        det->col_hits = hits;
+        det->col_cap = width;
+    }
+    memset (det->col_hits, 0, width * sizeof (uint32_t));
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = src + (size_t) y * stride;
+        uint32_t n = 0;
+        for (x = 0; x < width; x++) {
+            uint32_t fg = row[x] > thr;
+            n += fg;
+            det->col_hits[x] += fg;
+        }
+        if (n < min_pixels)
+            continue;
+        if (!det->found || y < det->y0)
+            det->y0 = y;
+        if (!det->found || y > det->y1)
+            det->y1 = y;
+        if (!det->found) {
+            det->x0 = width - 1;
+            det->x1 = 0;
+        }
+        det->found = 1;
+    }
+    if (det->found) {
+        for (x = 0; x < width; x++) {
+            if (det->col_hits[x] < min_pixels)
+                continue;
+            if (x < det->x0)
+                det->x0 = x;
+            if (x > det->x1)
+                det->x1 = x;
+        }
+    }
+    det->frames++;
+    return 0;
+}
+
+void
+dd_roi_detect_finish (DDRoiDetect *det, uint32_t margin, uint32_t width, uint32_t height,
+                      DDRoi *roi)
+{
+    uint32_t x0, y0, x1, y1;
+
+    if (!det->found || det->x1 < det->x0) {
+        roi->x = roi->y = 0;
+        roi->width = width;
+        roi->height = height;
+        return;
+    }
+    x0 = det->x0 > margin ? det->x0 - margin : 0;
+    y0 = det->y0 > margin ? det->y0 - margin : 0;
+    x1 = det->x1 + margin < width ? det->x1 + margin : width - 1;
+    y1 = det->y1 + margin < height ? det->y1 + margin : height - 1;
+    roi->x = x0;
+    roi->y = y0;
+    roi->width = x1 - x0 + 1;
+    roi->height = y1 - y0 + 1;
+}
+
+void
+dd_roi_detect_clear (DDRoiDetect *det)
+{
+    free (det->col_hits);
+    memset (det, 0, sizeof (*det));
+}
+
+/* rows and columns with fewer fruit pixels are noise */
+#define DD_ROI_MIN_PIXELS       8
+
+DDRoi
+dd_roi_config_get (const DDRoiConfig *cfg, uint32_t width, uint32_t height)
+{
+    DDRoi roi = { 0, 0, 0, 0 };
+
+    if (!cfg->auto_detect || cfg->locked)
+        roi = cfg->roi;
+    dd_roi_clamp (&roi, width, height);
+    return roi;
+}
+
+int
+dd_roi_config_learn (DDRoiConfig *cfg, const uint8_t *src, uint32_t stride, uint32_t width,
+                     uint32_t height, uint32_t thr)
+{
+    if (!cfg->auto_detect || cfg->locked)
+        return 0;
+    if (dd_roi_detect_frame (&cfg->det, src, stride, width, height, thr, DD_ROI_MIN_PIXELS) < 0)
+        return -1;
+    if (cfg->det.frames < cfg->learn_frames)
+        return 0;
+    dd_roi_detect_finish (&cfg->det, cfg->margin, width, height, &cfg->roi);
+    dd_roi_detect_clear (&cfg->det);
+    cfg->locked = 1;
+    return 1;
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "dd_cpu_kernels.h"
+
+#define DD_TILER_MAX_THREADS    64
+
+typedef struct {
+    uint32_t n;
+    DDTileFunc fn;
+    void *arg;
+    uint32_t next;
+} DDTileJob;
+
+typedef struct {
+    DDTiler *tiler;
+    uint32_t worker;
+} DDTileWorker;
+
+/*
+ * The workers are started once and sleep on @wake between frames. A run
+ * publishes the job and bumps @generation, the caller takes tiles like any
+ * worker and then waits on @idle for the others to finish theirs.
+ */
+struct _DDTiler {
+    uint32_t threads;
+    uint32_t tile_rows;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t tids[DD_TILER_MAX_THREADS];
+    DDTileWorker workers[DD_TILER_MAX_THREADS];
+    uint32_t started;
+    DDTileJob job;
+    uint64_t generation;
+    uint32_t busy;
+    int quit;
+    /* blur rows of each worker */
+    uint8_t *scratch;
+    uint32_t scratch_size;
+    /* histogram of each strip */
+    uint32_t (*hists)[DD_HIST_BINS];
+    uint32_t cap_hists;
+};
+
+static void
+tile_drain (DDTileJob *job, uint32_t worker)
+{
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+        job->fn (job->arg, i, worker);
+}
+
+static void *
+tile_worker (void *data)
+{
+    DDTileWorker *w = (DDTileWorker *) data;
+    DDTiler *tiler = w->tiler;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock (&tiler->lock);
+    for (;;) {
+        while (!tiler->quit && tiler->generation == seen)
+            pthread_cond_wait (&tiler->wake, &tiler->lock);
+        if (tiler->quit)
+            break;
+        seen = tiler->generation;
+        pthread_mutex_unlock (&tiler->lock);
+
+        tile_drain (&tiler->job, w->worker);
+
+        pthread_mutex_lock (&tiler->lock);
+        if (--tiler->busy == 0)
+            pthread_cond_signal (&tiler->idle);
+    }
+    pthread_mutex_unlock (&tiler->lock);
+    return NULL;
+}
+
+uint32_t
+dd_tiler_share (uint32_t users)
+{
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (n <= 0 || !users || (uint32_t) n <= users)
+        return 1;
+    return (uint32_t) n / users;
+}
+
+DDTiler *
+dd_tiler_for (DDTiler **tiler, uint32_t tile_threads, uint32_t tile_rows, uint32_t users,
+              uint32_t width, uint32_t height)
+{
+    uint32_t threads = tile_threads ? tile_threads : dd_tiler_share (users);
+
+    if (threads <= 1 && width <= DD_ACCEL_MAX_WIDTH && height <= DD_ACCEL_MAX_HEIGHT)
+        return NULL;
+    if (!*tiler)
+        *tiler = dd_tiler_new (threads, tile_rows);
+    return *tiler;
+}
+
+DDTiler *
+dd_tiler_new (uint32_t threads, uint32_t tile_rows)
+{
+    DDTiler *tiler = (DDTiler *) calloc (1, sizeof (DDTiler));
+    uint32_t i;
+
+    if (!tiler)
+        return NULL;
+    if (!threads) {
+        long n = sysconf (_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (uint32_t) n : 1;
+    }
+    if (threads > DD_TILER_MAX_THREADS)
+        threads = DD_TILER_MAX_THREADS;
+    tiler->threads = threads;
+    tiler->tile_rows = tile_rows;
+    pthread_mutex_init (&tiler->lock, NULL);
+    pthread_cond_init (&tiler->wake, NULL);
+    pthread_cond_init (&tiler->idle, NULL);
+
+    /* the caller is worker 0, a worker that fails to start leaves its tiles to the others */
+    for (i = 1; i < threads; i++) {
+        DDTileWorker *w = &tiler->workers[tiler->started];
+        w->tiler = tiler;
+        w->worker = tiler->started + 1;
+        if (pthread_create (&tiler->tids[tiler->started], NULL, tile_worker, w) != 0)
+            break;
+        tiler->started++;
+    }
+    return tiler;
+}
+
+void
+dd_tiler_free (DDTiler *tiler)
+{
+    uint32_t i;
+
+    if (!tiler)
+        return;
+    pthread_mutex_lock (&tiler->lock);
+    tiler->quit = 1;
+    pthread_cond_broadcast (&tiler->wake);
+    pthread_mutex_unlock (&tiler->lock);
+    for (i = 0; i < tiler->started; i++)
+        pthread_join (tiler->tids[i], NULL);
+    pthread_cond_destroy (&tiler->idle);
+    pthread_cond_destroy (&tiler->wake);
+    pthread_mutex_destroy (&tiler->lock);
+    free (tiler->scratch);
+    free (tiler->hists);
+    free (tiler);
+}
+
+uint32_t
+dd_tiler_threads (const DDTiler *tiler)
+{
+    return tiler->threads;
+}
+
+uint32_t
+dd_tiler_strips (const DDTiler *tiler, uint32_t height, uint32_t *rows)
+{
+    uint32_t r = tiler->tile_rows;
+
+    if (!r)
+        r = (height + tiler->threads - 1) / tiler->threads;
+    /* a seam costs a row compare, a strip below a few rows costs more */
+    if (r < 8)
+        r = 8;
+    *rows = r;
+    return height ? (height + r - 1) / r : 0;
+}
+
+void
+dd_tiler_run (DDTiler *tiler, uint32_t n, DDTileFunc fn, void *arg)
+{
+    if (!tiler->started || n < 2) {
+        DDTileJob job = { n, fn, arg, 0 };
+        tile_drain (&job, 0);
+        return;
+    }
+
+    pthread_mutex_lock (&tiler->lock);
+    tiler->job.n = n;
+    tiler->job.fn = fn;
+    tiler->job.arg = arg;
+    tiler->job.next = 0;
+    tiler->busy = tiler->started;
+    tiler->generation++;
+    pthread_cond_broadcast (&tiler->wake);
+    pthread_mutex_unlock (&tiler->lock);
+
+    tile_drain (&tiler->job, 0);
+
+    pthread_mutex_lock (&tiler->lock);
+    while (tiler->busy)
+        pthread_cond_wait (&tiler->idle, &tiler->lock);
+    pthread_mutex_unlock (&tiler->lock);
+}
+
+static int
+tiler_reserve (DDTiler *tiler, uint32_t width, uint32_t strips)
+{
+    uint32_t size = dd_cpu_blur_scratch_size (width);
+
+    if (size * tiler->threads > tiler->scratch_size) {
+        uint8_t *p = (uint8_t *) realloc (tiler->scratch, (size_t) size * tiler->threads);
+        if (!p)
+            return -1;
+        tiler->scratch = p;
+        tiler->scratch_size = size * tiler->threads;
+    }
+    if (strips > tiler->cap_hists) {
+        void *p = realloc (tiler->hists, (size_t) strips * sizeof (tiler->hists[0]));
+        if (!p)
+            return -1;
+        tiler->hists = (uint32_t (*)[DD_HIST_BINS]) p;
+        tiler->cap_hists = strips;
+    }
+    return 0;
+}
+
+static void
+tiler_hist_sum (DDTiler *tiler, uint32_t strips, uint32_t hist[DD_HIST_BINS])
+{
+    uint32_t i, s;
+
+    memset (hist, 0, DD_HIST_BINS * sizeof (uint32_t));
+    for (s = 0; s < strips; s++)
+        for (i = 0; i < DD_HIST_BINS; i++)
+            hist[i] += tiler->hists[s][i];
+}
+
+typedef struct {
+    DDTiler *tiler;
+    const uint8_t *src;
+    uint32_t src_stride;
+    uint8_t *dst;
+    uint32_t dst_stride;
+    uint32_t width, height, rows;
+    int32_t thresh;
+    uint8_t max_value;
+    int with_hist;
+} DDTileFrame;
+
+static void
+gaussian_tile (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDTileFrame *f = (DDTileFrame *) arg;
+    uint32_t y0 = tile * f->rows;
+    uint32_t y1 = y0 + f->rows < f->height ? y0 + f->rows : f->height;
+    uint8_t *scratch = f->tiler->scratch + (size_t) worker * dd_cpu_blur_scratch_size (f->width);
+
+    dd_cpu_gaussian_hist_rows (f->src, f->src_stride, f->dst, f->dst_stride, f->width, f->height,
+                               y0, y1, scratch, f->with_hist ? f->tiler->hists[tile] : NULL);
+}
+
+int
+dd_tiler_gaussian_hist (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                        uint32_t dst_stride, uint32_t width, uint32_t height,
+                        uint32_t hist[DD_HIST_BINS])
+{
+    DDTileFrame f = { tiler, src, src_stride, dst, dst_stride, width, height, 0, 0, 0, hist != NULL };
+    uint32_t strips = dd_tiler_strips (tiler, height, &f.rows);
+
+    if (tiler_reserve (tiler, width, strips) < 0)
+        return -1;
+    dd_tiler_run (tiler, strips, gaussian_tile, &f);
+    if (hist)
+        tiler_hist_sum (tiler, strips, hist);
+    return 0;
+}
+
+static void
+histogram_tile (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDTileFrame *f = (DDTileFrame *) arg;
+    uint32_t y0 = tile * f->rows;
+    uint32_t n = y0 + f->rows < f->height ? f->rows : f->height - y0;
+
+    (void) worker;
+    dd_cpu_histogram (f->src + (size_t) y0 * f->src_stride, f->src_stride, f->width, n,
+                      f->tiler->hists[tile]);
+}
+
+int
+dd_tiler_histogram (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint32_t width,
+                    uint32_t height, uint32_t hist[DD_HIST_BINS])
+{
+    DDTileFrame f = { tiler, src, src_stride, NULL, 0, width, height, 0, 0, 0, 1 };
+    uint32_t strips = dd_tiler_strips (tiler, height, &f.rows);
+
+    if (tiler_reserve (tiler, width, strips) < 0)
+        return -1;
+    dd_tiler_run (tiler, strips, histogram_tile, &f);
+    tiler_hist_sum (tiler, strips, hist);
+    return 0;
+}
+
+static void
+threshold_tile (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDTileFrame *f = (DDTileFrame *) arg;
+    uint32_t y0 = tile * f->rows;
+    uint32_t n = y0 + f->rows < f->height ? f->rows : f->height - y0;
+
+    (void) worker;
+    dd_cpu_threshold (f->src + (size_t) y0 * f->src_stride, f->src_stride,
+                      f->dst + (size_t) y0 * f->dst_stride, f->dst_stride,
+                      f->width, n, f->thresh, f->max_value);
+}
+
+void
+dd_tiler_threshold (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint8_t *dst,
+                    uint32_t dst_stride, uint32_t width, uint32_t height,
+                    int32_t thresh, uint8_t max_value)
+{
+    DDTileFrame f = { tiler, src, src_stride, dst, dst_stride, width, height, 0, thresh, max_value, 0 };
+    uint32_t strips = dd_tiler_strips (tiler, height, &f.rows);
+
+    dd_tiler_run (tiler, strips, threshold_tile, &f);
+}
+
+static void
+threshold_bits_tile (void *arg, uint32_t tile, uint32_t worker)
+{
+    DDTileFrame *f = (DDTileFrame *) arg;
+    uint32_t y0 = tile * f->rows;
+    uint32_t n = y0 + f->rows < f->height ? f->rows : f->height - y0;
+
+    (void) worker;
+    dd_cpu_threshold_bits (f->src + (size_t) y0 * f->src_stride, f->src_stride,
+                           f->dst + (size_t) y0 * f->dst_stride, f->dst_stride,
+                           f->width, n, f->thresh);
+}
+
+void
+dd_tiler_threshold_bits (DDTiler *tiler, const uint8_t *src, uint32_t src_stride, uint8_t *bits,
+                         uint32_t bits_stride, uint32_t width, uint32_t height, int32_t thresh)
+{
+    DDTileFrame f = { tiler, src, src_stride, bits, bits_stride, width, height, 0, thresh, 0, 0 };
+    uint32_t strips = dd_tiler_strips (tiler, height, &f.rows);
+
+    dd_tiler_run (tiler, strips, threshold_bits_tile, &f);
+}
+
+uint32_t
+dd_accel_bands (const DDRoi *roi, uint32_t width, uint32_t height, int packed, DDRoi *area)
+{
+    uint32_t n;
+
+    if (packed) {
+        *area = dd_roi_band (roi, width);
+    } else {
+        area->x = area->y = 0;
+        area->width = width;
+        area->height = height;
+    }
+    if (area->width > DD_ACCEL_MAX_WIDTH || !area->height)
+        return 0;
+    n = (area->height + DD_ACCEL_MAX_HEIGHT - 1) / DD_ACCEL_MAX_HEIGHT;
+    /* bands are addressed by row offset, padded rows would be misread */
+    return n > 1 && !packed ? 0 : n;
+}
+
+DDRoi
+dd_accel_band_at (const DDRoi *area, uint32_t index)
+{
+    DDRoi band = *area;
+    uint32_t y = index * DD_ACCEL_MAX_HEIGHT;
+
+    band.y = area->y + y;
+    band.height = area->height - y < DD_ACCEL_MAX_HEIGHT ? area->height - y : DD_ACCEL_MAX_HEIGHT;
+    return band;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "dd_stats.h"
+
+/* 4 buckets per power of two up to 2^41 ns, about 36 minutes */
+#define DD_STATS_SUB_BITS       2
+#define DD_STATS_BUCKETS        160
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[DD_STATS_BUCKETS];
+} DDHist;
+
+static DDHist dd_hists[DD_STATS_NUM_STAGES][DD_STATS_NUM_PHASES];
+static uint64_t dd_timeouts[DD_STATS_NUM_STAGES];
+
+static struct {
+    uint64_t allocated_bytes;
+    uint64_t peak_bytes;
+    uint64_t in_use_bytes;
+    uint64_t leases;
+    uint64_t reused;
+} dd_buffers;
+
+static const char *dd_stage_names[DD_STATS_NUM_STAGES] = {
+    "otsu", "preprocess", "cca", "fused", "overlay", "pipeline",
+};
+
+static const char *dd_phase_names[DD_STATS_NUM_PHASES] = {
+    "submit", "exec", "meta", "total",
+};
+
+uint64_t
+dd_stats_clock_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned
+bucket_of (uint64_t ns)
+{
+    unsigned msb, idx;
+    if (ns < (1u << DD_STATS_SUB_BITS))
+        return (unsigned) ns;
+    msb = 63 - __builtin_clzll (ns);
+    idx = ((msb - DD_STATS_SUB_BITS + 1) << DD_STATS_SUB_BITS)
+          + ((ns >> (msb - DD_STATS_SUB_BITS)) & ((1u << DD_STATS_SUB_BITS) - 1));
+    return idx < DD_STATS_BUCKETS ? idx : DD_STATS_BUCKETS - 1;
+}
+
+/* Largest value that falls into bucket @idx */
+static uint64_t
+bucket_upper (unsigned idx)
+{
+    unsigned shift, sub;
+    if (idx < (1u << DD_STATS_SUB_BITS))
+        return idx;
+    shift = (idx >> DD_STATS_SUB_BITS) - 1;
+    sub = idx & ((1u << DD_STATS_SUB_BITS) - 1);
+    return (((uint64_t) ((1u << DD_STATS_SUB_BITS) + sub + 1)) << shift) - 1;
+}
+
+void
+dd_stats_record (DDStatsStage stage, DDStatsPhase phase, uint64_t ns)
+{
+    DDHist *h = &dd_hists[stage][phase];
+    uint64_t max = __atomic_load_n (&h->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch (&h->buckets[bucket_of (ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&h->count, 1, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n (&h->max_ns, &max, ns, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t
+dd_stats_frame_begin (DDStatsFrame *frame)
+{
+    memset (frame->phase_ns, 0, sizeof (frame->phase_ns));
+    frame->start_ns = dd_stats_clock_ns ();
+    return frame->start_ns;
+}
+
+uint64_t
+dd_stats_frame_add (DDStatsFrame *frame, DDStatsPhase phase, uint64_t since)
+{
+    uint64_t now = dd_stats_clock_ns ();
+    frame->phase_ns[phase] += now - since;
+    return now;
+}
+
+void
+dd_stats_frame_commit (DDStatsFrame *frame, DDStatsStage stage)
+{
+    int phase;
+    for (phase = 0; phase < DD_STATS_TOTAL; phase++) {
+        if (frame->phase_ns[phase])
+            dd_stats_record (stage, (DDStatsPhase) phase, frame->phase_ns[phase]);
+    }
+    dd_stats_record (stage, DD_STATS_TOTAL, dd_stats_clock_ns () - frame->start_ns);
+}
+
+void
+dd_stats_timeout (DDStatsStage stage)
+{
+    __atomic_add_fetch (&dd_timeouts[stage], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+dd_stats_timeouts (DDStatsStage stage)
+{
+    return __atomic_load_n (&dd_timeouts[stage], __ATOMIC_RELAXED);
+}
+
+void
+dd_stats_buffer_alloc (uint64_t bytes)
+{
+    uint64_t now = __atomic_add_fetch (&dd_buffers.allocated_bytes, bytes, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n (&dd_buffers.peak_bytes, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n (&dd_buffers.peak_bytes, &peak, now, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void
+dd_stats_buffer_free (uint64_t bytes)
+{
+    __atomic_sub_fetch (&dd_buffers.allocated_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+dd_stats_buffer_lease (uint64_t bytes, int reused)
+{
+    __atomic_add_fetch (&dd_buffers.in_use_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&dd_buffers.leases, 1, __ATOMIC_RELAXED);
+    if (reused)
+        __atomic_add_fetch (&dd_buffers.reused, 1, __ATOMIC_RELAXED);
+}
+
+void
+dd_stats_buffer_return (uint64_t bytes)
+{
+    __atomic_sub_fetch (&dd_buffers.in_use_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+const char *
+dd_stats_stage_name (DDStatsStage stage)
+{
+    return dd_stage_names[stage];
+}
+
+const char *
+dd_stats_phase_name (DDStatsPhase phase)
+{
+    return dd_phase_names[phase];
+}
+
+static uint64_t
+percentile_ns (const uint64_t *buckets, uint64_t count, uint64_t max_ns, double p)
+{
+    uint64_t rank = (uint64_t) (p * count + 0.999999), seen = 0;
+    unsigned i;
+    for (i = 0; i < DD_STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_upper (i);
+            return v < max_ns ? v : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+int
+dd_stats_summary (DDStatsStage stage, DDStatsPhase phase, DDStatsSummary *summary)
+{
+    DDHist *h = &dd_hists[stage][phase];
+    uint64_t buckets[DD_STATS_BUCKETS];
+    uint64_t count = 0;
+    unsigned i;
+
+    /* a snapshot, frames recorded meanwhile may be half counted */
+    for (i = 0; i < DD_STATS_BUCKETS; i++) {
+        buckets[i] = __atomic_load_n (&h->buckets[i], __ATOMIC_RELAXED);
+        count += buckets[i];
+    }
+    if (!count)
+        return 0;
+    summary->count = count;
+    summary->sum_ns = __atomic_load_n (&h->sum_ns, __ATOMIC_RELAXED);
+    summary->max_ns = __atomic_load_n (&h->max_ns, __ATOMIC_RELAXED);
+    summary->p50_ns = percentile_ns (buckets, count, summary->max_ns, 0.50);
+    summary->p90_ns = percentile_ns (buckets, count, summary->max_ns, 0.90);
+    summary->p99_ns = percentile_ns (buckets, count, summary->max_ns, 0.99);
+    return 1;
+}
+
+void
+dd_stats_dump (FILE *fp)
+{
+    DDStatsSummary sum;
+    int stage, phase, first_stage = 1;
+
+    fprintf (fp, "{\"time_ns\":%llu", (unsigned long long) dd_stats_clock_ns ());
+    for (stage = 0; stage < DD_STATS_NUM_STAGES; stage++) {
+        int first_phase = 1;
+        if (!__atomic_load_n (&dd_hists[stage][DD_STATS_TOTAL].count, __ATOMIC_RELAXED))
+            continue;
+        fprintf (fp, "%s\"%s\":{", first_stage ? ",\"stages\":{" : ",", dd_stage_names[stage]);
+        first_stage = 0;
+        for (phase = 0; phase < DD_STATS_NUM_PHASES; phase++) {
+            if (!dd_stats_summary ((DDStatsStage) stage, (DDStatsPhase) phase, &sum))
+                continue;
+            fprintf (fp, "%s\"%s\":{\"count\":%llu,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+                     "\"p99_us\":%.1f,\"max_us\":%.1f}", first_phase ? "" : ",", dd_phase_names[phase],
+                     (unsigned long long) sum.count, sum.sum_ns / 1000.0 / sum.count, sum.p50_ns / 1000.0,
+                     sum.p90_ns / 1000.0, sum.p99_ns / 1000.0, sum.max_ns / 1000.0);
+            first_phase = 0;
+        }
+        fprintf (fp, ",\"timeouts\":%llu}", (unsigned long long) dd_stats_timeouts ((DDStatsStage) stage));
+    }
+    fprintf (fp, "%s", first_stage ? "" : "}");
+    if (__atomic_load_n (&dd_buffers.peak_bytes, __ATOMIC_RELAXED))
+        fprintf (fp, ",\"buffers\":{\"allocated_bytes\":%llu,\"peak_bytes\":%llu,\"in_use_bytes\":%llu,"
+                 "\"leases\":%llu,\"reused\":%llu}",
+                 (unsigned long long) __atomic_load_n (&dd_buffers.allocated_bytes, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n (&dd_buffers.peak_bytes, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n (&dd_buffers.in_use_bytes, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n (&dd_buffers.leases, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n (&dd_buffers.reused, __ATOMIC_RELAXED));
+    fprintf (fp, "}\n");
+    fflush (fp);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Process-wide latency histograms of the defect-detect elements.
+ *
+ * libdd_stats.so is shared by the kernel libraries, which record how long
+ * every frame spent in each phase of their stage, and the application,
+ * which dumps the histograms. Recording is a handful of relaxed atomic
+ * adds, safe from any streaming thread. Buckets are log-linear: four per
+ * power of two, so percentiles are within 25% of the true value.
+ */
+
+#ifndef __DD_STATS_H__
+#define __DD_STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    DD_STATS_OTSU,
+    DD_STATS_PREPROCESS,
+    DD_STATS_CCA,
+    DD_STATS_FUSED,
+    DD_STATS_OVERLAY,
+    /* glass to decision, recorded by the app with DD_STATS_TOTAL only */
+    DD_STATS_PIPELINE,
+    DD_STATS_NUM_STAGES,
+} DDStatsStage;
+
+typedef enum {
+    DD_STATS_SUBMIT,        /* issuing the accelerator command */
+    DD_STATS_EXEC,          /* vvas_kernel_start to vvas_kernel_done, or the CPU kernel */
+    DD_STATS_META,          /* reading and writing the defect meta */
+    DD_STATS_TOTAL,         /* xlnx_kernel_start entry to xlnx_kernel_done exit */
+    DD_STATS_NUM_PHASES,
+} DDStatsPhase;
+
+/* Snapshot of one histogram, times in nanoseconds */
+typedef struct _DDStatsSummary {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+} DDStatsSummary;
+
+/* Phase times of the frame an element is working on */
+typedef struct _DDStatsFrame {
+    uint64_t start_ns;
+    uint64_t phase_ns[DD_STATS_NUM_PHASES];
+} DDStatsFrame;
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t dd_stats_clock_ns (void);
+
+void dd_stats_record (DDStatsStage stage, DDStatsPhase phase, uint64_t ns);
+
+/* Starts timing a frame, returns the start time */
+uint64_t dd_stats_frame_begin (DDStatsFrame *frame);
+
+/* Charges the time since @since to @phase and returns the current time */
+uint64_t dd_stats_frame_add (DDStatsFrame *frame, DDStatsPhase phase, uint64_t since);
+
+/* Records the phases that ran and the total time since dd_stats_frame_begin() */
+void dd_stats_frame_commit (DDStatsFrame *frame, DDStatsStage stage);
+
+/* Counts a vvas_kernel_done that failed or timed out */
+void dd_stats_timeout (DDStatsStage stage);
+uint64_t dd_stats_timeouts (DDStatsStage stage);
+
+const char *dd_stats_stage_name (DDStatsStage stage);
+const char *dd_stats_phase_name (DDStatsPhase phase);
+
+/* Device memory of the shared buffer pool in src/dd_buffers.c, in bytes */
+void dd_stats_buffer_alloc (uint64_t bytes);
+void dd_stats_buffer_free (uint64_t bytes);
+/* @reused is 1 when the lease was served from the pool without allocating */
+void dd_stats_buffer_lease (uint64_t bytes, int reused);
+void dd_stats_buffer_return (uint64_t bytes);
+
+/* Fills @summary, returns 0 when nothing was recorded for @stage and @phase yet */
+int dd_stats_summary (DDStatsStage stage, DDStatsPhase phase, DDStatsSummary *summary);
+
+/*
+ * Writes the histograms accumulated since startup as one JSON object on a
+ * single line: count, mean and p50/p90/p99/max in microseconds for every
+ * phase of every stage that ran, then the device memory held by the buffer
+ * pool once it allocated any.
+ */
+void dd_stats_dump (FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DD_STATS_H__ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "gstdefectmeta.h"
+
+#define FIELDS_OFFSET   (sizeof (GstMeta))
+#define FIELDS_SIZE     (sizeof (GstDefectMeta) - sizeof (GstMeta))
+
+GType
+gst_defect_meta_api_get_type (void)
+{
+  static GType type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register ("GstDefectMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return type;
+}
+
+static gboolean
+gst_defect_meta_init (GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+  memset ((guint8 *) meta + FIELDS_OFFSET, 0, FIELDS_SIZE);
+  return TRUE;
+}
+
+static gboolean
+gst_defect_meta_transform (GstBuffer *dest, GstMeta *meta, GstBuffer *buffer,
+    GQuark type, gpointer data)
+{
+  GstDefectMeta *dmeta;
+
+  /* the values describe the whole frame, only plain copies carry them */
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  dmeta = gst_buffer_acquire_defect_meta (dest);
+  if (!dmeta)
+    return FALSE;
+  memcpy ((guint8 *) dmeta + FIELDS_OFFSET, (guint8 *) meta + FIELDS_OFFSET, FIELDS_SIZE);
+  return TRUE;
+}
+
+const GstMetaInfo *
+gst_defect_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) &meta_info)) {
+    const GstMetaInfo *mi = gst_meta_register (GST_DEFECT_META_API_TYPE,
+        "GstDefectMeta", sizeof (GstDefectMeta), gst_defect_meta_init,
+        NULL, gst_defect_meta_transform);
+    g_once_init_leave ((GstMetaInfo **) &meta_info, (GstMetaInfo *) mi);
+  }
+  return meta_info;
+}
+
+GstDefectMeta *
+gst_buffer_acquire_defect_meta (GstBuffer *buffer)
+{
+  GstDefectMeta *meta = gst_buffer_get_defect_meta (buffer);
+
+  if (!meta) {
+    meta = (GstDefectMeta *) gst_buffer_add_meta (buffer, GST_DEFECT_META_INFO, NULL);
+    if (meta)
+      GST_META_FLAG_SET ((GstMeta *) meta, GST_META_FLAG_POOLED);
+  }
+  return meta;
+}
+
+void
+gst_defect_meta_reset (GstDefectMeta *meta)
+{
+  guint64 capture_ns = meta->capture_ns;
+
+  memset ((guint8 *) meta + FIELDS_OFFSET, 0, FIELDS_SIZE);
+  meta->capture_ns = capture_ns;
+}
+
+guint64
+gst_defect_meta_clock_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (guint64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fixed-layout per-frame result of the defect-detect stages.
+ *
+ * Replaces the GstInferenceMeta prediction tree the plugins used to build
+ * for every frame: all fields are stored by value, nothing hangs off the
+ * meta, and the meta is flagged POOLED so a buffer coming back from its pool
+ * keeps it and the next frame just overwrites the fields.
+ */
+
+#ifndef __GST_DEFECT_META_H__
+#define __GST_DEFECT_META_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_DEFECT_META_API_TYPE        (gst_defect_meta_api_get_type ())
+#define GST_DEFECT_META_INFO            (gst_defect_meta_get_info ())
+#define GST_DEFECT_META_MAX_BLOBS       16
+
+typedef struct _GstDefectMeta GstDefectMeta;
+
+typedef enum {
+  GST_DEFECT_STAGE_OTSU,
+  GST_DEFECT_STAGE_PREPROCESS,
+  GST_DEFECT_STAGE_CCA,
+  /* the fused element, which replaces the three stages above */
+  GST_DEFECT_STAGE_FUSED,
+  GST_DEFECT_NUM_STAGES,
+} GstDefectStage;
+
+/* Which fields of the meta were written for the current frame */
+typedef enum {
+  GST_DEFECT_META_HAS_THRESHOLD = (1 << 0),
+  GST_DEFECT_META_HAS_COUNTS    = (1 << 1),
+  GST_DEFECT_META_HAS_BLOBS     = (1 << 2),
+  /* set by text2overlay when the defect density is above its threshold */
+  GST_DEFECT_META_DEFECTIVE     = (1 << 3),
+  /* roi_* hold the rectangle the stages processed, else the whole frame */
+  GST_DEFECT_META_HAS_ROI       = (1 << 4),
+  /* the buffer holds the ROI's mask at 1 bit per pixel, see DD_MASK_BITS_STRIDE() */
+  GST_DEFECT_META_MASK_BITS     = (1 << 5),
+} GstDefectMetaFlags;
+
+typedef struct _GstDefectBlob {
+  guint32 x, y, width, height;
+  guint32 area;
+  gfloat cx, cy;
+} GstDefectBlob;
+
+struct _GstDefectMeta {
+  GstMeta meta;
+
+  guint32 flags;
+  guint32 otsu_thr;
+  guint32 mango_pix;
+  guint32 defect_pix;
+  /* region of interest, set by the first stage; pixels outside it are 0 */
+  guint32 roi_x, roi_y, roi_width, roi_height;
+  /* bit mask rows, from the start of the buffer, and the byte value of fruit */
+  guint32 mask_stride;
+  guint32 mask_value;
+  /* processing time of each stage for this frame, 0 if it did not run */
+  guint64 stage_ns[GST_DEFECT_NUM_STAGES];
+  /* CLOCK_MONOTONIC time the frame entered the pipeline, stamped by the app */
+  guint64 capture_ns;
+  /* largest defects first */
+  guint32 num_blobs;
+  GstDefectBlob blobs[GST_DEFECT_META_MAX_BLOBS];
+};
+
+GType gst_defect_meta_api_get_type (void);
+const GstMetaInfo *gst_defect_meta_get_info (void);
+
+#define gst_buffer_get_defect_meta(b) \
+  ((GstDefectMeta *) gst_buffer_get_meta ((b), GST_DEFECT_META_API_TYPE))
+
+/*
+ * Returns the defect meta of @buffer, adding it on first use. Values from
+ * upstream stages, or from the previous frame of a pooled buffer, are kept;
+ * the first stage of the chain clears them with gst_defect_meta_reset(),
+ * which keeps only the capture time.
+ */
+GstDefectMeta *gst_buffer_acquire_defect_meta (GstBuffer *buffer);
+void gst_defect_meta_reset (GstDefectMeta *meta);
+
+/* CLOCK_MONOTONIC in nanoseconds, the time base of stage_ns */
+guint64 gst_defect_meta_clock_ns (void);
+
+G_END_DECLS
+
+#endif /* __GST_DEFECT_META_H__ */
@@ -16,14 +16,26 @@
  */
 
 #include <gst/gst.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
 #include <gst/video/videooverlay.h>
 #include <gst/video/video.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <memory>
 #include <stdexcept>
 #include <glob.h>
 #include <sstream>
+#include <map>
+#include <jansson.h>
+#include "gstdefectmeta.h"
+#include "dd_stats.h"
+#include "dd_capture.h"
+#include "dd_config.h"
 
 using namespace std;
 
@@ -33,14 +45,32 @@ GST_DEBUG_CATEGORY (defectdetect_app);
 #define PRE_PROCESS_JSON_FILE        "preprocess-accelarator.json"
 #define OTSU_ACC_JSON_FILE           "otsu-accelarator.json"
 #define CCA_ACC_JSON_FILE            "cca-accelarator.json"
+#define FUSED_JSON_FILE              "fused-accelarator.json"
 #define TEXT_2_OVERLAY_JSON_FILE     "text2overlay.json"
 #define DRM_BUS_ID                   "B0010000.v_mix"
 #define CAPTURE_FORMAT_Y8            "GRAY8"
 #define MAX_WIDTH                    1280
 #define MAX_HEIGHT                   800
+/* headless, larger frames are tiled by the kernels */
+#define MAX_TILED_WIDTH              4096
+#define MAX_TILED_HEIGHT             4096
 #define MAX_FRAME_RATE_DENOM         1
 #define MAX_DEMO_MODE_FRAME_RATE     4
 #define BASE_PLANE_ID                34
+#define MAX_STREAMS                  8
+#define MAX_DISPLAY_STREAMS          3
+#define LIVE_SOURCE_PREFIX           "/dev/media"
+#define NUM_METRIC_QUEUES            5
+#define METRICS_READ_TIMEOUT_S       1
+#define METRICS_MAX_THREADS          2
+#define LATENCY_CHECK_INTERVAL_MS    100
+#define LATENCY_CALM_CHECKS          10
+#define LATENCY_QUEUE_PRESSURE       2
+#define PREVIEW_DECIMATION           4
+#define DEFAULT_DEFECT_THRESHOLD     0.14
+#define VERDICT_LOG_HEADER           "stream,frame,otsu_thr,mango_pix,defect_pix,density,defective"
+#define MAX_REPORTED_DIFFS           20
+#define CAPTURE_QUEUE_FRAMES         4
 
 typedef enum {
     DD_SUCCESS,
@@ -51,32 +81,113 @@ typedef enum {
     DD_ERROR_RESOLUTION_NOT_SUPPORTED = -5,
     DD_ERROR_INPUT_OPTIONS_INVALID = -6,
     DD_ERROR_OVERLAY_CREATION_FAIL = -7,
+    DD_ERROR_REPLAY_MISMATCH = -8,
+    DD_ERROR_PIPELINE_RUN_FAIL = -9,
     DD_ERROR_OTHER = -99,
 } DD_ERROR_LOG;
 
+/* Where the latency budget drops frames */
+typedef enum {
+    BUDGET_BRANCH_RAW,          /* raw preview */
+    BUDGET_BRANCH_PREPROCESS,   /* pre-process preview */
+    BUDGET_BRANCH_FINAL,        /* final display, after the decision */
+    BUDGET_BRANCH_INSPECT,      /* stale frames before otsu */
+    NUM_BUDGET_BRANCHES,
+} BUDGET_BRANCH;
+
+/*
+ * Degradation steps of the latency budget. Each one keeps what the
+ * previous one does.
+ */
+typedef enum {
+    LATENCY_LEVEL_NORMAL,
+    /* preview queues leak and show 1 frame in PREVIEW_DECIMATION */
+    LATENCY_LEVEL_PREVIEW,
+    /* the inspection queue leaks, frames older than the budget are dropped
+     * before otsu and the final display skips frames too */
+    LATENCY_LEVEL_INSPECT,
+} LATENCY_LEVEL;
+
+/* --capture outputs of a stream */
+typedef enum {
+    CAPTURE_RAW,
+    CAPTURE_PREPROCESS,
+    CAPTURE_FINAL,
+    NUM_CAPTURES,
+} CAPTURE_OUTPUT;
+
+typedef struct _CaptureOut {
+    DDCaptureWriter *writer;
+    const gchar *path;
+    guint64 frames;
+} CaptureOut;
+
 typedef struct _AppData {
     GstElement *pipeline, *capsfilter, *src, *rawvideoparse;
     GstElement *sink_raw, *sink_preprocess, *sink_display;
     GstElement *tee_raw, *tee_preprocess;
-    GstElement *queue_raw, *queue_raw2, *queue_preprocess, *queue_preprocess2;
+    GstElement *queue_raw, *queue_raw2, *queue_preprocess, *queue_preprocess2, *queue_otsu;
     GstElement *perf_raw, *perf_preprocess, *perf_display;
     GstElement *videorate_raw, *videorate_preprocess, *videorate_display;
-    GstElement *preprocess, *otsu, *cca, *text2overlay;
+    GstElement *preprocess, *otsu, *cca, *fused, *text2overlay;
     GstElement *capsfilter_raw, *capsfilter_preprocess, *capsfilter_display;
     GstPad *pad_raw, *pad_raw2, *pad_preprocess, *pad_preprocess2;
     GstVideoOverlay  *overlay_raw, *overlay_preprocess, *overlay_display;
+    /* one inspection pipeline per source, all in the same GstPipeline */
+    guint index;
+    gboolean file_playback;
+    gchar *source;
+    /* --mmap input, frames are views of the mapping pushed by mapped_need_data_cb */
+    GMappedFile *mapping;
+    gsize frame_offset;
+    guint64 frames_pushed;
+    guint loops_done;
+    gchar *raw_out, *preprocess_out, *final_out;
+    CaptureOut captures[NUM_CAPTURES];
+    /* written from the streaming threads, read by the metrics endpoint */
+    guint64 frames, defective_frames;
+    guint32 otsu_thr;
+    guint64 overruns[NUM_METRIC_QUEUES];
+    /* latency budget state, see latency_check_cb */
+    guint64 window_max_ns;
+    guint level;
+    guint calm_checks;
+    guint64 branch_frames[NUM_BUDGET_BRANCHES];
+    guint64 budget_drops[NUM_BUDGET_BRANCHES];
 } AppData;
 
 GMainLoop *loop;
+/* set by message_cb, the run ended on an error rather than at EOS */
+gboolean pipeline_error = FALSE;
 gboolean file_playback = FALSE;
 gboolean file_dump = FALSE;
 gboolean demo_mode = FALSE;
+guint pipelined = 0;
+gboolean fused = FALSE;
+gboolean headless = FALSE;
+gboolean mmap_input = FALSE;
+gboolean capture = FALSE;
+gboolean watch_config = FALSE;
+guint loops = 1;
+/* density above which a frame is defective, text2overlay's defect_threshold, reloadable */
+gdouble defect_threshold = DEFAULT_DEFECT_THRESHOLD;
 static gchar* in_file = NULL;
 static gchar* config_path  = (gchar *)"/opt/xilinx/kv260-defect-detect/share/vvas/";
 static gchar *msg_firmware = (gchar *)"Load the HW accelerator firmware first. Use command: xmutil loadapp kv260-defect-detect\n";
 static gchar* final_out = NULL;
 static gchar* preprocess_out = NULL;
 static gchar* raw_out = NULL;
+static gchar* sources = NULL;
+static gchar* stats_out = NULL;
+static FILE *stats_fp = NULL;
+static gchar* verdict_log = NULL;
+static gchar* golden_log = NULL;
+static FILE *verdict_fp = NULL;
+guint stats_interval = 0;
+guint metrics_port = 0;
+guint latency_budget = 0;
+guint num_streams = 1;
+guint batch = 1;
 guint width = 1280;
 guint height = 800;
 guint framerate = 60;
@@ -93,6 +204,21 @@ static GOptionEntry entries[] =
     { "framerate",    'r', 0, G_OPTION_ARG_INT, &framerate, "Framerate of the input source", "60"},
     { "demomode",     'd', 0, G_OPTION_ARG_INT, &demo_mode, "For Demo mode value must be 1", "0"},
     { "cfgpath",      'c', 0, G_OPTION_ARG_STRING, &config_path, "JSON config file path", "/opt/xilinx/kv260-defect-detect/share/vvas/"},
+    { "pipelined",    'p', 0, G_OPTION_ARG_INT, &pipelined, "Frames queued between otsu and pre-process so they run concurrently, 0 disables", "0"},
+    { "fused",        'f', 0, G_OPTION_ARG_INT, &fused, "Run otsu, pre-process and CCA as one software pass on the CPU, value must be 1", "0"},
+    { "headless",     'e', 0, G_OPTION_ARG_INT, &headless, "Inspection only without display or overlay, one result line per frame on stdout, value must be 1", "0"},
+    { "batch",        'b', 0, G_OPTION_ARG_INT, &batch, "Frames read from the input file at once and queued at every stage, the outputs do not sync to the clock", "1"},
+    { "sources",      's', 0, G_OPTION_ARG_STRING, &sources, "Comma separated input files or media device nodes, one inspection pipeline each", "list"},
+    { "statsinterval",'t', 0, G_OPTION_ARG_INT, &stats_interval, "Seconds between latency statistics dumps, 0 dumps only on SIGUSR1 and at exit", "0"},
+    { "statsout",     'o', 0, G_OPTION_ARG_FILENAME, &stats_out, "Location of latency statistics output file, stdout by default", "file path"},
+    { "metricsport",  'm', 0, G_OPTION_ARG_INT, &metrics_port, "TCP port of the Prometheus metrics endpoint, 0 disables", "0"},
+    { "latencybudget",'l', 0, G_OPTION_ARG_INT, &latency_budget, "Glass-to-decision latency budget in ms, previews and stale frames are dropped to keep it, 0 disables", "0"},
+    { "capture",      'a', 0, G_OPTION_ARG_INT, &capture, "Write the raw, pre-process and final outputs as compressed, indexed capture files with the verdicts of every frame, value must be 1", "0"},
+    { "mmap",         'k', 0, G_OPTION_ARG_INT, &mmap_input, "Map the input files into memory and pass the frames on without copying them, value must be 1", "0"},
+    { "loops",        'n', 0, G_OPTION_ARG_INT, &loops, "Times the mapped input files are played, 0 repeats them until interrupted", "1"},
+    { "verdictlog",   'v', 0, G_OPTION_ARG_FILENAME, &verdict_log, "Replay the input files headless and unthrottled, one CSV verdict line per frame to this file", "file path"},
+    { "watchconfig",  'u', 0, G_OPTION_ARG_INT, &watch_config, "Apply changes to the JSON config files while running, SIGHUP applies them without it, value must be 1", "0"},
+    { "golden",       'g', 0, G_OPTION_ARG_FILENAME, &golden_log, "Verdict log of a reference run the replay must match, differences fail the run", "file path"},
     { NULL }
 };
 
@@ -118,6 +244,13 @@ signal_handler (gint sig) {
      return;
 }
 
+/* Appends one JSON line with the per-stage latency histograms */
+static gboolean
+stats_dump_cb (gpointer user_data) {
+    dd_stats_dump (stats_fp);
+    return G_SOURCE_CONTINUE;
+}
+
 static std::string exec(const char* cmd) {
     std::array<char, 128> buffer;
     std::string result;
@@ -159,6 +292,7 @@ message_cb (GstBus *bus, GstMessage *msg, AppData *data) {
         g_printerr ("Error: %s\n", err->message);
         g_error_free (err);
         g_free (debug);
+        pipeline_error = TRUE;
         if (loop && g_main_loop_is_running (loop)) {
             GST_DEBUG ("Quitting the loop");
             g_main_loop_quit (loop);
@@ -205,17 +339,146 @@ error_to_string (gint error_code) {
         case DD_ERROR_STATE_CHANGE_FAIL :
             return "state change failed";
         case DD_ERROR_RESOLUTION_NOT_SUPPORTED :
-            return "Resolution WxH should be 1280x800";
+            return "Resolution WxH should be at most 1280x800, or 4096x4096 in headless mode";
         case DD_ERROR_INPUT_OPTIONS_INVALID :
             return "Input options are incorrect";
         case DD_ERROR_OVERLAY_CREATION_FAIL :
             return "overlay creation is failed for the display";
+        case DD_ERROR_REPLAY_MISMATCH :
+            return "replay verdicts differ from the golden log";
+        case DD_ERROR_PIPELINE_RUN_FAIL :
+            return "pipeline stopped on an error";
         default :
             return "Unknown Error";
     }
     return "Unknown Error";
 }
 
+/* File playback through appsrc and a mapping of the file instead of filesrc */
+static gboolean
+mapped_input (AppData *data) {
+    return data->file_playback && mmap_input;
+}
+
+/*
+ * Pushes the next frame of the mapping. The GstBuffer wraps the pages of
+ * the file read-only and holds a reference on the mapping until it is
+ * freed, nothing is copied. A trailing partial frame is not played.
+ */
+static void
+mapped_need_data_cb (GstElement *src, guint length, AppData *data) {
+    gsize frame_size = (gsize) width * height;
+    guint rate = demo_mode ? MAX_DEMO_MODE_FRAME_RATE : framerate;
+    GstBuffer *buffer;
+
+    if (data->frame_offset + frame_size > g_mapped_file_get_length (data->mapping)) {
+        data->loops_done++;
+        if (loops && data->loops_done >= loops) {
+            gst_app_src_end_of_stream (GST_APP_SRC (src));
+            return;
+        }
+        data->frame_offset = 0;
+    }
+    buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+                                          g_mapped_file_get_contents (data->mapping) + data->frame_offset,
+                                          frame_size, 0, frame_size, g_mapped_file_ref (data->mapping),
+                                          (GDestroyNotify) g_mapped_file_unref);
+    GST_BUFFER_PTS (buffer) = gst_util_uint64_scale (data->frames_pushed, GST_SECOND, rate);
+    GST_BUFFER_DURATION (buffer) = gst_util_uint64_scale (1, GST_SECOND, rate);
+    GST_BUFFER_OFFSET (buffer) = data->frames_pushed++;
+    data->frame_offset += frame_size;
+    gst_app_src_push_buffer (GST_APP_SRC (src), buffer);
+}
+
+static DD_ERROR_LOG
+set_mapped_input_config (AppData *data) {
+    gsize frame_size = (gsize) width * height;
+    GError *error = NULL;
+    GstCaps *caps;
+
+    data->mapping = g_mapped_file_new (data->source, FALSE, &error);
+    if (!data->mapping) {
+        g_printerr ("Unable to map %s: %s\n", data->source, error->message);
+        g_clear_error (&error);
+        return DD_ERROR_FILE_IO;
+    }
+    if (g_mapped_file_get_length (data->mapping) < frame_size) {
+        g_printerr ("%s holds no complete %ux%u frame\n", data->source, width, height);
+        return DD_ERROR_FILE_IO;
+    }
+    /* read ahead and drop the pages behind, each pass goes front to back once */
+    if (madvise (g_mapped_file_get_contents (data->mapping), g_mapped_file_get_length (data->mapping),
+                 MADV_SEQUENTIAL) != 0)
+        GST_WARNING ("madvise on %s failed: %s", data->source, strerror (errno));
+
+    caps  = gst_caps_new_simple ("video/x-raw",
+                                 "width",     G_TYPE_INT,        width,
+                                 "height",    G_TYPE_INT,        height,
+                                 "format",    G_TYPE_STRING,     CAPTURE_FORMAT_Y8,
+                                 "framerate", GST_TYPE_FRACTION, demo_mode ? MAX_DEMO_MODE_FRAME_RATE : framerate,
+                                 MAX_FRAME_RATE_DENOM, NULL);
+    GST_DEBUG ("new Caps for appsrc %" GST_PTR_FORMAT, caps);
+    g_object_set (G_OBJECT (data->src), "caps", caps, "format", GST_FORMAT_TIME,
+                  "max-bytes", (guint64) frame_size * batch, NULL);
+    gst_caps_unref (caps);
+    g_signal_connect (data->src, "need-data", G_CALLBACK (mapped_need_data_cb), data);
+    return DD_SUCCESS;
+}
+
+/* Runs on the streaming thread of the sink, the frame is only copied into the writer's queue */
+static GstFlowReturn
+capture_sample_cb (GstElement *sink, CaptureOut *out) {
+    GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (sink));
+    GstBuffer *buffer;
+    GstDefectMeta *meta;
+    GstVideoMeta *vmeta;
+    GstMapInfo map;
+    DDCaptureRecord record;
+    gsize stride = width, offset = 0;
+
+    if (!sample)
+        return GST_FLOW_EOS;
+    buffer = gst_sample_get_buffer (sample);
+    memset (&record, 0, sizeof (record));
+    record.index = out->frames++;
+    record.pts_ns = GST_BUFFER_PTS (buffer);
+    meta = gst_buffer_get_defect_meta (buffer);
+    if (meta) {
+        record.capture_ns = meta->capture_ns;
+        record.flags = meta->flags;
+        record.otsu_thr = meta->otsu_thr;
+        record.mango_pix = meta->mango_pix;
+        record.defect_pix = meta->defect_pix;
+    }
+    vmeta = gst_buffer_get_video_meta (buffer);
+    if (vmeta) {
+        stride = vmeta->stride[0];
+        offset = vmeta->offset[0];
+    }
+    if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        if (map.size >= offset + stride * (height - 1) + width)
+            dd_capture_writer_push (out->writer, map.data + offset, stride, &record);
+        gst_buffer_unmap (buffer, &map);
+    }
+    gst_sample_unref (sample);
+    return GST_FLOW_OK;
+}
+
+static DD_ERROR_LOG
+set_capture_sink (AppData *data, guint which, GstElement *sink, const gchar *path) {
+    CaptureOut *out = &data->captures[which];
+
+    out->writer = dd_capture_writer_new (path, width, height, DD_CAPTURE_LZ, CAPTURE_QUEUE_FRAMES);
+    if (!out->writer) {
+        g_printerr ("Unable to create %s: %s\n", path, strerror (errno));
+        return DD_ERROR_FILE_IO;
+    }
+    out->path = path;
+    g_object_set (G_OBJECT (sink), "emit-signals", TRUE, "sync", FALSE, NULL);
+    g_signal_connect (sink, "new-sample", G_CALLBACK (capture_sample_cb), out);
+    return DD_SUCCESS;
+}
+
 /** @brief
  *  This function is to set the GstElement properties.
  *
@@ -233,25 +496,52 @@ set_pipeline_config (AppData *data) {
     string config_file(config_path);
     gint ret = DD_SUCCESS;
     guint plane_id = BASE_PLANE_ID;
-    if (file_playback) {
-        block_size = width * height;
-        g_object_set(G_OBJECT(data->src),            "location",  in_file,         NULL);
+    if (mapped_input (data)) {
+        ret = set_mapped_input_config (data);
+        if (ret != DD_SUCCESS)
+            return (DD_ERROR_LOG) ret;
+    } else if (data->file_playback) {
+        block_size = width * height * batch;
+        g_object_set(G_OBJECT(data->src),            "location",  data->source,    NULL);
         g_object_set(G_OBJECT(data->src),            "blocksize", block_size,      NULL);
     } else {
-        g_object_set(G_OBJECT(data->src),            "media-device", dev_node.c_str(), NULL);
+        g_object_set(G_OBJECT(data->src),            "media-device", data->source, NULL);
     }
-    if (file_dump) {
-        g_object_set(G_OBJECT(data->sink_raw),       "location",  raw_out,        NULL);
-        g_object_set(G_OBJECT(data->sink_preprocess),"location",  preprocess_out, NULL);
-        g_object_set(G_OBJECT(data->sink_display),   "location",  final_out,      NULL);
+    if (headless) {
+        if (data->final_out && capture) {
+            ret = set_capture_sink (data, CAPTURE_FINAL, data->sink_display, data->final_out);
+            if (ret != DD_SUCCESS)
+                return (DD_ERROR_LOG) ret;
+        } else if (data->final_out) {
+            g_object_set(G_OBJECT(data->sink_display), "location", data->final_out,      NULL);
+        }
+        /* replay and batch playback run as fast as the elements go */
+        if (verdict_log || (data->file_playback && batch > 1))
+            g_object_set(G_OBJECT(data->sink_display), "sync",     FALSE,                NULL);
+    } else if (file_dump && capture) {
+        if ((ret = set_capture_sink (data, CAPTURE_RAW, data->sink_raw, data->raw_out)) != DD_SUCCESS ||
+            (ret = set_capture_sink (data, CAPTURE_PREPROCESS, data->sink_preprocess, data->preprocess_out)) != DD_SUCCESS ||
+            (ret = set_capture_sink (data, CAPTURE_FINAL, data->sink_display, data->final_out)) != DD_SUCCESS)
+            return (DD_ERROR_LOG) ret;
+    } else if (file_dump) {
+        g_object_set(G_OBJECT(data->sink_raw),       "location",  data->raw_out,        NULL);
+        g_object_set(G_OBJECT(data->sink_preprocess),"location",  data->preprocess_out, NULL);
+        g_object_set(G_OBJECT(data->sink_display),   "location",  data->final_out,      NULL);
     } else {
-        g_object_set(G_OBJECT(data->sink_raw),          "bus-id",       DRM_BUS_ID,  NULL);
-        g_object_set(G_OBJECT(data->sink_raw),          "plane-id",     plane_id++,  NULL);
-        g_object_set(G_OBJECT(data->sink_raw),          "async",        FALSE,       NULL);
+        if (num_streams == 1) {
+            g_object_set(G_OBJECT(data->sink_raw),          "bus-id",       DRM_BUS_ID,  NULL);
+            g_object_set(G_OBJECT(data->sink_raw),          "plane-id",     plane_id++,  NULL);
+            g_object_set(G_OBJECT(data->sink_raw),          "async",        FALSE,       NULL);
 
-        g_object_set(G_OBJECT(data->sink_preprocess),   "bus-id",       DRM_BUS_ID,  NULL);
-        g_object_set(G_OBJECT(data->sink_preprocess),   "plane-id",     plane_id++,  NULL);
-        g_object_set(G_OBJECT(data->sink_preprocess),   "async",        FALSE,       NULL);
+            g_object_set(G_OBJECT(data->sink_preprocess),   "bus-id",       DRM_BUS_ID,  NULL);
+            g_object_set(G_OBJECT(data->sink_preprocess),   "plane-id",     plane_id++,  NULL);
+            g_object_set(G_OBJECT(data->sink_preprocess),   "async",        FALSE,       NULL);
+        } else {
+            /* only the final output of each lane is shown, one plane per lane */
+            plane_id += data->index;
+            g_object_set(G_OBJECT(data->sink_raw),          "async",        FALSE,       NULL);
+            g_object_set(G_OBJECT(data->sink_preprocess),   "async",        FALSE,       NULL);
+        }
 
         g_object_set(G_OBJECT(data->sink_display),      "bus-id",       DRM_BUS_ID,  NULL);
         g_object_set(G_OBJECT(data->sink_display),      "plane-id",     plane_id++,  NULL);
@@ -276,7 +566,7 @@ set_pipeline_config (AppData *data) {
             GST_DEBUG ("new Caps for final capsfilter %" GST_PTR_FORMAT, caps);
             g_object_set (G_OBJECT (data->capsfilter_display),  "caps",  caps, NULL);
             gst_caps_unref (caps);
-            if (file_playback) {
+            if (data->file_playback) {
                 g_object_set (G_OBJECT (data->rawvideoparse),  "use-sink-caps", FALSE,                    NULL);
                 g_object_set (G_OBJECT (data->rawvideoparse),  "width",         width,                    NULL);
                 g_object_set (G_OBJECT (data->rawvideoparse),  "height",        height,                   NULL);
@@ -284,40 +574,50 @@ set_pipeline_config (AppData *data) {
                 g_object_set (G_OBJECT (data->rawvideoparse),  "framerate",     MAX_DEMO_MODE_FRAME_RATE, MAX_FRAME_RATE_DENOM, NULL);
             }
         }
-        data->overlay_raw = GST_VIDEO_OVERLAY (data->sink_raw);
-        if (data->overlay_raw) {
-            ret = gst_video_overlay_set_render_rectangle (data->overlay_raw, 0, 680, width, height);
-            if (ret) {
-                gst_video_overlay_expose (data->overlay_raw);
-                ret = DD_SUCCESS;
+        if (num_streams > 1) {
+            data->overlay_display = GST_VIDEO_OVERLAY (data->sink_display);
+            if (!data->overlay_display) {
+                GST_ERROR ("Failed to create overlay");
+                return DD_ERROR_OVERLAY_CREATION_FAIL;
             }
+            if (gst_video_overlay_set_render_rectangle (data->overlay_display, data->index * MAX_WIDTH, 680, width, height))
+                gst_video_overlay_expose (data->overlay_display);
         } else {
-            GST_ERROR ("Failed to create overlay");
-            return DD_ERROR_OVERLAY_CREATION_FAIL;
-        }
+            data->overlay_raw = GST_VIDEO_OVERLAY (data->sink_raw);
+            if (data->overlay_raw) {
+                ret = gst_video_overlay_set_render_rectangle (data->overlay_raw, 0, 680, width, height);
+                if (ret) {
+                    gst_video_overlay_expose (data->overlay_raw);
+                    ret = DD_SUCCESS;
+                }
+            } else {
+                GST_ERROR ("Failed to create overlay");
+                return DD_ERROR_OVERLAY_CREATION_FAIL;
+            }
 
-        data->overlay_preprocess = GST_VIDEO_OVERLAY (data->sink_preprocess);
-        if (data->overlay_preprocess) {
-            ret = gst_video_overlay_set_render_rectangle (data->overlay_preprocess, 1280, 680, width, height);
-            if (ret) {
-                gst_video_overlay_expose (data->overlay_preprocess);
-                ret = DD_SUCCESS;
+            data->overlay_preprocess = GST_VIDEO_OVERLAY (data->sink_preprocess);
+            if (data->overlay_preprocess) {
+                ret = gst_video_overlay_set_render_rectangle (data->overlay_preprocess, 1280, 680, width, height);
+                if (ret) {
+                    gst_video_overlay_expose (data->overlay_preprocess);
+                    ret = DD_SUCCESS;
+                }
+            } else {
+                GST_ERROR ("Failed to create overlay");
+                return DD_ERROR_OVERLAY_CREATION_FAIL;
             }
-        } else {
-            GST_ERROR ("Failed to create overlay");
-            return DD_ERROR_OVERLAY_CREATION_FAIL;
-        }
 
-        data->overlay_display = GST_VIDEO_OVERLAY (data->sink_display);
-        if (data->overlay_display) {
-            ret = gst_video_overlay_set_render_rectangle (data->overlay_display, 2560, 680, width, height);
-            if (ret) {
-                gst_video_overlay_expose (data->overlay_display);
-                ret = DD_SUCCESS;
+            data->overlay_display = GST_VIDEO_OVERLAY (data->sink_display);
+            if (data->overlay_display) {
+                ret = gst_video_overlay_set_render_rectangle (data->overlay_display, 2560, 680, width, height);
+                if (ret) {
+                    gst_video_overlay_expose (data->overlay_display);
+                    ret = DD_SUCCESS;
+                }
+            } else {
+                GST_ERROR ("Failed to create overlay");
+                return DD_ERROR_OVERLAY_CREATION_FAIL;
             }
-        } else {
-            GST_ERROR ("Failed to create overlay");
-            return DD_ERROR_OVERLAY_CREATION_FAIL;
         }
     }
     caps  = gst_caps_new_simple ("video/x-raw",
@@ -330,20 +630,51 @@ set_pipeline_config (AppData *data) {
     g_object_set (G_OBJECT (data->capsfilter),  "caps",  caps, NULL);
     gst_caps_unref (caps);
 
-    config_file.append(PRE_PROCESS_JSON_FILE);
-    g_object_set (G_OBJECT(data->preprocess), "kernels-config", config_file.c_str(), NULL);
-    GST_DEBUG ("Config file path is %s", config_file.c_str());
+    if (data->file_playback && batch > 1 && !mapped_input (data)) {
+        /* filesrc reads the whole batch, rawvideoparse splits it back into frames */
+        g_object_set (G_OBJECT (data->rawvideoparse),  "use-sink-caps", FALSE,                    NULL);
+        g_object_set (G_OBJECT (data->rawvideoparse),  "width",         width,                    NULL);
+        g_object_set (G_OBJECT (data->rawvideoparse),  "height",        height,                   NULL);
+        g_object_set (G_OBJECT (data->rawvideoparse),  "format",        GST_VIDEO_FORMAT_GRAY8,   NULL);
+        g_object_set (G_OBJECT (data->rawvideoparse),  "framerate",     framerate, MAX_FRAME_RATE_DENOM, NULL);
+    }
+    if (data->file_playback && batch > 1 && !headless) {
+        /* keep a batch in flight at every stage and run as fast as the elements go */
+        g_object_set (G_OBJECT (data->queue_raw),         "max-size-buffers", batch, "max-size-bytes", 0, \
+                      "max-size-time", (guint64) 0, NULL);
+        g_object_set (G_OBJECT (data->queue_raw2),        "max-size-buffers", batch, "max-size-bytes", 0, \
+                      "max-size-time", (guint64) 0, NULL);
+        g_object_set (G_OBJECT (data->queue_preprocess),  "max-size-buffers", batch, "max-size-bytes", 0, \
+                      "max-size-time", (guint64) 0, NULL);
+        g_object_set (G_OBJECT (data->queue_preprocess2), "max-size-buffers", batch, "max-size-bytes", 0, \
+                      "max-size-time", (guint64) 0, NULL);
+        g_object_set (G_OBJECT (data->sink_raw),          "sync", FALSE, NULL);
+        g_object_set (G_OBJECT (data->sink_preprocess),   "sync", FALSE, NULL);
+        g_object_set (G_OBJECT (data->sink_display),      "sync", FALSE, NULL);
+    }
 
-    config_file.erase (config_file.begin()+ strlen(config_path), config_file.end()-0);
-    config_file.append(OTSU_ACC_JSON_FILE);
-    g_object_set (G_OBJECT(data->otsu),   "kernels-config", config_file.c_str(), NULL);
-    GST_DEBUG ("Config file path is %s", config_file.c_str());
+    if (fused) {
+        config_file.append(FUSED_JSON_FILE);
+        g_object_set (G_OBJECT(data->fused), "kernels-config", config_file.c_str(), NULL);
+        GST_DEBUG ("Config file path is %s", config_file.c_str());
+    } else {
+        config_file.append(PRE_PROCESS_JSON_FILE);
+        g_object_set (G_OBJECT(data->preprocess), "kernels-config", config_file.c_str(), NULL);
+        GST_DEBUG ("Config file path is %s", config_file.c_str());
 
-    config_file.erase (config_file.begin()+ strlen(config_path), config_file.end()-0);
-    config_file.append(CCA_ACC_JSON_FILE);
-    g_object_set (G_OBJECT(data->cca),    "kernels-config", config_file.c_str(), NULL);
-    GST_DEBUG ("Config file path is %s", config_file.c_str());
+        config_file.erase (config_file.begin()+ strlen(config_path), config_file.end()-0);
+        config_file.append(OTSU_ACC_JSON_FILE);
+        g_object_set (G_OBJECT(data->otsu),   "kernels-config", config_file.c_str(), NULL);
+        GST_DEBUG ("Config file path is %s", config_file.c_str());
+
+        config_file.erase (config_file.begin()+ strlen(config_path), config_file.end()-0);
+        config_file.append(CCA_ACC_JSON_FILE);
+        g_object_set (G_OBJECT(data->cca),    "kernels-config", config_file.c_str(), NULL);
+        GST_DEBUG ("Config file path is %s", config_file.c_str());
+    }
 
+    if (headless)
+        return DD_SUCCESS;
     config_file.erase (config_file.begin()+ strlen(config_path), config_file.end()-0);
     config_file.append(TEXT_2_OVERLAY_JSON_FILE);
     g_object_set (G_OBJECT(data->text2overlay), "kernels-config", config_file.c_str(), NULL);
@@ -351,6 +682,48 @@ set_pipeline_config (AppData *data) {
     return DD_SUCCESS;
 }
 
+/* Links src -> otsu -> pre-process -> cca, or fused, -> perf -> sink of one headless stream */
+static DD_ERROR_LOG
+link_headless_pipeline (AppData *data) {
+    GstElement *first = fused ? data->fused : data->otsu;
+    GstElement *last = fused ? data->fused : data->cca;
+    if (!data->file_playback) {
+        /* mediasrcbin is linked to the capsfilter in pad_added_cb */
+        if (!gst_element_link (data->capsfilter, first)) {
+            GST_ERROR ("Error linking for capsfilter --> inspection");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+    } else if (mapped_input (data)) {
+        if (!gst_element_link (data->src, first)) {
+            GST_ERROR ("Error linking for appsrc --> inspection");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+    } else if (batch == 1) {
+        if (!gst_element_link_many (data->src, data->capsfilter, first, NULL)) {
+            GST_ERROR ("Error linking for src --> capsfilter --> inspection");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+    } else {
+        if (!gst_element_link_many (data->src, data->rawvideoparse, first, NULL)) {
+            GST_ERROR ("Error linking for src --> rawvideoparse --> inspection");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+    }
+    if (!fused) {
+        if (pipelined ? !gst_element_link_many (data->otsu, data->queue_otsu, data->preprocess, data->cca, NULL)
+                      : !gst_element_link_many (data->otsu, data->preprocess, data->cca, NULL)) {
+            GST_ERROR ("Error linking for otsu --> preprocess --> cca");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+    }
+    if (!gst_element_link_many (last, data->perf_display, data->sink_display, NULL)) {
+        GST_ERROR ("Error linking for inspection --> perf --> sink");
+        return DD_ERROR_PIPELINE_LINKING_FAIL;
+    }
+    GST_DEBUG ("Linked the headless inspection pipeline successfully");
+    return DD_SUCCESS;
+}
+
 /** @brief
  *  This function is to link all the elements required to run defect
  *  detect use case.
@@ -364,18 +737,27 @@ DD_ERROR_LOG
 link_pipeline (AppData *data) {
     gchar *name1, *name2;
     gint ret = DD_SUCCESS;
+    if (headless)
+        return link_headless_pipeline (data);
     data->pad_raw = gst_element_get_request_pad(data->tee_raw, "src_1");
     name1 = gst_pad_get_name(data->pad_raw);
     data->pad_raw2 = gst_element_get_request_pad(data->tee_raw, "src_2");
     name2 = gst_pad_get_name(data->pad_raw2);
-    if (!file_playback) {
+    if (!data->file_playback) {
         if (!gst_element_link_many(data->capsfilter, data->tee_raw, NULL)) {
             GST_ERROR ("Error linking for capsfilter --> tee");
             return DD_ERROR_PIPELINE_LINKING_FAIL;
         }
         GST_DEBUG ("Linked for capsfilter --> tee successfully");
+    } else if (mapped_input (data)) {
+        /* appsrc has the caps, in demo mode at the demo rate */
+        if (!gst_element_link (data->src, data->tee_raw)) {
+            GST_ERROR ("Error linking for appsrc --> tee");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+        GST_DEBUG ("Linked for appsrc --> tee successfully");
     } else {
-        if (!demo_mode) {
+        if (!demo_mode && batch == 1) {
             if (!gst_element_link_many(data->src, data->capsfilter, data->tee_raw, NULL)) {
                 GST_ERROR ("Error linking for src --> capsfilter --> tee");
                 return DD_ERROR_PIPELINE_LINKING_FAIL;
@@ -415,11 +797,26 @@ link_pipeline (AppData *data) {
         }
         GST_DEBUG ("Linking for queue_raw --> perf_raw --> sink_raw successfully");
     }
-    if (!gst_element_link_many(data->queue_raw2, data->otsu, data->preprocess, data->tee_preprocess, NULL)) {
-        GST_ERROR ("Error linking for queue_raw2 --> otsu --> preprocess --> tee_preprocess");
-        return DD_ERROR_PIPELINE_LINKING_FAIL;
+    if (fused) {
+        if (!gst_element_link_many(data->queue_raw2, data->fused, data->tee_preprocess, NULL)) {
+            GST_ERROR ("Error linking for queue_raw2 --> fused --> tee_preprocess");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+        GST_DEBUG ("Linking for queue_raw2 --> fused --> tee_preprocess successfully");
+    } else if (pipelined) {
+        if (!gst_element_link_many(data->queue_raw2, data->otsu, data->queue_otsu, data->preprocess, \
+                                   data->tee_preprocess, NULL)) {
+            GST_ERROR ("Error linking for queue_raw2 --> otsu --> queue_otsu --> preprocess --> tee_preprocess");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+        GST_DEBUG ("Linking for queue_raw2 --> otsu --> queue_otsu --> preprocess --> tee_preprocess successfully");
+    } else {
+        if (!gst_element_link_many(data->queue_raw2, data->otsu, data->preprocess, data->tee_preprocess, NULL)) {
+            GST_ERROR ("Error linking for queue_raw2 --> otsu --> preprocess --> tee_preprocess");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+        GST_DEBUG ("Linking for queue_raw2 --> otsu --> preprocess --> tee_preprocess successfully");
     }
-    GST_DEBUG ("Linking for queue_raw2 --> otsu --> preprocess --> tee_preprocess successfully");
     data->pad_preprocess = gst_element_get_request_pad(data->tee_preprocess, "src_1");
     name1 = gst_pad_get_name(data->pad_preprocess);
     data->pad_preprocess2 = gst_element_get_request_pad(data->tee_preprocess, "src_2");
@@ -452,50 +849,122 @@ link_pipeline (AppData *data) {
         }
         GST_DEBUG ("Linking for queue_preprocess --> perf_preprocess --> sink_preprocess successfully");
     }
+    /* the fused element already labelled the mask, there is no separate cca */
+    if (fused) {
+        if (!gst_element_link (data->queue_preprocess2, data->text2overlay)) {
+            GST_ERROR ("Error linking for queue_preprocess2 --> text2overlay");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+        GST_DEBUG ("Linking for queue_preprocess2 --> text2overlay successfully");
+    } else {
+        if (!gst_element_link_many(data->queue_preprocess2, data->cca, data->text2overlay, NULL)) {
+            GST_ERROR ("Error linking for queue_preprocess2 --> cca --> text2overlay");
+            return DD_ERROR_PIPELINE_LINKING_FAIL;
+        }
+        GST_DEBUG ("Linking for queue_preprocess2 --> cca --> text2overlay successfully");
+    }
     if (demo_mode) {
-        if (!gst_element_link_many(data->queue_preprocess2, data->cca, data->text2overlay, \
-                                   data->videorate_display, data->capsfilter_display, \
+        if (!gst_element_link_many(data->text2overlay, data->videorate_display, data->capsfilter_display, \
                                    data->perf_display, data->sink_display, NULL)) {
-            GST_ERROR ("Error linking for queue --> cca --> text2overlay --> videorate --> capsfilter \
-                        --> perf --> sink");
+            GST_ERROR ("Error linking for text2overlay --> videorate --> capsfilter --> perf --> sink");
              return DD_ERROR_PIPELINE_LINKING_FAIL;
         }
-        GST_DEBUG ("Linking for queue --> cca --> text2overlay --> videorate  --> capsfilter --> \
-                    perf --> sink  successfully");
+        GST_DEBUG ("Linking for text2overlay --> videorate  --> capsfilter --> perf --> sink  successfully");
     } else {
-        if (!gst_element_link_many(data->queue_preprocess2, data->cca, data->text2overlay, \
-                                   data->perf_display, data->sink_display, NULL)) {
-            GST_ERROR ("Error linking for queue_preprocess2 --> cca --> text2overlay --> perf --> sink");
+        if (!gst_element_link_many(data->text2overlay, data->perf_display, data->sink_display, NULL)) {
+            GST_ERROR ("Error linking for text2overlay --> perf --> sink");
             return DD_ERROR_PIPELINE_LINKING_FAIL;
         }
-        GST_DEBUG ("Linking for queue_raw2 --> cca --> text2overlay --> perf --> sink successfully");
+        GST_DEBUG ("Linking for text2overlay --> perf --> sink successfully");
     }
 
     return DD_SUCCESS;
 }
 
+/* Elements of stream N get a "-N" suffix when several streams run */
+static std::string
+element_name (AppData *data, const gchar *name) {
+    if (num_streams == 1)
+        return name;
+    return std::string (name) + "-" + std::to_string (data->index);
+}
+
+/* Creates src -> otsu -> pre-process -> cca, or fused, -> perf -> sink, nothing for a monitor */
+static DD_ERROR_LOG
+create_headless_pipeline (AppData *data) {
+    if (data->file_playback) {
+        data->src               =  gst_element_factory_make(mmap_input ? "appsrc" : "filesrc", NULL);
+    } else {
+        data->src               =  gst_element_factory_make("mediasrcbin",  NULL);
+    }
+    if (data->final_out) {
+        data->sink_display      =  gst_element_factory_make(capture ? "appsink" : "filesink", NULL);
+    } else {
+        data->sink_display      =  gst_element_factory_make("fakesink",     NULL);
+    }
+    data->capsfilter            =  gst_element_factory_make("capsfilter",   NULL);
+    data->rawvideoparse         =  gst_element_factory_make("rawvideoparse",NULL);
+    if (fused) {
+        data->fused             =  gst_element_factory_make("vvas_xfilter", element_name(data, "fused").c_str());
+    } else {
+        data->preprocess        =  gst_element_factory_make("vvas_xfilter", element_name(data, "pre-process").c_str());
+        data->otsu              =  gst_element_factory_make("vvas_xfilter", element_name(data, "otsu").c_str());
+        data->cca               =  gst_element_factory_make("vvas_xfilter", element_name(data, "cca").c_str());
+    }
+    data->perf_display          =  gst_element_factory_make("perf",         element_name(data, "perf-final").c_str());
+
+    if (!data->src || !data->capsfilter || !data->rawvideoparse || !data->sink_display || !data->perf_display \
+        || (fused ? !data->fused : (!data->preprocess || !data->otsu || !data->cca))) {
+           GST_ERROR ("could not create few elements");
+           return DD_ERROR_PIPELINE_CREATE_FAIL;
+    }
+    gst_bin_add_many(GST_BIN(data->pipeline), data->src, data->rawvideoparse, data->capsfilter, \
+                     data->perf_display, data->sink_display, NULL);
+    if (fused) {
+        gst_bin_add (GST_BIN(data->pipeline), data->fused);
+    } else {
+        gst_bin_add_many(GST_BIN(data->pipeline), data->preprocess, data->otsu, data->cca, NULL);
+    }
+    if (pipelined) {
+        data->queue_otsu = gst_element_factory_make("queue", element_name(data, "queue-otsu").c_str());
+        if (!data->queue_otsu) {
+            GST_ERROR ("could not create otsu queue");
+            return DD_ERROR_PIPELINE_CREATE_FAIL;
+        }
+        g_object_set (G_OBJECT (data->queue_otsu), "max-size-buffers", pipelined, \
+                      "max-size-bytes", 0, "max-size-time", (guint64) 0, NULL);
+        gst_bin_add (GST_BIN(data->pipeline), data->queue_otsu);
+    }
+    return DD_SUCCESS;
+}
+
 /** @brief
  *  This function is to create a pipeline required to run defect
  *  detect use case.
  *
- *  All GStreamer elements instance has to be created and add
- *  into the pipeline bin. Also link file based pipeline.
+ *  All GStreamer elements instance of one stream has to be created
+ *  and added into the shared pipeline bin.
  *
  *  @param data is the application structure pointer.
  *  @return Error code.
  */
 DD_ERROR_LOG
 create_pipeline (AppData *data) {
-    data->pipeline =   gst_pipeline_new("defectdetection");
-    if (file_playback) {
-        data->src               =  gst_element_factory_make("filesrc",      NULL);
+    if (headless)
+        return create_headless_pipeline (data);
+    if (data->file_playback) {
+        data->src               =  gst_element_factory_make(mmap_input ? "appsrc" : "filesrc", NULL);
     } else {
         data->src               =  gst_element_factory_make("mediasrcbin",  NULL);
     }
     if (file_dump) {
-        data->sink_raw          =  gst_element_factory_make("filesink",     NULL);
-        data->sink_preprocess   =  gst_element_factory_make("filesink",     NULL);
-        data->sink_display      =  gst_element_factory_make("filesink",     NULL);
+        data->sink_raw          =  gst_element_factory_make(capture ? "appsink" : "filesink", NULL);
+        data->sink_preprocess   =  gst_element_factory_make(capture ? "appsink" : "filesink", NULL);
+        data->sink_display      =  gst_element_factory_make(capture ? "appsink" : "filesink", NULL);
+    } else if (num_streams > 1) {
+        data->sink_raw          =  gst_element_factory_make("fakesink",     NULL);
+        data->sink_preprocess   =  gst_element_factory_make("fakesink",     NULL);
+        data->sink_display      =  gst_element_factory_make("kmssink",      element_name(data, "display-final").c_str());
     } else {
         data->sink_raw          =  gst_element_factory_make("kmssink",      "display-raw");
         data->sink_preprocess   =  gst_element_factory_make("kmssink",      "display-preprocess");
@@ -503,19 +972,23 @@ create_pipeline (AppData *data) {
     }
     data->capsfilter            =  gst_element_factory_make("capsfilter",   NULL);
     data->rawvideoparse         =  gst_element_factory_make("rawvideoparse",NULL);
-    data->preprocess            =  gst_element_factory_make("vvas_xfilter", "pre-process");
-    data->otsu                  =  gst_element_factory_make("vvas_xfilter", "otsu");
-    data->cca                   =  gst_element_factory_make("vvas_xfilter", "cca");
-    data->text2overlay          =  gst_element_factory_make("vvas_xfilter", "text2overlay");
+    if (fused) {
+        data->fused             =  gst_element_factory_make("vvas_xfilter", element_name(data, "fused").c_str());
+    } else {
+        data->preprocess        =  gst_element_factory_make("vvas_xfilter", element_name(data, "pre-process").c_str());
+        data->otsu              =  gst_element_factory_make("vvas_xfilter", element_name(data, "otsu").c_str());
+        data->cca               =  gst_element_factory_make("vvas_xfilter", element_name(data, "cca").c_str());
+    }
+    data->text2overlay          =  gst_element_factory_make("vvas_xfilter", element_name(data, "text2overlay").c_str());
     data->tee_raw               =  gst_element_factory_make("tee",          NULL);
     data->tee_preprocess        =  gst_element_factory_make("tee",          NULL);
     data->queue_raw             =  gst_element_factory_make("queue",        NULL);
     data->queue_raw2            =  gst_element_factory_make("queue",        NULL);
     data->queue_preprocess      =  gst_element_factory_make("queue",        NULL);
     data->queue_preprocess2     =  gst_element_factory_make("queue",        NULL);
-    data->perf_raw              =  gst_element_factory_make("perf",         "perf-raw");
-    data->perf_preprocess       =  gst_element_factory_make("perf",         "perf-preprocess");
-    data->perf_display          =  gst_element_factory_make("perf",         "perf-final");
+    data->perf_raw              =  gst_element_factory_make("perf",         element_name(data, "perf-raw").c_str());
+    data->perf_preprocess       =  gst_element_factory_make("perf",         element_name(data, "perf-preprocess").c_str());
+    data->perf_display          =  gst_element_factory_make("perf",         element_name(data, "perf-final").c_str());
     data->videorate_raw         =  gst_element_factory_make("videorate",    NULL);
     data->videorate_preprocess  =  gst_element_factory_make("videorate",    NULL);
     data->videorate_display     =  gst_element_factory_make("videorate",    NULL);
@@ -523,8 +996,8 @@ create_pipeline (AppData *data) {
     data->capsfilter_preprocess =  gst_element_factory_make("capsfilter",   NULL);
     data->capsfilter_display    =  gst_element_factory_make("capsfilter",   NULL);
 
-    if (!data->pipeline || !data->src || !data->capsfilter || ! data->rawvideoparse \
-        || !data->preprocess || !data->otsu || !data->cca || !data->text2overlay \
+    if (!data->src || !data->capsfilter || ! data->rawvideoparse \
+        || (fused ? !data->fused : (!data->preprocess || !data->otsu || !data->cca)) || !data->text2overlay \
         || !data->sink_display || !data->sink_raw || !data->sink_preprocess \
         || !data->tee_raw || !data->tee_preprocess \
         || !data->queue_raw || !data->queue_raw || !data->queue_raw2 || !data->queue_preprocess \
@@ -536,13 +1009,29 @@ create_pipeline (AppData *data) {
     }
     GST_DEBUG ("All elements are created");
     gst_bin_add_many(GST_BIN(data->pipeline), data->src, data->rawvideoparse, data->capsfilter, \
-                     data->preprocess, data->otsu, data->cca, data->text2overlay, \
+                     data->text2overlay, \
                      data->sink_display, data->sink_raw, data->queue_raw, data->queue_raw2, \
                      data->queue_preprocess, data->queue_preprocess2, data->sink_preprocess, \
                      data->tee_raw, data->tee_preprocess, data->perf_raw, data->perf_preprocess, \
                      data->perf_display, data->videorate_raw, data->videorate_preprocess, \
                      data->videorate_display, data->capsfilter_raw, data->capsfilter_preprocess, \
                      data->capsfilter_display, NULL);
+    if (fused) {
+        gst_bin_add (GST_BIN(data->pipeline), data->fused);
+    } else {
+        gst_bin_add_many(GST_BIN(data->pipeline), data->preprocess, data->otsu, data->cca, NULL);
+    }
+    if (pipelined) {
+        /* otsu runs ahead of pre-process by up to this many frames, results travel in the buffer meta */
+        data->queue_otsu = gst_element_factory_make("queue", element_name(data, "queue-otsu").c_str());
+        if (!data->queue_otsu) {
+            GST_ERROR ("could not create otsu queue");
+            return DD_ERROR_PIPELINE_CREATE_FAIL;
+        }
+        g_object_set (G_OBJECT (data->queue_otsu), "max-size-buffers", pipelined, \
+                      "max-size-bytes", 0, "max-size-time", (guint64) 0, NULL);
+        gst_bin_add (GST_BIN(data->pipeline), data->queue_otsu);
+    }
     return DD_SUCCESS;
 }
 
@@ -582,16 +1071,693 @@ check_mipi_src() {
     return 0;
 }
 
+/* Headless mode judges frames like text2overlay would, with its threshold */
+static void
+load_defect_threshold (void) {
+    std::string file = std::string (config_path) + "/" + TEXT_2_OVERLAY_JSON_FILE;
+    json_error_t error;
+    json_t *root, *val;
+
+    root = json_load_file (file.c_str (), JSON_DECODE_ANY, &error);
+    if (!root) {
+        GST_WARNING ("Unable to read %s, defect threshold is %f", file.c_str (), defect_threshold);
+        return;
+    }
+    val = json_object_get (json_object_get (json_array_get (json_object_get (root, "kernels"), 0), "config"),
+                           "defect_threshold");
+    if (val && json_is_number (val))
+        defect_threshold = json_number_value (val);
+    GST_DEBUG ("defect threshold is %f", defect_threshold);
+    json_decref (root);
+}
+
+/* A kernel config file the app reads again on changes and SIGHUP */
+typedef struct {
+    const gchar *file;
+    DDConfigKernel kernel;
+    gboolean used;
+    GFileMonitor *monitor;
+    /* last one loaded, to tell which keys changed */
+    json_t *config;
+} ConfigWatch;
+
+static ConfigWatch config_watches[] = {
+    { OTSU_ACC_JSON_FILE,       DD_CONFIG_OTSU },
+    { PRE_PROCESS_JSON_FILE,    DD_CONFIG_PREPROCESS },
+    { CCA_ACC_JSON_FILE,        DD_CONFIG_CCA },
+    { FUSED_JSON_FILE,          DD_CONFIG_FUSED },
+    { TEXT_2_OVERLAY_JSON_FILE, DD_CONFIG_OVERLAY },
+};
+
+/* Returns the "config" object of the first kernel of @file with a reference, or NULL */
+static json_t *
+load_kernel_config (const gchar *file) {
+    std::string path = std::string (config_path) + "/" + file;
+    json_error_t error;
+    json_t *root, *config;
+
+    root = json_load_file (path.c_str (), JSON_DECODE_ANY, &error);
+    if (!root) {
+        g_printerr ("Unable to read %s, line %d: %s\n", path.c_str (), error.line, error.text);
+        return NULL;
+    }
+    config = json_object_get (json_array_get (json_object_get (root, "kernels"), 0), "config");
+    if (json_is_object (config))
+        json_incref (config);
+    else {
+        g_printerr ("%s has no kernel config\n", path.c_str ());
+        config = NULL;
+    }
+    json_decref (root);
+    return config;
+}
+
+/* Warns about @key when it differs from the running config but is not applied while running */
+static void
+check_static_key (ConfigWatch *watch, json_t *config, const char *key) {
+    if (!dd_config_reloadable (watch->kernel, key) &&
+        !json_equal (json_object_get (config, key), json_object_get (watch->config, key)))
+        g_printerr ("%s of %s is applied at the next start only\n", key, watch->file);
+}
+
+/*
+ * Publishes the config of @watch to its kernels, which check and apply it
+ * before their next frame. Headless, text2overlay's threshold is the app's.
+ */
+static void
+reload_config (ConfigWatch *watch) {
+    json_t *config, *val;
+    const char *key;
+    gdouble threshold = defect_threshold;
+
+    config = load_kernel_config (watch->file);
+    if (!config) {
+        g_printerr ("Keeping the running config of %s\n", watch->file);
+        return;
+    }
+    if (watch->config) {
+        json_object_foreach (config, key, val)
+            check_static_key (watch, config, key);
+        json_object_foreach (watch->config, key, val)
+            if (!json_object_get (config, key))
+                check_static_key (watch, config, key);
+    }
+    if (headless && watch->kernel == DD_CONFIG_OVERLAY) {
+        if (dd_config_number (config, "defect_threshold", 0.0, 100.0, &threshold) < 0)
+            g_printerr ("defect_threshold of %s must be from 0 to 100, keeping %f\n", watch->file, defect_threshold);
+        else
+            __atomic_store (&defect_threshold, &threshold, __ATOMIC_RELAXED);
+    }
+    dd_config_publish (watch->kernel, config);
+    json_decref (watch->config);
+    watch->config = config;
+    g_printerr ("Reloaded %s\n", watch->file);
+}
+
+static void
+config_changed_cb (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, ConfigWatch *watch) {
+    /* also sent once a file is moved over the watched one */
+    if (event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
+        reload_config (watch);
+}
+
+static gboolean
+config_reload_cb (gpointer user_data) {
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS (config_watches); i++)
+        if (config_watches[i].used)
+            reload_config (&config_watches[i]);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Remembers the configs the kernels start with and watches their files with --watchconfig */
+static void
+watch_configs (void) {
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS (config_watches); i++) {
+        ConfigWatch *watch = &config_watches[i];
+        std::string path = std::string (config_path) + "/" + watch->file;
+        GFile *file;
+        GError *error = NULL;
+
+        if (watch->kernel == DD_CONFIG_OVERLAY)
+            watch->used = TRUE;
+        else if (fused)
+            watch->used = watch->kernel == DD_CONFIG_FUSED;
+        else
+            watch->used = watch->kernel != DD_CONFIG_FUSED;
+        if (!watch->used)
+            continue;
+        watch->config = load_kernel_config (watch->file);
+        if (!watch_config)
+            continue;
+        file = g_file_new_for_path (path.c_str ());
+        watch->monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+        g_object_unref (file);
+        if (!watch->monitor) {
+            g_printerr ("Unable to watch %s: %s\n", path.c_str (), error->message);
+            g_clear_error (&error);
+            continue;
+        }
+        g_signal_connect (watch->monitor, "changed", G_CALLBACK (config_changed_cb), watch);
+    }
+}
+
+static void
+unwatch_configs (void) {
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS (config_watches); i++) {
+        ConfigWatch *watch = &config_watches[i];
+        if (watch->monitor) {
+            g_file_monitor_cancel (watch->monitor);
+            g_object_unref (watch->monitor);
+            watch->monitor = NULL;
+        }
+        json_decref (watch->config);
+        watch->config = NULL;
+    }
+}
+
+/* Whether pre-process passes its mask to CCA at 1 bit per pixel */
+static gboolean
+preprocess_mask_bits (void) {
+    std::string file = std::string (config_path) + "/" + PRE_PROCESS_JSON_FILE;
+    json_error_t error;
+    json_t *root, *val;
+    gboolean bits;
+
+    root = json_load_file (file.c_str (), JSON_DECODE_ANY, &error);
+    if (!root)
+        return FALSE;
+    val = json_object_get (json_object_get (json_array_get (json_object_get (root, "kernels"), 0), "config"),
+                           "mask_format");
+    bits = val && json_is_string (val) && !strcmp (json_string_value (val), "bits");
+    json_decref (root);
+    return bits;
+}
+
+/* raw.y8 becomes raw-1.y8 for stream 1 when several streams are dumped */
+static gchar *
+stream_file_name (const gchar *path, guint index) {
+    const gchar *base = strrchr (path, '/');
+    const gchar *ext = strrchr (base ? base : path, '.');
+    if (num_streams == 1)
+        return g_strdup (path);
+    if (!ext)
+        return g_strdup_printf ("%s-%u", path, index);
+    return g_strdup_printf ("%.*s-%u%s", (int) (ext - path), path, index, ext);
+}
+
+/* Queues of a stream in the order of AppData.overruns, NULL where not used */
+static void
+metric_queues (AppData *data, GstElement *queues[NUM_METRIC_QUEUES], const gchar *names[NUM_METRIC_QUEUES]) {
+    queues[0] = data->queue_raw;          names[0] = "raw-display";
+    queues[1] = data->queue_raw2;         names[1] = "inspect";
+    queues[2] = fused ? NULL : data->queue_otsu;
+    names[2] = "otsu";
+    queues[3] = data->queue_preprocess;   names[3] = "preprocess-display";
+    queues[4] = data->queue_preprocess2;  names[4] = "cca";
+}
+
+/* A full queue blocks its upstream, a leaky one drops a frame instead */
+static void
+queue_overrun_cb (GstElement *queue, guint64 *overruns) {
+    __atomic_add_fetch (overruns, 1, __ATOMIC_RELAXED);
+}
+
+/* Stamps the capture time every stage passes on in the defect meta */
+static GstPadProbeReturn
+capture_probe_cb (GstPad *pad, GstPadProbeInfo *info, AppData *data) {
+    GstBuffer *buffer = gst_buffer_make_writable (GST_PAD_PROBE_INFO_BUFFER (info));
+    GstDefectMeta *meta = gst_buffer_acquire_defect_meta (buffer);
+    GST_PAD_PROBE_INFO_DATA (info) = buffer;
+    if (meta)
+        meta->capture_ns = dd_stats_clock_ns ();
+    return GST_PAD_PROBE_OK;
+}
+
+/* One JSON line per frame, the headless replacement of the overlay */
+static void
+print_result (AppData *data, GstBuffer *buffer, GstDefectMeta *meta, guint64 frame, gdouble density,
+              gboolean defective, guint64 latency) {
+    GstClockTime pts = GST_BUFFER_PTS (buffer);
+    gchar pts_str[24] = "null";
+    if (GST_CLOCK_TIME_IS_VALID (pts))
+        g_snprintf (pts_str, sizeof (pts_str), "%" G_GUINT64_FORMAT, pts);
+    g_print ("{\"stream\":%u,\"frame\":%" G_GUINT64_FORMAT ",\"pts_ns\":%s,\"otsu_thr\":%u,\"mango_pix\":%u,"
+             "\"defect_pix\":%u,\"density\":%.4f,\"defective\":%s,\"num_blobs\":%u,\"latency_us\":%.1f}\n",
+             data->index, frame, pts_str, meta->otsu_thr, meta->mango_pix, meta->defect_pix, density,
+             defective ? "true" : "false", meta->num_blobs, latency / 1000.0);
+}
+
+/* One CSV line per frame, lines of several streams interleave */
+static void
+write_verdict (AppData *data, GstDefectMeta *meta, guint64 frame, gdouble density, gboolean defective) {
+    fprintf (verdict_fp, "%u,%" G_GUINT64_FORMAT ",%u,%u,%u,%.4f,%d\n", data->index, frame, meta->otsu_thr,
+             meta->mango_pix, meta->defect_pix, density, defective ? 1 : 0);
+}
+
+typedef struct _Verdict {
+    guint otsu_thr, mango_pix, defect_pix;
+    gint defective;
+} Verdict;
+
+typedef std::map<std::pair<guint, guint64>, Verdict> VerdictMap;
+
+/* Verdicts of a log by stream and frame, FALSE when it can not be read */
+static gboolean
+read_verdicts (const gchar *path, VerdictMap &verdicts) {
+    FILE *fp = fopen (path, "r");
+    gchar line[256];
+    if (!fp) {
+        g_printerr ("Unable to open %s: %s\n", path, strerror (errno));
+        return FALSE;
+    }
+    while (fgets (line, sizeof (line), fp)) {
+        guint stream;
+        guint64 frame;
+        gdouble density;
+        Verdict v;
+        if (sscanf (line, "%u,%" G_GUINT64_FORMAT ",%u,%u,%u,%lf,%d", &stream, &frame, &v.otsu_thr,
+                    &v.mango_pix, &v.defect_pix, &density, &v.defective) == 7)
+            verdicts[std::make_pair (stream, frame)] = v;
+    }
+    fclose (fp);
+    return TRUE;
+}
+
+/*
+ * Compares the replay against the golden run frame by frame. The density
+ * follows from the counts, so only the counts, the threshold and the
+ * decision are compared. Returns the number of differing, missing and
+ * extra frames, or -1 when a log can not be read.
+ */
+static gint
+diff_verdicts (const gchar *log, const gchar *golden) {
+    VerdictMap replay, reference;
+    guint differ = 0, missing = 0, extra = 0, reported = 0;
+
+    if (!read_verdicts (log, replay) || !read_verdicts (golden, reference))
+        return -1;
+    for (auto &ref : reference) {
+        auto it = replay.find (ref.first);
+        const Verdict &g = ref.second;
+        if (it == replay.end ()) {
+            if (reported++ < MAX_REPORTED_DIFFS)
+                g_printerr ("stream %u frame %" G_GUINT64_FORMAT ": missing from the replay\n",
+                            ref.first.first, ref.first.second);
+            missing++;
+            continue;
+        }
+        const Verdict &r = it->second;
+        if (r.otsu_thr == g.otsu_thr && r.mango_pix == g.mango_pix && r.defect_pix == g.defect_pix &&
+            r.defective == g.defective)
+            continue;
+        if (reported++ < MAX_REPORTED_DIFFS)
+            g_printerr ("stream %u frame %" G_GUINT64_FORMAT ": otsu_thr %u/%u mango_pix %u/%u defect_pix %u/%u "
+                        "defective %d/%d (golden/replay)\n", ref.first.first, ref.first.second,
+                        g.otsu_thr, r.otsu_thr, g.mango_pix, r.mango_pix, g.defect_pix, r.defect_pix,
+                        g.defective, r.defective);
+        differ++;
+    }
+    for (auto &rep : replay) {
+        if (reference.count (rep.first))
+            continue;
+        if (reported++ < MAX_REPORTED_DIFFS)
+            g_printerr ("stream %u frame %" G_GUINT64_FORMAT ": not in the golden log\n",
+                        rep.first.first, rep.first.second);
+        extra++;
+    }
+    g_printerr ("Replay of %zu frames against %zu golden: %u differ, %u missing, %u extra\n",
+                replay.size (), reference.size (), differ, missing, extra);
+    return differ + missing + extra;
+}
+
+/*
+ * Counts the frames text2overlay judged, as its accumulated defect count
+ * does, and records their glass-to-decision latency. Without text2overlay
+ * the frames are judged here against its defect_threshold.
+ */
+static GstPadProbeReturn
+final_probe_cb (GstPad *pad, GstPadProbeInfo *info, AppData *data) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstDefectMeta *meta = gst_buffer_get_defect_meta (buffer);
+    guint64 latency = 0, max;
+    guint64 frame = __atomic_fetch_add (&data->frames, 1, __ATOMIC_RELAXED);
+    gboolean defective;
+    gdouble density, threshold;
+    if (!meta)
+        return GST_PAD_PROBE_OK;
+    if (meta->capture_ns) {
+        latency = dd_stats_clock_ns () - meta->capture_ns;
+        dd_stats_record (DD_STATS_PIPELINE, DD_STATS_TOTAL, latency);
+        max = __atomic_load_n (&data->window_max_ns, __ATOMIC_RELAXED);
+        while (latency > max && !__atomic_compare_exchange_n (&data->window_max_ns, &max, latency, TRUE,
+                                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+    if (headless) {
+        if (!(meta->flags & GST_DEFECT_META_HAS_COUNTS))
+            return GST_PAD_PROBE_OK;
+        /* same percentage text2overlay compares */
+        density = meta->mango_pix ? ((gdouble) meta->defect_pix / meta->mango_pix) * 100.0 : 0.0;
+        __atomic_load (&defect_threshold, &threshold, __ATOMIC_RELAXED);
+        defective = density > threshold;
+        if (verdict_fp)
+            write_verdict (data, meta, frame, density, defective);
+        else
+            print_result (data, buffer, meta, frame, density, defective, latency);
+    } else {
+        defective = (meta->flags & GST_DEFECT_META_DEFECTIVE) != 0;
+    }
+    if (defective)
+        __atomic_add_fetch (&data->defective_frames, 1, __ATOMIC_RELAXED);
+    if (meta->flags & GST_DEFECT_META_HAS_THRESHOLD)
+        __atomic_store_n (&data->otsu_thr, meta->otsu_thr, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+}
+
+/* Decimates the previews and the final display under the latency budget */
+static GstPadProbeReturn
+display_probe_cb (GstPad *pad, GstPadProbeInfo *info, AppData *data) {
+    BUDGET_BRANCH branch = (BUDGET_BRANCH) GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (pad), "budget-branch"));
+    guint level = __atomic_load_n (&data->level, __ATOMIC_RELAXED);
+    guint64 n = __atomic_add_fetch (&data->branch_frames[branch], 1, __ATOMIC_RELAXED);
+
+    if (level == LATENCY_LEVEL_NORMAL || (branch == BUDGET_BRANCH_FINAL && level < LATENCY_LEVEL_INSPECT))
+        return GST_PAD_PROBE_OK;
+    if (n % PREVIEW_DECIMATION == 0)
+        return GST_PAD_PROBE_OK;
+    __atomic_add_fetch (&data->budget_drops[branch], 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_DROP;
+}
+
+/* A frame that waited longer than the budget can not be judged in time */
+static GstPadProbeReturn
+inspect_probe_cb (GstPad *pad, GstPadProbeInfo *info, AppData *data) {
+    GstDefectMeta *meta = gst_buffer_get_defect_meta (GST_PAD_PROBE_INFO_BUFFER (info));
+
+    if (__atomic_load_n (&data->level, __ATOMIC_RELAXED) < LATENCY_LEVEL_INSPECT || !meta || !meta->capture_ns)
+        return GST_PAD_PROBE_OK;
+    if (dd_stats_clock_ns () - meta->capture_ns <= (guint64) latency_budget * GST_MSECOND)
+        return GST_PAD_PROBE_OK;
+    __atomic_add_fetch (&data->budget_drops[BUDGET_BRANCH_INSPECT], 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_DROP;
+}
+
+static void
+add_buffer_probe (GstElement *element, const gchar *pad_name, GstPadProbeCallback cb, AppData *data, gint branch) {
+    GstPad *pad = gst_element_get_static_pad (element, pad_name);
+    if (branch >= 0)
+        g_object_set_data (G_OBJECT (pad), "budget-branch", GUINT_TO_POINTER (branch));
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, cb, data, NULL);
+    gst_object_unref (pad);
+}
+
+static void
+attach_probes (AppData *data) {
+    GstElement *queues[NUM_METRIC_QUEUES];
+    const gchar *names[NUM_METRIC_QUEUES];
+    guint i;
+
+    metric_queues (data, queues, names);
+    for (i = 0; i < NUM_METRIC_QUEUES; i++) {
+        if (queues[i])
+            g_signal_connect (queues[i], "overrun", G_CALLBACK (queue_overrun_cb), &data->overruns[i]);
+    }
+    if (headless) {
+        add_buffer_probe (fused ? data->fused : data->otsu, "sink", (GstPadProbeCallback) capture_probe_cb, data, -1);
+        add_buffer_probe (fused ? data->fused : data->cca, "src", (GstPadProbeCallback) final_probe_cb, data, -1);
+        return;
+    }
+    add_buffer_probe (data->tee_raw, "sink", (GstPadProbeCallback) capture_probe_cb, data, -1);
+    add_buffer_probe (data->text2overlay, "src", (GstPadProbeCallback) final_probe_cb, data, -1);
+    if (!latency_budget)
+        return;
+    add_buffer_probe (data->queue_raw, "sink", (GstPadProbeCallback) display_probe_cb, data, BUDGET_BRANCH_RAW);
+    add_buffer_probe (data->queue_preprocess, "sink", (GstPadProbeCallback) display_probe_cb, data, BUDGET_BRANCH_PREPROCESS);
+    add_buffer_probe (data->perf_display, "sink", (GstPadProbeCallback) display_probe_cb, data, BUDGET_BRANCH_FINAL);
+    add_buffer_probe (data->queue_raw2, "src", (GstPadProbeCallback) inspect_probe_cb, data, -1);
+}
+
+/* Leaky downstream queues drop their oldest frame instead of blocking the tee */
+static void
+apply_latency_level (AppData *data, guint level) {
+    GST_DEBUG ("stream %u latency level %u", data->index, level);
+    g_object_set (G_OBJECT (data->queue_raw),        "leaky", level >= LATENCY_LEVEL_PREVIEW ? 2 : 0, NULL);
+    g_object_set (G_OBJECT (data->queue_preprocess), "leaky", level >= LATENCY_LEVEL_PREVIEW ? 2 : 0, NULL);
+    g_object_set (G_OBJECT (data->queue_raw2),       "leaky", level >= LATENCY_LEVEL_INSPECT ? 2 : 0, NULL);
+    __atomic_store_n (&data->level, level, __ATOMIC_RELAXED);
+}
+
+static guint
+queue_level (GstElement *queue) {
+    guint level = 0;
+    g_object_get (G_OBJECT (queue), "current-level-buffers", &level, NULL);
+    return level;
+}
+
+/*
+ * Runs on the main loop every LATENCY_CHECK_INTERVAL_MS. A stream goes one
+ * level up as soon as the worst latency of the interval exceeds the budget
+ * or frames pile up in front of the inspection, and one level down after
+ * LATENCY_CALM_CHECKS intervals below half the budget.
+ */
+static gboolean
+latency_check_cb (AppData *data) {
+    guint64 budget_ns = (guint64) latency_budget * GST_MSECOND;
+    guint i;
+
+    for (i = 0; i < num_streams; i++) {
+        AppData *d = &data[i];
+        guint64 worst = __atomic_exchange_n (&d->window_max_ns, 0, __ATOMIC_RELAXED);
+        gboolean backlog = queue_level (d->queue_raw2) >= LATENCY_QUEUE_PRESSURE ||
+                           queue_level (d->queue_preprocess2) >= LATENCY_QUEUE_PRESSURE;
+        guint level = d->level;
+
+        if (worst > budget_ns || backlog) {
+            d->calm_checks = 0;
+            if (level < LATENCY_LEVEL_INSPECT)
+                apply_latency_level (d, level + 1);
+        } else if (worst < budget_ns / 2 && level > LATENCY_LEVEL_NORMAL) {
+            if (++d->calm_checks >= LATENCY_CALM_CHECKS) {
+                d->calm_checks = 0;
+                apply_latency_level (d, level - 1);
+            }
+        } else {
+            d->calm_checks = 0;
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+metrics_header (GString *out, const gchar *name, const gchar *type, const gchar *help) {
+    g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Renders the Prometheus text exposition format */
+static GString *
+metrics_render (AppData *data) {
+    GString *out = g_string_new (NULL);
+    GstElement *queues[NUM_METRIC_QUEUES];
+    const gchar *names[NUM_METRIC_QUEUES];
+    DDStatsSummary sum;
+    guint i, q;
+    gint stage, phase;
+
+    metrics_header (out, "defect_detect_frames_total", "counter", "Frames that went through text2overlay.");
+    for (i = 0; i < num_streams; i++)
+        g_string_append_printf (out, "defect_detect_frames_total{stream=\"%u\"} %" G_GUINT64_FORMAT "\n",
+                                i, __atomic_load_n (&data[i].frames, __ATOMIC_RELAXED));
+    metrics_header (out, "defect_detect_defective_frames_total", "counter", "Frames with a defect density above the threshold.");
+    for (i = 0; i < num_streams; i++)
+        g_string_append_printf (out, "defect_detect_defective_frames_total{stream=\"%u\"} %" G_GUINT64_FORMAT "\n",
+                                i, __atomic_load_n (&data[i].defective_frames, __ATOMIC_RELAXED));
+    metrics_header (out, "defect_detect_otsu_threshold", "gauge", "Otsu threshold of the last frame.");
+    for (i = 0; i < num_streams; i++)
+        g_string_append_printf (out, "defect_detect_otsu_threshold{stream=\"%u\"} %u\n",
+                                i, __atomic_load_n (&data[i].otsu_thr, __ATOMIC_RELAXED));
+
+    metrics_header (out, "defect_detect_queue_overruns_total", "counter",
+                    "Frames that found the queue full; a leaky queue drops them.");
+    for (i = 0; i < num_streams; i++) {
+        metric_queues (&data[i], queues, names);
+        for (q = 0; q < NUM_METRIC_QUEUES; q++) {
+            if (queues[q])
+                g_string_append_printf (out, "defect_detect_queue_overruns_total{stream=\"%u\",queue=\"%s\"} %"
+                                        G_GUINT64_FORMAT "\n", i, names[q],
+                                        __atomic_load_n (&data[i].overruns[q], __ATOMIC_RELAXED));
+        }
+    }
+    if (latency_budget) {
+        const gchar *branches[NUM_BUDGET_BRANCHES] = { "raw", "preprocess", "final", "inspect" };
+        metrics_header (out, "defect_detect_latency_level", "gauge",
+                        "Degradation step of the latency budget, 0 normal, 1 previews, 2 inspection.");
+        for (i = 0; i < num_streams; i++)
+            g_string_append_printf (out, "defect_detect_latency_level{stream=\"%u\"} %u\n",
+                                    i, __atomic_load_n (&data[i].level, __ATOMIC_RELAXED));
+        metrics_header (out, "defect_detect_budget_dropped_frames_total", "counter",
+                        "Frames dropped by the latency budget.");
+        for (i = 0; i < num_streams; i++) {
+            for (q = 0; q < NUM_BUDGET_BRANCHES; q++)
+                g_string_append_printf (out, "defect_detect_budget_dropped_frames_total{stream=\"%u\",branch=\"%s\"} %"
+                                        G_GUINT64_FORMAT "\n", i, branches[q],
+                                        __atomic_load_n (&data[i].budget_drops[q], __ATOMIC_RELAXED));
+        }
+    }
+    metrics_header (out, "defect_detect_queue_level_buffers", "gauge", "Frames waiting in the queue.");
+    for (i = 0; i < num_streams; i++) {
+        metric_queues (&data[i], queues, names);
+        for (q = 0; q < NUM_METRIC_QUEUES; q++) {
+            guint level = 0;
+            if (!queues[q])
+                continue;
+            g_object_get (G_OBJECT (queues[q]), "current-level-buffers", &level, NULL);
+            g_string_append_printf (out, "defect_detect_queue_level_buffers{stream=\"%u\",queue=\"%s\"} %u\n",
+                                    i, names[q], level);
+        }
+    }
+    if (demo_mode) {
+        metrics_header (out, "defect_detect_videorate_dropped_frames_total", "counter",
+                        "Frames dropped by videorate to reach the demo frame rate.");
+        for (i = 0; i < num_streams; i++) {
+            GstElement *rates[] = { data[i].videorate_raw, data[i].videorate_preprocess, data[i].videorate_display };
+            const gchar *branches[] = { "raw", "preprocess", "final" };
+            for (q = 0; q < G_N_ELEMENTS (rates); q++) {
+                guint64 dropped = 0;
+                g_object_get (G_OBJECT (rates[q]), "drop", &dropped, NULL);
+                g_string_append_printf (out, "defect_detect_videorate_dropped_frames_total{stream=\"%u\",branch=\"%s\"} %"
+                                        G_GUINT64_FORMAT "\n", i, branches[q], dropped);
+            }
+        }
+    }
+
+    /* kernel library histograms are process wide, summed over the streams */
+    metrics_header (out, "defect_detect_stage_latency_seconds", "summary",
+                    "Time per frame spent in each phase of a stage.");
+    for (stage = 0; stage < DD_STATS_NUM_STAGES; stage++) {
+        for (phase = 0; phase < DD_STATS_NUM_PHASES; phase++) {
+            const gchar *sname = dd_stats_stage_name ((DDStatsStage) stage);
+            const gchar *pname = dd_stats_phase_name ((DDStatsPhase) phase);
+            const uint64_t *quantiles[] = { &sum.p50_ns, &sum.p90_ns, &sum.p99_ns };
+            const gchar *labels[] = { "0.5", "0.9", "0.99" };
+            if (!dd_stats_summary ((DDStatsStage) stage, (DDStatsPhase) phase, &sum))
+                continue;
+            for (q = 0; q < G_N_ELEMENTS (quantiles); q++)
+                g_string_append_printf (out, "defect_detect_stage_latency_seconds{stage=\"%s\",phase=\"%s\",quantile=\"%s\"} %.9f\n",
+                                        sname, pname, labels[q], *quantiles[q] / 1e9);
+            g_string_append_printf (out, "defect_detect_stage_latency_seconds_sum{stage=\"%s\",phase=\"%s\"} %.9f\n",
+                                    sname, pname, sum.sum_ns / 1e9);
+            g_string_append_printf (out, "defect_detect_stage_latency_seconds_count{stage=\"%s\",phase=\"%s\"} %"
+                                    G_GUINT64_FORMAT "\n", sname, pname, (guint64) sum.count);
+        }
+    }
+    metrics_header (out, "defect_detect_accelerator_timeouts_total", "counter",
+                    "Accelerator commands that failed or did not complete in time.");
+    for (stage = 0; stage <= DD_STATS_CCA; stage++)
+        g_string_append_printf (out, "defect_detect_accelerator_timeouts_total{stage=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                dd_stats_stage_name ((DDStatsStage) stage), (guint64) dd_stats_timeouts ((DDStatsStage) stage));
+    return out;
+}
+
+/*
+ * Serves one scrape on a thread of the service, so a slow or silent client
+ * never holds up the main loop: HTTP/1.0, GET /metrics only, the connection
+ * is closed after the response.
+ */
+static gboolean
+metrics_run_cb (GThreadedSocketService *service, GSocketConnection *conn, GObject *source, AppData *data) {
+    gchar request[512];
+    gssize len;
+    GString *body = NULL;
+    gchar *header;
+    GOutputStream *os = g_io_stream_get_output_stream (G_IO_STREAM (conn));
+
+    g_socket_set_timeout (g_socket_connection_get_socket (conn), METRICS_READ_TIMEOUT_S);
+    len = g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (conn)), request, sizeof (request) - 1, NULL, NULL);
+    if (len <= 0)
+        goto exit;
+    request[len] = '\0';
+
+    if (g_str_has_prefix (request, "GET /metrics ") || g_str_has_prefix (request, "GET / ")) {
+        body = metrics_render (data);
+        header = g_strdup_printf ("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %" G_GSIZE_FORMAT "\r\nConnection: close\r\n\r\n", body->len);
+    } else {
+        header = g_strdup ("HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    if (g_output_stream_write_all (os, header, strlen (header), NULL, NULL, NULL) && body)
+        g_output_stream_write_all (os, body->str, body->len, NULL, NULL, NULL);
+    g_free (header);
+    if (body)
+        g_string_free (body, TRUE);
+exit:
+    g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
+    return TRUE;
+}
+
+static void
+release_stream (AppData *data) {
+    guint i;
+    for (i = 0; i < NUM_CAPTURES; i++) {
+        CaptureOut *out = &data->captures[i];
+        DDCaptureStats stats;
+        if (!out->writer)
+            continue;
+        if (dd_capture_writer_free (out->writer, &stats) < 0)
+            g_printerr ("Writing %s failed, the capture is incomplete\n", out->path);
+        g_printerr ("Capture %s: %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " dropped, compressed %.1f:1\n",
+                    out->path, stats.frames, stats.dropped,
+                    stats.written_bytes ? (gdouble) stats.raw_bytes / stats.written_bytes : 0.0);
+        out->writer = NULL;
+    }
+    if (data->pad_raw) {
+        GST_DEBUG ("releasing pad");
+        gst_element_release_request_pad (data->tee_raw, data->pad_raw);
+        gst_object_unref (data->pad_raw);
+    }
+    if (data->pad_raw2) {
+        GST_DEBUG ("releasing pad");
+        gst_element_release_request_pad (data->tee_raw, data->pad_raw2);
+        gst_object_unref (data->pad_raw2);
+    }
+    if (data->pad_preprocess) {
+        GST_DEBUG ("releasing pad");
+        gst_element_release_request_pad (data->tee_preprocess, data->pad_preprocess);
+        gst_object_unref (data->pad_preprocess);
+    }
+    if (data->pad_preprocess2) {
+        GST_DEBUG ("releasing pad");
+        gst_element_release_request_pad (data->tee_preprocess, data->pad_preprocess2);
+        gst_object_unref (data->pad_preprocess2);
+    }
+    if (data->mapping)
+        g_mapped_file_unref (data->mapping);
+    g_free (data->source);
+    g_free (data->raw_out);
+    g_free (data->preprocess_out);
+    g_free (data->final_out);
+}
+
 gint
 main (int argc, char **argv) {
-    AppData data;
+    AppData data[MAX_STREAMS];
+    GstElement *pipeline = NULL;
     GstBus *bus;
     gint ret = DD_SUCCESS;
-    guint bus_watch_id;
+    guint bus_watch_id = 0;
+    guint stats_signal_id = 0;
+    guint reload_signal_id = 0;
+    guint stats_timer_id = 0;
+    guint latency_timer_id = 0;
+    GSocketService *metrics_service = NULL;
+    guint i;
+    gchar **source_list = NULL;
     GOptionContext *optctx;
     GError *error = NULL;
 
-    memset (&data, 0, sizeof(AppData));
+    memset (data, 0, sizeof(data));
 
     gst_init(&argc, &argv);
     signal(SIGINT, signal_handler);
@@ -620,105 +1786,304 @@ main (int argc, char **argv) {
         GST_DEBUG ("In file is %s", in_file);
     }
 
+    if (golden_log && !verdict_log) {
+        g_printerr ("--golden compares the log of --verdictlog, which is missing\n");
+        ret = DD_ERROR_INPUT_OPTIONS_INVALID;
+        g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+        return ret;
+    }
+    if (verdict_log) {
+        /* replay of recordings, the verdicts are the only output besides --finalout */
+        if (!in_file && !sources) {
+            g_printerr ("--verdictlog replays recorded files, give them with --infile or --sources\n");
+            ret = DD_ERROR_INPUT_OPTIONS_INVALID;
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            return ret;
+        }
+        headless = TRUE;
+    }
+
+    if (sources) {
+        if (in_file) {
+            g_printerr ("--infile and --sources can not be used together\n");
+            ret = DD_ERROR_INPUT_OPTIONS_INVALID;
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            return ret;
+        }
+        source_list = g_strsplit (sources, ",", -1);
+        num_streams = g_strv_length (source_list);
+        if (num_streams == 0 || num_streams > MAX_STREAMS || (!file_dump && !headless && num_streams > MAX_DISPLAY_STREAMS)) {
+            g_printerr ("Between 1 and %u sources are supported, %u with display output\n", MAX_STREAMS, MAX_DISPLAY_STREAMS);
+            g_strfreev (source_list);
+            ret = DD_ERROR_INPUT_OPTIONS_INVALID;
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            return ret;
+        }
+    }
+
     GST_DEBUG ("Width is %d", width);
     GST_DEBUG ("height is %d", height);
     GST_DEBUG ("framerate is %d", framerate);
     GST_DEBUG ("file playback mode is %s", file_playback ? "TRUE" : "FALSE");
     GST_DEBUG ("file dump is %s", file_dump ? "TRUE" : "FALSE");
     GST_DEBUG ("demo mode is %s", demo_mode ? "On" : "Off");
+    GST_DEBUG ("pipelined queue depth is %u", pipelined);
+    GST_DEBUG ("fused mode is %s", fused ? "On" : "Off");
+    GST_DEBUG ("number of streams is %u", num_streams);
+    GST_DEBUG ("batch size is %u", batch);
+    GST_DEBUG ("latency budget is %u ms", latency_budget);
+    GST_DEBUG ("headless mode is %s", headless ? "On" : "Off");
+    GST_DEBUG ("mmap input is %s, loops %u", mmap_input ? "On" : "Off", loops);
+
+    if (headless) {
+        /* nothing is shown, only the final output can be written to a file */
+        if (demo_mode || latency_budget || raw_out || preprocess_out)
+            g_printerr ("Headless mode has no display or preview branches, ignoring demo mode, latency budget and raw and pre-process outputs\n");
+        demo_mode = FALSE;
+        latency_budget = 0;
+        file_dump = FALSE;
+        load_defect_threshold ();
+    }
+
+    /* the bit mask cannot be shown or dumped as a frame, only CCA reads it */
+    if (!headless && !fused && preprocess_mask_bits ()) {
+        g_printerr ("mask_format bits of %s needs headless mode, the pre-process output is shown or dumped\n",
+                    PRE_PROCESS_JSON_FILE);
+        ret = DD_ERROR_INPUT_OPTIONS_INVALID;
+        g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+        g_strfreev (source_list);
+        return ret;
+    }
+
+    if (capture && !final_out) {
+        g_printerr ("Capture files are written for the --rawout, --preprocessout and --finalout outputs, ignoring it\n");
+        capture = FALSE;
+    }
+
+    if (loops != 1 && !mmap_input) {
+        g_printerr ("Looping is only available for mapped input files, ignoring it\n");
+        loops = 1;
+    }
+
+    if (fused && pipelined) {
+        g_printerr ("Pipelined mode has no effect with the fused element, ignoring it\n");
+        pipelined = 0;
+    }
+
+    if (batch == 0 || (batch > 1 && (demo_mode || (!in_file && !sources)))) {
+        if (batch > 1)
+            g_printerr ("Batch mode is only available for file playback without demo mode, ignoring it\n");
+        batch = 1;
+    }
+    /* let otsu run a batch ahead of pre-process as well */
+    if (batch > 1 && !fused && !pipelined)
+        pipelined = batch;
+    if (batch > 1 && latency_budget) {
+        g_printerr ("Batch mode does not keep a latency budget, ignoring it\n");
+        latency_budget = 0;
+    }
 
     if (config_path)
         GST_DEBUG ("config path is %s", config_path);
 
-    if (dev_node.c_str())
-        GST_DEBUG ("media node is %s", dev_node.c_str());
-
-    if (width > MAX_WIDTH || height > MAX_HEIGHT) {
+    /* the display layout is built for 1280x800 channels */
+    if (width > (headless ? MAX_TILED_WIDTH : MAX_WIDTH) || height > (headless ? MAX_TILED_HEIGHT : MAX_HEIGHT)) {
         ret = DD_ERROR_RESOLUTION_NOT_SUPPORTED;
         g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+        g_strfreev (source_list);
         return ret;
     }
 
-    if (access("/dev/dri/by-path/platform-b0010000.v_mix-card", F_OK) != 0) {
+    if (headless) {
+        GST_DEBUG ("Headless, not setting up the mixer");
+    } else if (access("/dev/dri/by-path/platform-b0010000.v_mix-card", F_OK) != 0) {
         g_printerr("ERROR: Mixer device is not ready.\n%s", msg_firmware);
+        g_strfreev (source_list);
         return -1;
     } else {
         exec("echo | modetest -M xlnx -D B0010000.v_mix -s 52@40:3840x2160@NV16");
     }
 
-    if (!file_playback && (check_mipi_src() != 0)) {
+    if (!source_list && !file_playback && (check_mipi_src() != 0)) {
         g_printerr ("MIPI media node not found, please check the connection of camera\n");
         return -1;
     }
-    if (!file_playback ) {
+
+    for (i = 0; i < num_streams; i++) {
+        data[i].index = i;
+        if (source_list) {
+            data[i].source = g_strdup (g_strstrip (source_list[i]));
+            data[i].file_playback = !g_str_has_prefix (data[i].source, LIVE_SOURCE_PREFIX);
+        } else {
+            data[i].source = g_strdup (file_playback ? in_file : dev_node.c_str());
+            data[i].file_playback = file_playback;
+        }
+        if (file_dump) {
+            data[i].raw_out = stream_file_name (raw_out, i);
+            data[i].preprocess_out = stream_file_name (preprocess_out, i);
+            data[i].final_out = stream_file_name (final_out, i);
+        } else if (headless && final_out) {
+            data[i].final_out = stream_file_name (final_out, i);
+        }
+        GST_DEBUG ("stream %u source is %s", i, data[i].source);
+        if (data[i].file_playback)
+            continue;
+        if (verdict_log) {
+            g_printerr ("ERROR: %s is a live source, replay takes recorded files only\n", data[i].source);
+            ret = DD_ERROR_INPUT_OPTIONS_INVALID;
+            goto CLOSE;
+        }
+        if (access (data[i].source, F_OK) != 0) {
+            g_printerr("ERROR: Device %s is not ready.\n%s", data[i].source, msg_firmware);
+            ret = -1;
+            goto CLOSE;
+        }
         std::string script_caller;
         GST_DEBUG ("Calling default sensor calibration script");
-        script_caller = "echo | ar0144-sensor-calib.sh " + dev_node;
+        script_caller = std::string ("echo | ar0144-sensor-calib.sh ") + data[i].source;
         exec(script_caller.c_str());
     }
-    ret = create_pipeline (&data);
-    if (ret != DD_SUCCESS) {
+
+    pipeline = gst_pipeline_new("defectdetection");
+    if (!pipeline) {
+        ret = DD_ERROR_PIPELINE_CREATE_FAIL;
         g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
-        return ret;
+        goto CLOSE;
     }
 
-    ret = link_pipeline (&data);
-    if (ret != DD_SUCCESS) {
-        g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
-        return ret;
+    for (i = 0; i < num_streams; i++) {
+        data[i].pipeline = pipeline;
+        ret = create_pipeline (&data[i]);
+        if (ret != DD_SUCCESS) {
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            goto CLOSE;
+        }
+
+        ret = link_pipeline (&data[i]);
+        if (ret != DD_SUCCESS) {
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            goto CLOSE;
+        }
+
+        ret = set_pipeline_config (&data[i]);
+        if (ret != DD_SUCCESS) {
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            goto CLOSE;
+        }
+
+        if (!data[i].file_playback) {
+            g_signal_connect (data[i].src, "pad-added", G_CALLBACK (pad_added_cb), &data[i]);
+        }
+        attach_probes (&data[i]);
     }
 
-    ret = set_pipeline_config (&data);
-    if (ret != DD_SUCCESS) {
-        g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
-        return ret;
+    if (stats_out) {
+        stats_fp = fopen (stats_out, "a");
+        if (!stats_fp) {
+            g_printerr ("Unable to open %s: %s\n", stats_out, strerror (errno));
+            ret = DD_ERROR_FILE_IO;
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            goto CLOSE;
+        }
+    } else {
+        stats_fp = stdout;
+    }
+    if (verdict_log) {
+        verdict_fp = fopen (verdict_log, "w");
+        if (!verdict_fp) {
+            g_printerr ("Unable to open %s: %s\n", verdict_log, strerror (errno));
+            ret = DD_ERROR_FILE_IO;
+            g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            goto CLOSE;
+        }
+        fprintf (verdict_fp, "%s\n", VERDICT_LOG_HEADER);
     }
 
     /* we add a message handler */
-    bus = gst_pipeline_get_bus (GST_PIPELINE (data.pipeline));
-    bus_watch_id = gst_bus_add_watch (bus, (GstBusFunc)(message_cb), &data);
+    bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+    bus_watch_id = gst_bus_add_watch (bus, (GstBusFunc)(message_cb), &data[0]);
     gst_object_unref (bus);
 
-    if (!file_playback) {
-        g_signal_connect (data.src, "pad-added", G_CALLBACK (pad_added_cb), &data);
+    stats_signal_id = g_unix_signal_add (SIGUSR1, stats_dump_cb, NULL);
+    watch_configs ();
+    reload_signal_id = g_unix_signal_add (SIGHUP, config_reload_cb, NULL);
+    if (stats_interval)
+        stats_timer_id = g_timeout_add_seconds (stats_interval, stats_dump_cb, NULL);
+    if (latency_budget)
+        latency_timer_id = g_timeout_add (LATENCY_CHECK_INTERVAL_MS, (GSourceFunc) latency_check_cb, data);
+
+    if (metrics_port) {
+        metrics_service = g_threaded_socket_service_new (METRICS_MAX_THREADS);
+        if (!g_socket_listener_add_inet_port (G_SOCKET_LISTENER (metrics_service), metrics_port, NULL, &error)) {
+            g_printerr ("Unable to serve metrics on port %u: %s\n", metrics_port, error->message);
+            g_clear_error (&error);
+            ret = DD_ERROR_OTHER;
+            goto CLOSE;
+        }
+        g_signal_connect (metrics_service, "run", G_CALLBACK (metrics_run_cb), data);
+        g_socket_service_start (metrics_service);
     }
+
     GST_DEBUG ("Triggering play command");
-    if (GST_STATE_CHANGE_FAILURE == gst_element_set_state (data.pipeline, GST_STATE_PLAYING)) {
+    if (GST_STATE_CHANGE_FAILURE == gst_element_set_state (pipeline, GST_STATE_PLAYING)) {
         g_printerr ("state change to Play failed\n");
+        ret = DD_ERROR_STATE_CHANGE_FAIL;
+        g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
         goto CLOSE;
     }
     GST_DEBUG ("waiting for the loop");
     loop = g_main_loop_new (NULL, FALSE);
     g_main_loop_run (loop);
+    if (pipeline_error) {
+        ret = DD_ERROR_PIPELINE_RUN_FAIL;
+        g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+    }
 CLOSE:
-    gst_element_set_state(data.pipeline, GST_STATE_NULL);
-    if (data.pipeline) {
-        if (data.pad_raw) {
-            GST_DEBUG ("releasing pad");
-            gst_element_release_request_pad (data.tee_raw, data.pad_raw);
-            gst_object_unref (data.pad_raw);
-        }
-        if (data.pad_raw2) {
-            GST_DEBUG ("releasing pad");
-            gst_element_release_request_pad (data.tee_raw, data.pad_raw2);
-            gst_object_unref (data.pad_raw2);
-        }
-        if (data.pad_preprocess) {
-            GST_DEBUG ("releasing pad");
-            gst_element_release_request_pad (data.tee_preprocess, data.pad_preprocess);
-            gst_object_unref (data.pad_preprocess);
-        }
-        if (data.pad_preprocess2) {
-            GST_DEBUG ("releasing pad");
-            gst_element_release_request_pad (data.tee_preprocess, data.pad_preprocess2);
-            gst_object_unref (data.pad_preprocess2);
-        }
-        gst_object_unref (GST_OBJECT (data.pipeline));
-        data.pipeline = NULL;
-    }
-    GST_DEBUG ("Removing bus");
-    g_source_remove (bus_watch_id);
+    if (metrics_service) {
+        g_socket_service_stop (metrics_service);
+        g_socket_listener_close (G_SOCKET_LISTENER (metrics_service));
+        g_object_unref (metrics_service);
+    }
+    if (pipeline)
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+    for (i = 0; i < num_streams; i++)
+        release_stream (&data[i]);
+    if (pipeline) {
+        gst_object_unref (GST_OBJECT (pipeline));
+        pipeline = NULL;
+    }
+    if (bus_watch_id) {
+        GST_DEBUG ("Removing bus");
+        g_source_remove (bus_watch_id);
+    }
+    if (latency_timer_id)
+        g_source_remove (latency_timer_id);
+    if (stats_timer_id)
+        g_source_remove (stats_timer_id);
+    if (stats_signal_id)
+        g_source_remove (stats_signal_id);
+    if (reload_signal_id)
+        g_source_remove (reload_signal_id);
+    unwatch_configs ();
+    if (stats_fp) {
+        dd_stats_dump (stats_fp);
+        if (stats_fp != stdout)
+            fclose (stats_fp);
+    }
+    if (verdict_fp) {
+        fclose (verdict_fp);
+        if (golden_log && ret == DD_SUCCESS) {
+            gint diffs = diff_verdicts (verdict_log, golden_log);
+            if (diffs) {
+                ret = diffs < 0 ? DD_ERROR_FILE_IO : DD_ERROR_REPLAY_MISMATCH;
+                g_printerr ("Exiting the app with an error: %s\n", error_to_string (ret));
+            }
+        }
+    }
 
+    g_strfreev (source_list);
+    if (sources)
+        g_free (sources);
     if (in_file)
         g_free (in_file);
     if (final_out)
@@ -727,6 +2092,12 @@ CLOSE:
         g_free (raw_out);
     if (preprocess_out)
         g_free (preprocess_out);
+    if (stats_out)
+        g_free (stats_out);
+    if (verdict_log)
+        g_free (verdict_log);
+    if (golden_log)
+        g_free (golden_log);
     return ret;
 }
 
@@ -14,20 +14,75 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include <vvas/vvaslogs.h>
 #include <vvas/vvas_kernel.h>
-#include <gst/vvas/gstinferencemeta.h>
+#include "gstdefectmeta.h"
+#include "dd_cpu_kernels.h"
+#include "dd_stats.h"
+#include "dd_buffers.h"
+#include "dd_config.h"
 
-#define MAX_SUPPORTED_WIDTH         1280
-#define MAX_SUPPORTED_HEIGHT        800
+#define MAX_SUPPORTED_WIDTH         DD_ACCEL_MAX_WIDTH
+#define MAX_SUPPORTED_HEIGHT        DD_ACCEL_MAX_HEIGHT
+#define DEFAULT_MAX_BLOBS           0
+#define DEFAULT_MIN_BLOB_AREA       1
+#define DEFECT_PAINT_VALUE          128
+#define KERNEL_DONE_TIMEOUT_MS      1000
+#define DEFAULT_NUM_CU              1
+#define DEFAULT_TILE_THREADS        0
+#define DEFAULT_TILE_ROWS           0
+#define SCRATCH_SIZE                (MAX_SUPPORTED_WIDTH * MAX_SUPPORTED_HEIGHT)
 
 typedef struct _kern_priv
 {
     int log_level;
+    DDBackend backend;
+    int num_cu;
+    uint32_t max_blobs;
+    uint32_t min_blob_area;
+    uint16_t mem_bank;
+    /* attached to the buffer pool of the device */
+    gboolean pooled;
+    /* accelerator scratch, leased from the buffer pool for the command in flight */
     VVASFrame *tmp_mem1;
     VVASFrame *tmp_mem2;
+    /* copied into the defect meta on completion, see vvas_otsu.c */
     VVASFrame *mango_pix;
     VVASFrame *defect_pix;
+    uint32_t sw_mango_pix;
+    uint32_t sw_defect_pix;
+    DDCcaCtx *cca;
+    /* command in flight between xlnx_kernel_start and xlnx_kernel_done */
+    gboolean pending;
+    /* the frame went to the accelerator and holds a CU of cca_cu_pool */
+    gboolean on_cu;
+    gboolean labelled;
+    VVASFrame *inframe;
+    VVASFrame *outframe;
+    GstDefectMeta *meta;
+    /* rectangle set by otsu, blobs are labelled inside it */
+    DDRoi roi;
+    /* the input is the ROI's mask at 1 bit per pixel, see vvas_preprocess.c */
+    gboolean in_bits;
+    uint32_t mask_stride;
+    uint8_t mask_value;
+    /* what the accelerator is given, see dd_accel_bands() */
+    DDRoi area;
+    /*
+     * The CPU labels in strips on a pool of tile_threads workers, merged
+     * across the seams. Frames larger than the accelerator always go this
+     * way; the accelerator only reports counts and cannot be stitched.
+     * The pool is started on the first frame labelled on the CPU.
+     */
+    DDTiler *tiler;
+    uint32_t tile_threads;
+    uint32_t tile_rows;
+    /* last config update taken from dd_config */
+    uint64_t config_gen;
+    DDStatsFrame stats;
+    /* end of the submit, the accelerator runs from here to the wait */
+    uint64_t exec_ns;
 } PreProcessingKernelPriv;
 
 int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT]);
@@ -35,22 +90,48 @@ int32_t xlnx_kernel_done(VVASKernel *handle);
 int32_t xlnx_kernel_init(VVASKernel *handle);
 uint32_t xlnx_kernel_deinit(VVASKernel *handle);
 
+/* shared by the CCA elements of all streams */
+static DDCuPool cca_cu_pool = DD_CU_POOL_INIT;
+/* one per stream, their tilers share the CPUs */
+static uint32_t cca_elements;
+
+static void
+cca_return_scratch (PreProcessingKernelPriv *kernel_priv)
+{
+    dd_buffer_put (kernel_priv->tmp_mem1);
+    dd_buffer_put (kernel_priv->tmp_mem2);
+    kernel_priv->tmp_mem1 = kernel_priv->tmp_mem2 = NULL;
+}
+
 uint32_t xlnx_kernel_deinit(VVASKernel *handle)
 {
     PreProcessingKernelPriv *kernel_priv;
     kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
-    if (kernel_priv->mango_pix)
-        vvas_free_buffer (handle, kernel_priv->mango_pix);
-    if (kernel_priv->defect_pix)
-        vvas_free_buffer (handle, kernel_priv->defect_pix);
-    if (kernel_priv->tmp_mem1)
-        vvas_free_buffer (handle, kernel_priv->tmp_mem1);
-    if (kernel_priv->tmp_mem2)
-        vvas_free_buffer (handle, kernel_priv->tmp_mem2);
+    if (kernel_priv->pooled) {
+        dd_buffer_put (kernel_priv->mango_pix);
+        dd_buffer_put (kernel_priv->defect_pix);
+        dd_buffers_detach ();
+    }
+    dd_cpu_cca_free (kernel_priv->cca);
+    dd_tiler_free (kernel_priv->tiler);
+    __atomic_sub_fetch (&cca_elements, 1, __ATOMIC_RELAXED);
     free(kernel_priv);
     return 0;
 }
 
+/* Both scratch buffers or none */
+static int32_t
+cca_lease_scratch (PreProcessingKernelPriv *kernel_priv)
+{
+    kernel_priv->tmp_mem1 = dd_buffer_get (SCRATCH_SIZE, kernel_priv->mem_bank);
+    kernel_priv->tmp_mem2 = dd_buffer_get (SCRATCH_SIZE, kernel_priv->mem_bank);
+    if (!kernel_priv->tmp_mem1 || !kernel_priv->tmp_mem2) {
+        cca_return_scratch (kernel_priv);
+        return -1;
+    }
+    return 0;
+}
+
 int32_t xlnx_kernel_init(VVASKernel *handle)
 {
     json_t *jconfig = handle->kernel_config;
@@ -61,11 +142,6 @@ int32_t xlnx_kernel_init(VVASKernel *handle)
     if (!kernel_priv) {
         printf("Error: Unable to allocate PPE kernel memory\n");
     }
-    uint32_t resolution = MAX_SUPPORTED_HEIGHT * MAX_SUPPORTED_WIDTH;
-    kernel_priv->mango_pix  = vvas_alloc_buffer (handle, 1*(sizeof(uint32_t)), VVAS_INTERNAL_MEMORY, DEFAULT_MEM_BANK, NULL);
-    kernel_priv->defect_pix = vvas_alloc_buffer (handle, 1*(sizeof(uint32_t)), VVAS_INTERNAL_MEMORY, DEFAULT_MEM_BANK, NULL);
-    kernel_priv->tmp_mem1   = vvas_alloc_buffer (handle, resolution*(sizeof(uint8_t)), VVAS_INTERNAL_MEMORY, DEFAULT_MEM_BANK, NULL);
-    kernel_priv->tmp_mem2   = vvas_alloc_buffer (handle, resolution*(sizeof(uint8_t)), VVAS_INTERNAL_MEMORY, DEFAULT_MEM_BANK, NULL);
 
     /* parse config */
     val = json_object_get (jconfig, "debug_level");
@@ -75,68 +151,372 @@ int32_t xlnx_kernel_init(VVASKernel *handle)
 	    kernel_priv->log_level = json_integer_value (val);
     LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: debug_level %d", kernel_priv->log_level);
 
+    val = json_object_get (jconfig, "backend");
+    if (!val || !json_is_string (val) || dd_backend_from_string (json_string_value (val)) < 0)
+	    kernel_priv->backend = DD_BACKEND_FPGA;
+    else
+	    kernel_priv->backend = dd_backend_from_string (json_string_value (val));
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: backend %s", dd_backend_to_string (kernel_priv->backend));
+
+    val = json_object_get (jconfig, "max_blobs");
+    if (!val || !json_is_integer (val))
+	    kernel_priv->max_blobs = DEFAULT_MAX_BLOBS;
+    else
+	    kernel_priv->max_blobs = json_integer_value (val);
+    if (kernel_priv->max_blobs > GST_DEFECT_META_MAX_BLOBS)
+        kernel_priv->max_blobs = GST_DEFECT_META_MAX_BLOBS;
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: max_blobs %u", kernel_priv->max_blobs);
+
+    val = json_object_get (jconfig, "min_blob_area");
+    if (!val || !json_is_integer (val))
+	    kernel_priv->min_blob_area = DEFAULT_MIN_BLOB_AREA;
+    else
+	    kernel_priv->min_blob_area = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: min_blob_area %u", kernel_priv->min_blob_area);
+
+    val = json_object_get (jconfig, "num_cu");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->num_cu = DEFAULT_NUM_CU;
+    else
+	    kernel_priv->num_cu = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: num_cu %d", kernel_priv->num_cu);
+
+    val = json_object_get (jconfig, "mem_bank");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->mem_bank = DEFAULT_MEM_BANK;
+    else
+	    kernel_priv->mem_bank = json_integer_value (val);
+
+    val = json_object_get (jconfig, "tile_threads");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->tile_threads = DEFAULT_TILE_THREADS;
+    else
+	    kernel_priv->tile_threads = json_integer_value (val);
+
+    val = json_object_get (jconfig, "tile_rows");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->tile_rows = DEFAULT_TILE_ROWS;
+    else
+	    kernel_priv->tile_rows = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: tile_threads %u", kernel_priv->tile_threads);
+
+    if (kernel_priv->backend != DD_BACKEND_CPU) {
+        int ret = -1;
+        if (dd_buffers_attach () == 0) {
+            kernel_priv->pooled = TRUE;
+            kernel_priv->mango_pix  = dd_buffer_get (1*(sizeof(uint32_t)), kernel_priv->mem_bank);
+            kernel_priv->defect_pix = dd_buffer_get (1*(sizeof(uint32_t)), kernel_priv->mem_bank);
+            /* fill the pool with the scratch of one command, the first frame does not allocate */
+            ret = cca_lease_scratch (kernel_priv);
+            cca_return_scratch (kernel_priv);
+        }
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: mem_bank %u", kernel_priv->mem_bank);
+        if ((!kernel_priv->mango_pix || !kernel_priv->defect_pix || ret < 0)
+            && kernel_priv->backend != DD_BACKEND_FPGA) {
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Device memory not available, using CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+        }
+    }
+    /* the labeller also serves blob statistics and frames too big for the FPGA */
+    kernel_priv->cca = dd_cpu_cca_new ();
+
+    __atomic_add_fetch (&cca_elements, 1, __ATOMIC_RELAXED);
     handle->kernel_priv = (void *)kernel_priv;
     handle->is_multiprocess = 1;
     return 0;
 }
 
-int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT])
+static int32_t
+cca_submit_fpga (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe, VVASFrame *outframe)
 {
-    PreProcessingKernelPriv *kernel_priv;
     int ret;
-    uint32_t *mango_pixel;
-    uint32_t *defect_pixel;
-    GstInferenceMeta *infer_meta = NULL;
-    VVASFrame *outframe = output[0];
+    uint64_t in_paddr, out_paddr;
+    DDRoi band = kernel_priv->area;
 
-    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
-    ret = vvas_kernel_start (handle, "pppppppuu", input[0]->paddr[0], input[0]->paddr[0], \
+    in_paddr = inframe->paddr[0] + (uint64_t) band.y * inframe->props.stride;
+    out_paddr = outframe->paddr[0] + (uint64_t) band.y * outframe->props.stride;
+    ret = vvas_kernel_start (handle, "pppppppuu", in_paddr, in_paddr, \
                              kernel_priv->tmp_mem1->paddr[0], kernel_priv->tmp_mem2->paddr[0], \
-                             output[0]->paddr[0], kernel_priv->mango_pix->paddr[0], kernel_priv->defect_pix->paddr[0], \
-                             input[0]->props.height, input[0]->props.width); 
+                             out_paddr, kernel_priv->mango_pix->paddr[0], kernel_priv->defect_pix->paddr[0], \
+                             band.height, band.width);
     if (ret < 0) {
         LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to issue execute command");
-        return FALSE;
+        return -1;
     }
+    return 0;
+}
 
+static int32_t
+cca_wait_fpga (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv)
+{
+    int ret;
     /* wait for kernel completion */
-    ret = vvas_kernel_done (handle, 1000);
+    ret = vvas_kernel_done (handle, KERNEL_DONE_TIMEOUT_MS);
     if (ret < 0) {
         LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to receive response from kernel");
-        return FALSE;
+        dd_stats_timeout (DD_STATS_CCA);
+        return -1;
     }
+    return 0;
+}
 
-    mango_pixel =  kernel_priv->mango_pix->vaddr[0];
-    defect_pixel =  kernel_priv->defect_pix->vaddr[0];
+/* Strips in parallel, see dd_tiler_for() */
+static gboolean
+cca_tiled (PreProcessingKernelPriv *kernel_priv, const DDRoi *roi)
+{
+    return dd_tiler_for (&kernel_priv->tiler, kernel_priv->tile_threads, kernel_priv->tile_rows,
+                         __atomic_load_n (&cca_elements, __ATOMIC_RELAXED), roi->width, roi->height) != NULL;
+}
 
-    infer_meta = (GstInferenceMeta *) gst_buffer_add_meta ((GstBuffer *) outframe->app_priv,
-                                                      gst_inference_meta_get_info (), NULL);
-    if (infer_meta == NULL) {
-        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "vvas meta data is not available");
-        return FALSE;
+/* Labels the input mask; @outframe is only written on the CPU backend */
+static int32_t
+cca_start_cpu (PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe, VVASFrame *outframe)
+{
+    const DDRoi *roi = &kernel_priv->roi;
+    uint8_t *dst = outframe ? (uint8_t *) outframe->vaddr[0] : NULL;
+    uint32_t dst_stride = outframe ? outframe->props.stride : 0;
+    const uint8_t *src;
+    uint8_t *roi_dst;
+    int tiled, ret;
+
+    if (!kernel_priv->cca || !inframe->vaddr[0] || (outframe && !dst)) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Frames are not mapped for CPU access");
+        return -1;
     }
-    if (NULL == infer_meta->prediction) {
-        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Allocating prediction");
-        infer_meta->prediction = gst_inference_prediction_new ();
+    roi_dst = dst ? dst + (size_t) roi->y * dst_stride + roi->x : NULL;
+    tiled = cca_tiled (kernel_priv, roi);
+    if (kernel_priv->in_bits) {
+        /* the bit mask holds the ROI only, from the start of the buffer */
+        src = (const uint8_t *) inframe->vaddr[0];
+        if (tiled)
+            ret = dd_cpu_cca_tiled_bits (kernel_priv->cca, kernel_priv->tiler, src, kernel_priv->mask_stride,
+                                         roi_dst, dst_stride, roi->width, roi->height, kernel_priv->mask_value,
+                                         DEFECT_PAINT_VALUE, &kernel_priv->sw_mango_pix, &kernel_priv->sw_defect_pix);
+        else
+            ret = dd_cpu_cca_bits (kernel_priv->cca, src, kernel_priv->mask_stride, roi_dst, dst_stride,
+                                   roi->width, roi->height, kernel_priv->mask_value, DEFECT_PAINT_VALUE,
+                                   &kernel_priv->sw_mango_pix, &kernel_priv->sw_defect_pix);
     } else {
-        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Already allocated prediction");
+        src = (const uint8_t *) inframe->vaddr[0] + (size_t) roi->y * inframe->props.stride + roi->x;
+        if (tiled)
+            ret = dd_cpu_cca_tiled (kernel_priv->cca, kernel_priv->tiler, src, inframe->props.stride,
+                                    roi_dst, dst_stride, roi->width, roi->height, DEFECT_PAINT_VALUE,
+                                    &kernel_priv->sw_mango_pix, &kernel_priv->sw_defect_pix);
+        else
+            ret = dd_cpu_cca (kernel_priv->cca, src, inframe->props.stride, roi_dst, dst_stride,
+                              roi->width, roi->height, DEFECT_PAINT_VALUE,
+                              &kernel_priv->sw_mango_pix, &kernel_priv->sw_defect_pix);
     }
+    if (ret < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Unable to allocate CCA run storage");
+        return -1;
+    }
+    if (dst && !dd_roi_is_full (roi, outframe->props.width, outframe->props.height))
+        dd_cpu_clear_outside (dst, dst_stride, outframe->props.width, outframe->props.height, roi);
+    return 0;
+}
+
+/* The ROI otsu processed and the format of the mask, carried by the meta of the input mask */
+static void
+cca_read_roi (PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe)
+{
+    GstDefectMeta *meta = gst_buffer_get_defect_meta ((GstBuffer *) inframe->app_priv);
+
+    if (meta && (meta->flags & GST_DEFECT_META_HAS_ROI)) {
+        kernel_priv->roi.x = meta->roi_x;
+        kernel_priv->roi.y = meta->roi_y;
+        kernel_priv->roi.width = meta->roi_width;
+        kernel_priv->roi.height = meta->roi_height;
+    } else {
+        memset (&kernel_priv->roi, 0, sizeof (kernel_priv->roi));
+    }
+    dd_roi_clamp (&kernel_priv->roi, inframe->props.width, inframe->props.height);
+    kernel_priv->in_bits = meta && (meta->flags & GST_DEFECT_META_MASK_BITS);
+    if (kernel_priv->in_bits) {
+        kernel_priv->mask_stride = meta->mask_stride;
+        kernel_priv->mask_value = meta->mask_value;
+    }
+}
+
+static void
+cca_fill_blobs (PreProcessingKernelPriv *kernel_priv, GstDefectMeta *meta)
+{
+    const DDBlob *blobs;
+    uint32_t i, n;
+
+    n = dd_cpu_cca_blobs (kernel_priv->cca, kernel_priv->min_blob_area, &blobs);
+    if (n > kernel_priv->max_blobs)
+        n = kernel_priv->max_blobs;
+    for (i = 0; i < n; i++) {
+        GstDefectBlob *b = &meta->blobs[i];
+        /* labelled inside the ROI, published in frame coordinates */
+        b->x = blobs[i].x0 + kernel_priv->roi.x;
+        b->y = blobs[i].y0 + kernel_priv->roi.y;
+        b->width = blobs[i].x1 - blobs[i].x0 + 1;
+        b->height = blobs[i].y1 - blobs[i].y0 + 1;
+        b->area = blobs[i].area;
+        b->cx = blobs[i].cx + kernel_priv->roi.x;
+        b->cy = blobs[i].cy + kernel_priv->roi.y;
+        LOG_MESSAGE (LOG_LEVEL_DEBUG, kernel_priv->log_level, "Defect %u: area %u box %u,%u-%u,%u centroid %.1f,%.1f",
+                     i, blobs[i].area, blobs[i].x0, blobs[i].y0, blobs[i].x1, blobs[i].y1, blobs[i].cx, blobs[i].cy);
+    }
+    meta->num_blobs = n;
+    meta->flags |= GST_DEFECT_META_HAS_BLOBS;
+}
+
+/* Takes debug_level, max_blobs and min_blob_area of a published config */
+static void
+cca_reload (PreProcessingKernelPriv *kernel_priv)
+{
+    json_t *jconfig = dd_config_update (DD_CONFIG_CCA, &kernel_priv->config_gen);
+    int64_t log_level = kernel_priv->log_level;
+    int64_t max_blobs = kernel_priv->max_blobs, min_blob_area = kernel_priv->min_blob_area;
+
+    if (!jconfig)
+        return;
+    if (dd_config_int (jconfig, "debug_level", 0, INT32_MAX, &log_level) < 0 ||
+        dd_config_int (jconfig, "max_blobs", 0, INT32_MAX, &max_blobs) < 0 ||
+        dd_config_int (jconfig, "min_blob_area", 0, UINT32_MAX, &min_blob_area) < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Config update rejected, keeping the running values");
+    } else {
+        kernel_priv->log_level = log_level;
+        kernel_priv->max_blobs = max_blobs < GST_DEFECT_META_MAX_BLOBS ? max_blobs : GST_DEFECT_META_MAX_BLOBS;
+        kernel_priv->min_blob_area = min_blob_area;
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: config updated, max_blobs %u min_blob_area %u",
+                     kernel_priv->max_blobs, kernel_priv->min_blob_area);
+    }
+    json_decref (jconfig);
+}
+
+/*
+ * Issues the command and uses the time the PL is busy to label blobs on the
+ * ARM. Results are published in xlnx_kernel_done.
+ */
+int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT])
+{
+    PreProcessingKernelPriv *kernel_priv;
+    int ret;
+    uint64_t t;
+    GstDefectMeta *meta = NULL;
+    VVASFrame *outframe = output[0];
 
-    GstInferencePrediction *predict;
-    GstInferenceClassification *a = NULL;
-    predict = gst_inference_prediction_new ();
+    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
+    cca_reload (kernel_priv);
+    kernel_priv->inframe = input[0];
+    kernel_priv->outframe = outframe;
+    kernel_priv->pending = FALSE;
+    kernel_priv->labelled = FALSE;
+    kernel_priv->meta = NULL;
+    t = dd_stats_frame_begin (&kernel_priv->stats);
+    cca_read_roi (kernel_priv, input[0]);
 
-    a = gst_inference_classification_new_full (-1, 0.0, "DEFECT DENSITY", 0, NULL, NULL, NULL);
-    predict->reserved_1 = (void *) mango_pixel;
-    predict->reserved_2 = (void *) defect_pixel;
-    gst_inference_prediction_append_classification (predict, a);
+    /*
+     * One command or none, components cannot be merged across accelerator
+     * bands. The accelerator reads byte masks only.
+     */
+    kernel_priv->on_cu = !kernel_priv->in_bits &&
+                         dd_accel_bands (&kernel_priv->roi, input[0]->props.width, input[0]->props.height,
+                                         input[0]->props.stride == input[0]->props.width &&
+                                         outframe->props.stride == outframe->props.width,
+                                         &kernel_priv->area) == 1 &&
+                         dd_cu_pool_acquire (&cca_cu_pool, kernel_priv->backend, kernel_priv->num_cu);
+    if (kernel_priv->on_cu && cca_lease_scratch (kernel_priv) < 0) {
+        dd_cu_pool_release (&cca_cu_pool);
+        kernel_priv->on_cu = FALSE;
+        if (kernel_priv->backend == DD_BACKEND_FPGA) {
+            LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Device memory not available");
+            return FALSE;
+        }
+    }
+    if (kernel_priv->on_cu) {
+        ret = cca_submit_fpga (handle, kernel_priv, input[0], outframe);
+        if (ret < 0) {
+            cca_return_scratch (kernel_priv);
+            dd_cu_pool_release (&cca_cu_pool);
+            kernel_priv->on_cu = FALSE;
+            if (kernel_priv->backend == DD_BACKEND_FPGA)
+                return FALSE;
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Accelerator failed, switching to CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+        } else {
+            kernel_priv->pending = TRUE;
+        }
+        t = kernel_priv->exec_ns = dd_stats_frame_add (&kernel_priv->stats, DD_STATS_SUBMIT, t);
+    }
+    if (!kernel_priv->on_cu) {
+        if (cca_start_cpu (kernel_priv, input[0], outframe) < 0)
+            return FALSE;
+        kernel_priv->labelled = TRUE;
+        t = dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, t);
+    } else if (kernel_priv->max_blobs && cca_start_cpu (kernel_priv, input[0], NULL) == 0) {
+        kernel_priv->labelled = TRUE;
+    }
 
-    gst_inference_prediction_append (infer_meta->prediction, predict);
+    meta = gst_buffer_acquire_defect_meta ((GstBuffer *) outframe->app_priv);
+    if (meta == NULL) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "vvas meta data is not available");
+        if (kernel_priv->pending) {
+            cca_wait_fpga (handle, kernel_priv);
+            cca_return_scratch (kernel_priv);
+            dd_cu_pool_release (&cca_cu_pool);
+        }
+        kernel_priv->pending = FALSE;
+        return FALSE;
+    }
+    meta->num_blobs = 0;
+    /* the output is the painted GRAY8 frame, whatever mask came in */
+    meta->flags &= ~(GST_DEFECT_META_HAS_COUNTS | GST_DEFECT_META_HAS_BLOBS | GST_DEFECT_META_MASK_BITS);
+    if (kernel_priv->labelled && kernel_priv->max_blobs)
+        cca_fill_blobs (kernel_priv, meta);
+    kernel_priv->meta = meta;
+    /* with the accelerator this includes labelling the blobs while it runs */
+    dd_stats_frame_add (&kernel_priv->stats, DD_STATS_META, t);
     return TRUE;
 }
 
 int32_t xlnx_kernel_done(VVASKernel *handle)
 {
-    /* dummy */
+    PreProcessingKernelPriv *kernel_priv;
+    GstDefectMeta *meta;
+    int ret = 0;
+    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
+    meta = kernel_priv->meta;
+
+    if (!meta)
+        return -1;
+    kernel_priv->meta = NULL;
+
+    if (kernel_priv->pending) {
+        kernel_priv->pending = FALSE;
+        ret = cca_wait_fpga (handle, kernel_priv);
+        cca_return_scratch (kernel_priv);
+        dd_cu_pool_release (&cca_cu_pool);
+        if (ret < 0 && kernel_priv->backend != DD_BACKEND_FPGA) {
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Accelerator failed, switching to CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+            kernel_priv->on_cu = FALSE;
+            ret = cca_start_cpu (kernel_priv, kernel_priv->inframe, kernel_priv->outframe);
+        }
+        dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, kernel_priv->exec_ns);
+    }
+    if (ret < 0)
+        return -1;
+
+    if (kernel_priv->on_cu && kernel_priv->outframe->vaddr[0] &&
+        !dd_roi_is_full (&kernel_priv->roi, kernel_priv->outframe->props.width, kernel_priv->outframe->props.height))
+        dd_cpu_clear_outside ((uint8_t *) kernel_priv->outframe->vaddr[0], kernel_priv->outframe->props.stride,
+                              kernel_priv->outframe->props.width, kernel_priv->outframe->props.height,
+                              &kernel_priv->roi);
+
+    if (!kernel_priv->on_cu) {
+        meta->mango_pix = kernel_priv->sw_mango_pix;
+        meta->defect_pix = kernel_priv->sw_defect_pix;
+    } else {
+        meta->mango_pix = *(uint32_t *) kernel_priv->mango_pix->vaddr[0];
+        meta->defect_pix = *(uint32_t *) kernel_priv->defect_pix->vaddr[0];
+    }
+    meta->flags |= GST_DEFECT_META_HAS_COUNTS;
+    meta->stage_ns[GST_DEFECT_STAGE_CCA] = dd_stats_clock_ns () - kernel_priv->stats.start_ns;
+    dd_stats_frame_commit (&kernel_priv->stats, DD_STATS_CCA);
     return 0;
 }
@@ -0,0 +1,328 @@
+/*
+ * Copyright 2021-2022 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software-only replacement for the otsu -> preprocess -> cca chain. The
+ * three stages run in one banded pass over the raw frame (see
+ * dd_cpu_fused_frame) and the output buffer receives the labelled mask, so
+ * a single vvas_xfilter with a single buffer pool does the work of three.
+ * The defect meta carries what the separate plugins would have filled in,
+ * text2overlay needs no change.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <vvas/vvaslogs.h>
+#include <vvas/vvas_kernel.h>
+#include "gstdefectmeta.h"
+#include "dd_cpu_kernels.h"
+#include "dd_stats.h"
+#include "dd_config.h"
+
+#define DEFAULT_MAX_VALUE           255
+#define NORMALIZE_THRESHOLD         13
+#define DEFECT_PAINT_VALUE          128
+#define DEFAULT_BAND_ROWS           32
+#define DEFAULT_MAX_BLOBS           0
+#define DEFAULT_MIN_BLOB_AREA       1
+#define DEFAULT_ROI_FRAMES          30
+#define DEFAULT_ROI_MARGIN          16
+
+typedef struct _kern_priv
+{
+    int log_level;
+    uint32_t max_value;
+    uint32_t band_rows;
+    gboolean exact;
+    uint32_t max_blobs;
+    uint32_t min_blob_area;
+    /* Otsu split of the previous frame, used by the lagged mode */
+    gboolean have_prev;
+    uint32_t prev_otsu;
+    DDRoiConfig roi_cfg;
+    DDCcaCtx *cca;
+    void *scratch;
+    uint32_t scratch_size;
+    /* last config update taken from dd_config */
+    uint64_t config_gen;
+} FusedKernelPriv;
+
+int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT]);
+int32_t xlnx_kernel_done(VVASKernel *handle);
+int32_t xlnx_kernel_init(VVASKernel *handle);
+uint32_t xlnx_kernel_deinit(VVASKernel *handle);
+
+uint32_t xlnx_kernel_deinit(VVASKernel *handle)
+{
+    FusedKernelPriv *kernel_priv;
+    kernel_priv = (FusedKernelPriv *)handle->kernel_priv;
+    dd_cpu_cca_free (kernel_priv->cca);
+    dd_roi_detect_clear (&kernel_priv->roi_cfg.det);
+    free (kernel_priv->scratch);
+    free (kernel_priv);
+    return 0;
+}
+
+int32_t xlnx_kernel_init(VVASKernel *handle)
+{
+    json_t *jconfig = handle->kernel_config;
+    json_t *val; /* kernel config from app */
+    FusedKernelPriv *kernel_priv;
+
+    kernel_priv = (FusedKernelPriv *)calloc(1, sizeof(FusedKernelPriv));
+    if (!kernel_priv) {
+        printf("Error: Unable to allocate fused kernel memory\n");
+        return -1;
+    }
+
+    /* parse config */
+    val = json_object_get (jconfig, "debug_level");
+    if (!val || !json_is_integer (val))
+	    kernel_priv->log_level = LOG_LEVEL_WARNING;
+    else
+	    kernel_priv->log_level = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: debug_level %d, cpu simd %s",
+                 kernel_priv->log_level, dd_cpu_simd_name ());
+
+    val = json_object_get (jconfig, "max_value");
+    if (!val || !json_is_integer (val))
+	    kernel_priv->max_value = DEFAULT_MAX_VALUE;
+    else
+	    kernel_priv->max_value = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: max_value %u", kernel_priv->max_value);
+
+    val = json_object_get (jconfig, "band_rows");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->band_rows = DEFAULT_BAND_ROWS;
+    else
+	    kernel_priv->band_rows = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: band_rows %u", kernel_priv->band_rows);
+
+    val = json_object_get (jconfig, "threshold_mode");
+    if (val && json_is_string (val) && !strcmp (json_string_value (val), "exact"))
+	    kernel_priv->exact = TRUE;
+    else
+	    kernel_priv->exact = FALSE;
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: threshold_mode %s",
+                 kernel_priv->exact ? "exact" : "lagged");
+
+    val = json_object_get (jconfig, "max_blobs");
+    if (!val || !json_is_integer (val))
+	    kernel_priv->max_blobs = DEFAULT_MAX_BLOBS;
+    else
+	    kernel_priv->max_blobs = json_integer_value (val);
+    if (kernel_priv->max_blobs > GST_DEFECT_META_MAX_BLOBS)
+        kernel_priv->max_blobs = GST_DEFECT_META_MAX_BLOBS;
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: max_blobs %u", kernel_priv->max_blobs);
+
+    val = json_object_get (jconfig, "min_blob_area");
+    if (!val || !json_is_integer (val))
+	    kernel_priv->min_blob_area = DEFAULT_MIN_BLOB_AREA;
+    else
+	    kernel_priv->min_blob_area = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: min_blob_area %u", kernel_priv->min_blob_area);
+
+    val = json_object_get (jconfig, "roi");
+    if (val && json_is_string (val) && !strcmp (json_string_value (val), "auto")) {
+	    kernel_priv->roi_cfg.auto_detect = 1;
+    } else if (val && json_is_array (val) && json_array_size (val) == 4) {
+	    kernel_priv->roi_cfg.roi.x = json_integer_value (json_array_get (val, 0));
+	    kernel_priv->roi_cfg.roi.y = json_integer_value (json_array_get (val, 1));
+	    kernel_priv->roi_cfg.roi.width = json_integer_value (json_array_get (val, 2));
+	    kernel_priv->roi_cfg.roi.height = json_integer_value (json_array_get (val, 3));
+    } else if (val) {
+	    LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "VVAS FUSED: roi must be [x, y, width, height] or \"auto\"");
+    }
+
+    val = json_object_get (jconfig, "roi_frames");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->roi_cfg.learn_frames = DEFAULT_ROI_FRAMES;
+    else
+	    kernel_priv->roi_cfg.learn_frames = json_integer_value (val);
+
+    val = json_object_get (jconfig, "roi_margin");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->roi_cfg.margin = DEFAULT_ROI_MARGIN;
+    else
+	    kernel_priv->roi_cfg.margin = json_integer_value (val);
+    if (kernel_priv->roi_cfg.auto_detect)
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: roi auto, learnt from %u frames, margin %u",
+                     kernel_priv->roi_cfg.learn_frames, kernel_priv->roi_cfg.margin);
+    else
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: roi [%u, %u, %u, %u]",
+                     kernel_priv->roi_cfg.roi.x, kernel_priv->roi_cfg.roi.y,
+                     kernel_priv->roi_cfg.roi.width, kernel_priv->roi_cfg.roi.height);
+
+    kernel_priv->cca = dd_cpu_cca_new ();
+    if (!kernel_priv->cca) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Unable to allocate CCA context");
+        free (kernel_priv);
+        return -1;
+    }
+
+    handle->kernel_priv = (void *)kernel_priv;
+    return 0;
+}
+
+static void
+fused_fill_blobs (FusedKernelPriv *kernel_priv, GstDefectMeta *meta, const DDRoi *roi)
+{
+    const DDBlob *blobs;
+    uint32_t i, n;
+
+    n = dd_cpu_cca_blobs (kernel_priv->cca, kernel_priv->min_blob_area, &blobs);
+    if (n > kernel_priv->max_blobs)
+        n = kernel_priv->max_blobs;
+    for (i = 0; i < n; i++) {
+        GstDefectBlob *b = &meta->blobs[i];
+        b->x = blobs[i].x0 + roi->x;
+        b->y = blobs[i].y0 + roi->y;
+        b->width = blobs[i].x1 - blobs[i].x0 + 1;
+        b->height = blobs[i].y1 - blobs[i].y0 + 1;
+        b->area = blobs[i].area;
+        b->cx = blobs[i].cx + roi->x;
+        b->cy = blobs[i].cy + roi->y;
+    }
+    meta->num_blobs = n;
+    meta->flags |= GST_DEFECT_META_HAS_BLOBS;
+}
+
+/* Takes debug_level, max_value, threshold_mode, max_blobs and min_blob_area of a published config */
+static void
+fused_reload (FusedKernelPriv *kernel_priv)
+{
+    json_t *jconfig = dd_config_update (DD_CONFIG_FUSED, &kernel_priv->config_gen);
+    int64_t log_level = kernel_priv->log_level, max_value = kernel_priv->max_value;
+    int64_t max_blobs = kernel_priv->max_blobs, min_blob_area = kernel_priv->min_blob_area;
+    const char *mode;
+    json_t *val;
+
+    if (!jconfig)
+        return;
+    val = json_object_get (jconfig, "threshold_mode");
+    mode = val && json_is_string (val) ? json_string_value (val) : NULL;
+    if ((val && (!mode || (strcmp (mode, "exact") && strcmp (mode, "lagged")))) ||
+        dd_config_int (jconfig, "debug_level", 0, INT32_MAX, &log_level) < 0 ||
+        dd_config_int (jconfig, "max_value", 1, 255, &max_value) < 0 ||
+        dd_config_int (jconfig, "max_blobs", 0, INT32_MAX, &max_blobs) < 0 ||
+        dd_config_int (jconfig, "min_blob_area", 0, UINT32_MAX, &min_blob_area) < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Config update rejected, keeping the running values");
+    } else {
+        kernel_priv->log_level = log_level;
+        kernel_priv->max_value = max_value;
+        if (mode)
+            kernel_priv->exact = !strcmp (mode, "exact");
+        kernel_priv->max_blobs = max_blobs < GST_DEFECT_META_MAX_BLOBS ? max_blobs : GST_DEFECT_META_MAX_BLOBS;
+        kernel_priv->min_blob_area = min_blob_area;
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level,
+                     "VVAS FUSED: config updated, max_value %u threshold_mode %s max_blobs %u min_blob_area %u",
+                     kernel_priv->max_value, kernel_priv->exact ? "exact" : "lagged",
+                     kernel_priv->max_blobs, kernel_priv->min_blob_area);
+    }
+    json_decref (jconfig);
+}
+
+int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT])
+{
+    FusedKernelPriv *kernel_priv;
+    VVASFrame *inframe = input[0];
+    VVASFrame *outframe = output[0];
+    GstDefectMeta *meta;
+    DDFusedParams params;
+    DDFusedResult res;
+    DDRoi roi;
+    uint32_t need;
+    DDStatsFrame stats;
+    uint64_t t = dd_stats_frame_begin (&stats);
+
+    kernel_priv = (FusedKernelPriv *)handle->kernel_priv;
+    fused_reload (kernel_priv);
+
+    if (!inframe->vaddr[0] || !outframe->vaddr[0]) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Frames are not mapped for CPU access");
+        return FALSE;
+    }
+
+    roi = dd_roi_config_get (&kernel_priv->roi_cfg, inframe->props.width, inframe->props.height);
+    need = dd_cpu_fused_scratch_size (roi.width, kernel_priv->band_rows);
+    if (need > kernel_priv->scratch_size) {
+        void *scratch = realloc (kernel_priv->scratch, need);
+        if (!scratch) {
+            LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Unable to allocate fused scratch memory");
+            return FALSE;
+        }
+        kernel_priv->scratch = scratch;
+        kernel_priv->scratch_size = need;
+    }
+
+    params.band_rows = kernel_priv->band_rows;
+    params.thr_offset = NORMALIZE_THRESHOLD;
+    params.max_value = kernel_priv->max_value;
+    params.defect_value = DEFECT_PAINT_VALUE;
+    /* the first frame has no previous split to lean on */
+    params.lagged = !kernel_priv->exact && kernel_priv->have_prev;
+    params.prev_otsu = kernel_priv->prev_otsu;
+
+    if (dd_cpu_fused_frame (kernel_priv->cca, &params,
+                            (const uint8_t *) inframe->vaddr[0] + (size_t) roi.y * inframe->props.stride + roi.x,
+                            inframe->props.stride,
+                            (uint8_t *) outframe->vaddr[0] + (size_t) roi.y * outframe->props.stride + roi.x,
+                            outframe->props.stride, roi.width, roi.height,
+                            kernel_priv->scratch, &res) < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Unable to allocate CCA run storage");
+        return FALSE;
+    }
+    if (!dd_roi_is_full (&roi, outframe->props.width, outframe->props.height))
+        dd_cpu_clear_outside ((uint8_t *) outframe->vaddr[0], outframe->props.stride,
+                              outframe->props.width, outframe->props.height, &roi);
+    /* frames are processed whole while the ROI is being learnt */
+    if (dd_roi_config_learn (&kernel_priv->roi_cfg, (const uint8_t *) inframe->vaddr[0], inframe->props.stride,
+                             inframe->props.width, inframe->props.height, res.otsu_thr) > 0)
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS FUSED: learnt roi [%u, %u, %u, %u]",
+                     kernel_priv->roi_cfg.roi.x, kernel_priv->roi_cfg.roi.y,
+                     kernel_priv->roi_cfg.roi.width, kernel_priv->roi_cfg.roi.height);
+    t = dd_stats_frame_add (&stats, DD_STATS_EXEC, t);
+    kernel_priv->prev_otsu = res.otsu_thr;
+    kernel_priv->have_prev = TRUE;
+    LOG_MESSAGE (LOG_LEVEL_DEBUG, kernel_priv->log_level, "otsu %u threshold %d mango %u defect %u",
+                 res.otsu_thr, res.threshold, res.mango_pix, res.defect_pix);
+
+    meta = gst_buffer_acquire_defect_meta ((GstBuffer *) outframe->app_priv);
+    if (meta == NULL) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "vvas meta data is not available");
+        return FALSE;
+    }
+    gst_defect_meta_reset (meta);
+    meta->otsu_thr = res.otsu_thr;
+    meta->mango_pix = res.mango_pix;
+    meta->defect_pix = res.defect_pix;
+    meta->roi_x = roi.x;
+    meta->roi_y = roi.y;
+    meta->roi_width = roi.width;
+    meta->roi_height = roi.height;
+    meta->flags = GST_DEFECT_META_HAS_THRESHOLD | GST_DEFECT_META_HAS_COUNTS | GST_DEFECT_META_HAS_ROI;
+    if (kernel_priv->max_blobs)
+        fused_fill_blobs (kernel_priv, meta, &roi);
+    meta->stage_ns[GST_DEFECT_STAGE_FUSED] = dd_stats_clock_ns () - stats.start_ns;
+    dd_stats_frame_add (&stats, DD_STATS_META, t);
+    dd_stats_frame_commit (&stats, DD_STATS_FUSED);
+    return TRUE;
+}
+
+int32_t xlnx_kernel_done(VVASKernel *handle)
+{
+    return 0;
+}
@@ -14,14 +14,68 @@
  * limitations under the License.
  */
 
+#include <string.h>
+#include <float.h>
 #include <vvas/vvaslogs.h>
 #include <vvas/vvas_kernel.h>
-#include <gst/vvas/gstinferencemeta.h>
+#include "gstdefectmeta.h"
+#include "dd_cpu_kernels.h"
+#include "dd_stats.h"
+#include "dd_buffers.h"
+#include "dd_config.h"
 
+#define KERNEL_DONE_TIMEOUT_MS      1000
+#define DEFAULT_NUM_CU              1
+#define DEFAULT_ROI_FRAMES          30
+#define DEFAULT_ROI_MARGIN          16
+#define DEFAULT_TILE_THREADS        0
+#define DEFAULT_TILE_ROWS           0
+#define DEFAULT_OTSU_ALPHA          0.1
+#define DEFAULT_OTSU_TOLERANCE      0.02
+#define DEFAULT_HIST_STEP           1
+
+/*
+ * The threshold is copied out of the device buffer into the frame's defect
+ * meta when the command completes, so a single result buffer serves any
+ * number of frames queued between the elements.
+ */
 typedef struct _kern_priv
 {
     int log_level;
+    DDBackend backend;
+    int num_cu;
+    uint16_t mem_bank;
+    /* from the buffer pool, the element is attached to it when set */
     VVASFrame *mem;
+    uint32_t sw_thr;
+    uint8_t *scratch;
+    uint32_t scratch_size;
+    /* command in flight between xlnx_kernel_start and xlnx_kernel_done */
+    gboolean pending;
+    /* the frame went to the accelerator and holds a CU of otsu_cu_pool */
+    gboolean on_cu;
+    VVASFrame *inframe;
+    VVASFrame *outframe;
+    GstDefectMeta *meta;
+    DDRoiConfig roi_cfg;
+    /* rectangle of the frame in flight */
+    DDRoi roi;
+    /* accelerator bands of the frame in flight, see dd_accel_bands() */
+    DDRoi area;
+    uint32_t n_bands;
+    /* frames larger than the accelerator are cut into strips on the CPU, started on the first */
+    DDTiler *tiler;
+    uint32_t tile_threads;
+    uint32_t tile_rows;
+    /* "temporal" otsu_mode, the split follows a running histogram */
+    gboolean temporal;
+    DDOtsuTemporal otsu_state;
+    uint32_t hist_step;
+    /* last config update taken from dd_config */
+    uint64_t config_gen;
+    DDStatsFrame stats;
+    /* end of the submit, the accelerator runs from here to the wait */
+    uint64_t exec_ns;
 } PreProcessingKernelPriv;
 
 int32_t  xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT]);
@@ -29,12 +83,23 @@ int32_t  xlnx_kernel_done(VVASKernel *handle);
 int32_t  xlnx_kernel_init(VVASKernel *handle);
 uint32_t xlnx_kernel_deinit(VVASKernel *handle);
 
+/* shared by the otsu elements of all streams */
+static DDCuPool otsu_cu_pool = DD_CU_POOL_INIT;
+/* one per stream, their tilers share the CPUs */
+static uint32_t otsu_elements;
+
 uint32_t xlnx_kernel_deinit(VVASKernel *handle)
 {
     PreProcessingKernelPriv *kernel_priv;
     kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
-    if (kernel_priv->mem)
-        vvas_free_buffer (handle, kernel_priv->mem);
+    if (kernel_priv->mem) {
+        dd_buffer_put (kernel_priv->mem);
+        dd_buffers_detach ();
+    }
+    dd_roi_detect_clear (&kernel_priv->roi_cfg.det);
+    dd_tiler_free (kernel_priv->tiler);
+    __atomic_sub_fetch (&otsu_elements, 1, __ATOMIC_RELAXED);
+    free(kernel_priv->scratch);
     free(kernel_priv);
     return 0;
 }
@@ -49,8 +114,6 @@ int32_t xlnx_kernel_init(VVASKernel *handle)
     if (!kernel_priv) {
         printf("Error: Unable to allocate PPE kernel memory\n");
     }
-    kernel_priv->mem = vvas_alloc_buffer (handle, 1*(sizeof(uint32_t)), VVAS_INTERNAL_MEMORY, DEFAULT_MEM_BANK, NULL);
-
 
     /* parse config */
     val = json_object_get (jconfig, "debug_level");
@@ -60,63 +123,458 @@ int32_t xlnx_kernel_init(VVASKernel *handle)
 	    kernel_priv->log_level = json_integer_value (val);
     LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: debug_level %d", kernel_priv->log_level);
 
+    val = json_object_get (jconfig, "backend");
+    if (!val || !json_is_string (val) || dd_backend_from_string (json_string_value (val)) < 0)
+	    kernel_priv->backend = DD_BACKEND_FPGA;
+    else
+	    kernel_priv->backend = dd_backend_from_string (json_string_value (val));
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: backend %s, cpu simd %s",
+                 dd_backend_to_string (kernel_priv->backend), dd_cpu_simd_name ());
+
+    val = json_object_get (jconfig, "num_cu");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->num_cu = DEFAULT_NUM_CU;
+    else
+	    kernel_priv->num_cu = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: num_cu %d", kernel_priv->num_cu);
+
+    val = json_object_get (jconfig, "mem_bank");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->mem_bank = DEFAULT_MEM_BANK;
+    else
+	    kernel_priv->mem_bank = json_integer_value (val);
+
+    val = json_object_get (jconfig, "roi");
+    if (val && json_is_string (val) && !strcmp (json_string_value (val), "auto")) {
+	    kernel_priv->roi_cfg.auto_detect = 1;
+    } else if (val && json_is_array (val) && json_array_size (val) == 4) {
+	    kernel_priv->roi_cfg.roi.x = json_integer_value (json_array_get (val, 0));
+	    kernel_priv->roi_cfg.roi.y = json_integer_value (json_array_get (val, 1));
+	    kernel_priv->roi_cfg.roi.width = json_integer_value (json_array_get (val, 2));
+	    kernel_priv->roi_cfg.roi.height = json_integer_value (json_array_get (val, 3));
+    } else if (val) {
+	    LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "VVAS PPE: roi must be [x, y, width, height] or \"auto\"");
+    }
+
+    val = json_object_get (jconfig, "roi_frames");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->roi_cfg.learn_frames = DEFAULT_ROI_FRAMES;
+    else
+	    kernel_priv->roi_cfg.learn_frames = json_integer_value (val);
+
+    val = json_object_get (jconfig, "roi_margin");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->roi_cfg.margin = DEFAULT_ROI_MARGIN;
+    else
+	    kernel_priv->roi_cfg.margin = json_integer_value (val);
+    if (kernel_priv->roi_cfg.auto_detect)
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: roi auto, learnt from %u frames, margin %u",
+                     kernel_priv->roi_cfg.learn_frames, kernel_priv->roi_cfg.margin);
+    else
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: roi [%u, %u, %u, %u]",
+                     kernel_priv->roi_cfg.roi.x, kernel_priv->roi_cfg.roi.y,
+                     kernel_priv->roi_cfg.roi.width, kernel_priv->roi_cfg.roi.height);
+
+    val = json_object_get (jconfig, "tile_threads");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->tile_threads = DEFAULT_TILE_THREADS;
+    else
+	    kernel_priv->tile_threads = json_integer_value (val);
+
+    val = json_object_get (jconfig, "tile_rows");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->tile_rows = DEFAULT_TILE_ROWS;
+    else
+	    kernel_priv->tile_rows = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: tile_threads %u", kernel_priv->tile_threads);
+
+    val = json_object_get (jconfig, "otsu_mode");
+    if (val && json_is_string (val) && !strcmp (json_string_value (val), "temporal"))
+	    kernel_priv->temporal = TRUE;
+    else
+	    kernel_priv->temporal = FALSE;
+    {
+        double alpha = DEFAULT_OTSU_ALPHA, tolerance = DEFAULT_OTSU_TOLERANCE;
+        val = json_object_get (jconfig, "otsu_alpha");
+        if (val && json_is_number (val) && json_number_value (val) > 0.0 && json_number_value (val) <= 1.0)
+	        alpha = json_number_value (val);
+        val = json_object_get (jconfig, "otsu_tolerance");
+        if (val && json_is_number (val) && json_number_value (val) >= 0.0)
+	        tolerance = json_number_value (val);
+        dd_otsu_temporal_init (&kernel_priv->otsu_state, alpha, tolerance);
+        if (kernel_priv->temporal)
+            LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: otsu_mode temporal, alpha %.3f tolerance %.3f",
+                         alpha, tolerance);
+    }
+
+    val = json_object_get (jconfig, "hist_step");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->hist_step = DEFAULT_HIST_STEP;
+    else
+	    kernel_priv->hist_step = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: hist_step %u", kernel_priv->hist_step);
+
+    if (kernel_priv->backend != DD_BACKEND_CPU) {
+        if (dd_buffers_attach () == 0) {
+            kernel_priv->mem = dd_buffer_get (1*(sizeof(uint32_t)), kernel_priv->mem_bank);
+            if (!kernel_priv->mem)
+                dd_buffers_detach ();
+        }
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: mem_bank %u", kernel_priv->mem_bank);
+        if (!kernel_priv->mem && kernel_priv->backend != DD_BACKEND_FPGA) {
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Device memory not available, using CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+        }
+    }
+
+    __atomic_add_fetch (&otsu_elements, 1, __ATOMIC_RELAXED);
     handle->kernel_priv = (void *)kernel_priv;
     handle->is_multiprocess = 1;
     return 0;
 }
 
-int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT])
+/*
+ * The accelerator reads packed rows, so it is given the band of rows of the
+ * ROI; the columns around it are cleared in xlnx_kernel_done.
+ */
+static int32_t
+otsu_submit_fpga (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe, VVASFrame *outframe,
+                  uint32_t index)
 {
-    PreProcessingKernelPriv *kernel_priv;
     int ret;
-    uint32_t *thr;
     float sigma = 0.0;
-    GstInferenceMeta *infer_meta = NULL;
-    VVASFrame *outframe = output[0];
-    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
-    ret = vvas_kernel_start (handle, "ppuufp", input[0]->paddr[0], \
-                             output[0]->paddr[0], input[0]->props.height, input[0]->props.width, sigma, kernel_priv->mem->paddr[0]);
+    DDRoi band = dd_accel_band_at (&kernel_priv->area, index);
+
+    ret = vvas_kernel_start (handle, "ppuufp", inframe->paddr[0] + (uint64_t) band.y * inframe->props.stride, \
+                             outframe->paddr[0] + (uint64_t) band.y * outframe->props.stride,
+                             band.height, band.width, sigma,
+                             kernel_priv->mem->paddr[0]);
     if (ret < 0) {
         LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to issue execute command");
-        return FALSE;
+        return -1;
     }
+    return 0;
+}
 
+static int32_t
+otsu_wait_fpga (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv)
+{
+    int ret;
     /* wait for kernel completion */
-    ret = vvas_kernel_done (handle, 1000);
+    ret = vvas_kernel_done (handle, KERNEL_DONE_TIMEOUT_MS);
     if (ret < 0) {
         LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to receive response from kernel");
-        return FALSE;
+        dd_stats_timeout (DD_STATS_OTSU);
+        return -1;
     }
-    thr =  kernel_priv->mem->vaddr[0]; 
-    infer_meta = (GstInferenceMeta *) gst_buffer_add_meta ((GstBuffer *)outframe->app_priv,
-                                                     gst_inference_meta_get_info (), NULL);
-    if (infer_meta == NULL) {
-        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Meta data is not available");
-        return FALSE;
+    return 0;
+}
+
+static int32_t
+otsu_reserve_scratch (PreProcessingKernelPriv *kernel_priv, uint32_t width)
+{
+    uint32_t size = dd_cpu_blur_scratch_size (width);
+
+    if (size > kernel_priv->scratch_size) {
+        free (kernel_priv->scratch);
+        kernel_priv->scratch = (uint8_t *) malloc (size);
+        kernel_priv->scratch_size = kernel_priv->scratch ? size : 0;
+        if (!kernel_priv->scratch) {
+            LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Unable to allocate CPU scratch memory");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (NULL == infer_meta->prediction) {
-        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Allocating prediction");
-        infer_meta->prediction = gst_inference_prediction_new ();
+/* Strips in parallel, see dd_tiler_for() */
+static gboolean
+otsu_tiled (PreProcessingKernelPriv *kernel_priv, const DDRoi *roi)
+{
+    return dd_tiler_for (&kernel_priv->tiler, kernel_priv->tile_threads, kernel_priv->tile_rows,
+                         __atomic_load_n (&otsu_elements, __ATOMIC_RELAXED), roi->width, roi->height) != NULL;
+}
+
+/* Otsu split of a frame histogram, or of the running one in temporal mode */
+static uint32_t
+otsu_split (PreProcessingKernelPriv *kernel_priv, const uint32_t hist[DD_HIST_BINS])
+{
+    uint32_t thr;
+    int recomputed;
+
+    if (!kernel_priv->temporal)
+        return dd_cpu_otsu_threshold (hist);
+    thr = dd_otsu_temporal_update (&kernel_priv->otsu_state, hist, &recomputed);
+    if (recomputed)
+        LOG_MESSAGE (LOG_LEVEL_DEBUG, kernel_priv->log_level, "Otsu split recomputed: %u", thr);
+    return thr;
+}
+
+/* Histogram of the blurred ROI already in @outframe, sampled every hist_step pixels */
+static void
+otsu_output_hist (PreProcessingKernelPriv *kernel_priv, VVASFrame *outframe, uint32_t hist[DD_HIST_BINS])
+{
+    const DDRoi *roi = &kernel_priv->roi;
+    const uint8_t *src = (const uint8_t *) outframe->vaddr[0] + (size_t) roi->y * outframe->props.stride + roi->x;
+
+    if (kernel_priv->hist_step > 1)
+        dd_cpu_histogram_step (src, outframe->props.stride, roi->width, roi->height, kernel_priv->hist_step, hist);
+    else if (!kernel_priv->tiler ||
+             dd_tiler_histogram (kernel_priv->tiler, src, outframe->props.stride, roi->width, roi->height, hist) < 0)
+        dd_cpu_histogram (src, outframe->props.stride, roi->width, roi->height, hist);
+}
+
+/* Same contract as gaussian_otsu_accel: blurred frame to output, threshold to sw_thr */
+static int32_t
+otsu_start_cpu (PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe, VVASFrame *outframe)
+{
+    uint32_t hist[DD_HIST_BINS];
+    uint32_t *full_hist;
+    const DDRoi *roi = &kernel_priv->roi;
+    const uint8_t *src;
+    uint8_t *dst;
+
+    if (!inframe->vaddr[0] || !outframe->vaddr[0]) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Frames are not mapped for CPU access");
+        return -1;
+    }
+
+    /*
+     * Histogram and blur of the ROI only, the rest of the output is
+     * background. A sampled histogram is taken after the blur instead of
+     * during it.
+     */
+    src = (const uint8_t *) inframe->vaddr[0] + (size_t) roi->y * inframe->props.stride + roi->x;
+    dst = (uint8_t *) outframe->vaddr[0] + (size_t) roi->y * outframe->props.stride + roi->x;
+    full_hist = kernel_priv->hist_step <= 1 ? hist : NULL;
+    if (otsu_tiled (kernel_priv, roi)) {
+        if (dd_tiler_gaussian_hist (kernel_priv->tiler, src, inframe->props.stride, dst, outframe->props.stride,
+                                    roi->width, roi->height, full_hist) < 0) {
+            LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Unable to allocate CPU scratch memory");
+            return -1;
+        }
+    } else {
+        if (otsu_reserve_scratch (kernel_priv, roi->width) < 0)
+            return -1;
+        dd_cpu_gaussian_hist_rows (src, inframe->props.stride, dst, outframe->props.stride,
+                                   roi->width, roi->height, 0, roi->height, kernel_priv->scratch, full_hist);
+    }
+    if (!full_hist)
+        otsu_output_hist (kernel_priv, outframe, hist);
+    kernel_priv->sw_thr = otsu_split (kernel_priv, hist);
+    if (!dd_roi_is_full (roi, outframe->props.width, outframe->props.height))
+        dd_cpu_clear_outside ((uint8_t *) outframe->vaddr[0], outframe->props.stride,
+                              outframe->props.width, outframe->props.height, roi);
+    return 0;
+}
+
+/*
+ * A frame taller than the accelerator: the remaining bands are blurred one
+ * command at a time, the rows on either side of each seam are blurred again
+ * on the CPU with their real neighbours, and the threshold is taken from the
+ * histogram of the ROI since the accelerator only returns that of a band.
+ */
+static int32_t
+otsu_finish_bands (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv)
+{
+    VVASFrame *inframe = kernel_priv->inframe, *outframe = kernel_priv->outframe;
+    const DDRoi *area = &kernel_priv->area;
+    const uint8_t *src = (const uint8_t *) inframe->vaddr[0] + (size_t) area->y * inframe->props.stride;
+    uint8_t *dst = (uint8_t *) outframe->vaddr[0] + (size_t) area->y * outframe->props.stride;
+    uint32_t hist[DD_HIST_BINS];
+    uint32_t i;
+
+    for (i = 1; i < kernel_priv->n_bands; i++) {
+        if (otsu_submit_fpga (handle, kernel_priv, inframe, outframe, i) < 0 ||
+            otsu_wait_fpga (handle, kernel_priv) < 0)
+            return -1;
+    }
+    if (!src || !dst || otsu_reserve_scratch (kernel_priv, area->width) < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Frames are not mapped for CPU access");
+        return -1;
+    }
+    for (i = 1; i < kernel_priv->n_bands; i++) {
+        uint32_t seam = i * DD_ACCEL_MAX_HEIGHT;
+        dd_cpu_gaussian_hist_rows (src, inframe->props.stride, dst, outframe->props.stride,
+                                   area->width, area->height, seam - 1, seam + 1, kernel_priv->scratch, NULL);
+    }
+
+    otsu_output_hist (kernel_priv, outframe, hist);
+    kernel_priv->sw_thr = otsu_split (kernel_priv, hist);
+    return 0;
+}
+
+/* Takes debug_level, hist_step, otsu_alpha and otsu_tolerance of a published config */
+static void
+otsu_reload (PreProcessingKernelPriv *kernel_priv)
+{
+    json_t *jconfig = dd_config_update (DD_CONFIG_OTSU, &kernel_priv->config_gen);
+    int64_t log_level = kernel_priv->log_level, hist_step = kernel_priv->hist_step;
+    double alpha = kernel_priv->otsu_state.alpha, tolerance = kernel_priv->otsu_state.tolerance;
+
+    if (!jconfig)
+        return;
+    if (dd_config_int (jconfig, "debug_level", 0, INT32_MAX, &log_level) < 0 ||
+        dd_config_int (jconfig, "hist_step", 1, INT32_MAX, &hist_step) < 0 ||
+        dd_config_number (jconfig, "otsu_alpha", 0.0, 1.0, &alpha) < 0 || alpha <= 0.0 ||
+        dd_config_number (jconfig, "otsu_tolerance", 0.0, DBL_MAX, &tolerance) < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Config update rejected, keeping the running values");
     } else {
-        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Already allocated prediction");
+        kernel_priv->log_level = log_level;
+        kernel_priv->hist_step = hist_step;
+        /* the running histogram is kept, only how it moves changes */
+        kernel_priv->otsu_state.alpha = alpha;
+        kernel_priv->otsu_state.tolerance = tolerance;
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: config updated, hist_step %u otsu_alpha %.3f otsu_tolerance %.3f",
+                     kernel_priv->hist_step, alpha, tolerance);
     }
+    json_decref (jconfig);
+}
+
+/*
+ * Issues the command and, while the PL is busy, prepares the metadata the
+ * result will be published in. Completion is collected in xlnx_kernel_done.
+ */
+int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT])
+{
+    PreProcessingKernelPriv *kernel_priv;
+    int ret;
+    uint64_t t;
+    GstDefectMeta *meta = NULL;
+    VVASFrame *outframe = output[0];
+    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
 
-    GstInferencePrediction *predict;
-    GstInferenceClassification *a = NULL;
-    predict = gst_inference_prediction_new ();
+    otsu_reload (kernel_priv);
+    kernel_priv->inframe = input[0];
+    kernel_priv->outframe = outframe;
+    kernel_priv->pending = FALSE;
+    kernel_priv->meta = NULL;
+    kernel_priv->roi = dd_roi_config_get (&kernel_priv->roi_cfg, input[0]->props.width, input[0]->props.height);
+    kernel_priv->n_bands = dd_accel_bands (&kernel_priv->roi, input[0]->props.width, input[0]->props.height,
+                                           input[0]->props.stride == input[0]->props.width &&
+                                           outframe->props.stride == outframe->props.width, &kernel_priv->area);
+    t = dd_stats_frame_begin (&kernel_priv->stats);
 
-    a = gst_inference_classification_new_full (-1, 0.0, "OTSU THRSHOLD", 0, NULL, NULL, NULL);
-    predict->reserved_1 = (void *)thr;
-    gst_inference_prediction_append_classification (predict, a);
+    /* too wide for the accelerator, the CPU strips it */
+    kernel_priv->on_cu = kernel_priv->n_bands &&
+                         dd_cu_pool_acquire (&otsu_cu_pool, kernel_priv->backend, kernel_priv->num_cu);
+    if (kernel_priv->on_cu) {
+        ret = otsu_submit_fpga (handle, kernel_priv, input[0], outframe, 0);
+        if (ret < 0) {
+            dd_cu_pool_release (&otsu_cu_pool);
+            kernel_priv->on_cu = FALSE;
+            if (kernel_priv->backend == DD_BACKEND_FPGA)
+                return FALSE;
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Accelerator failed, switching to CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+        } else {
+            kernel_priv->pending = TRUE;
+        }
+        t = kernel_priv->exec_ns = dd_stats_frame_add (&kernel_priv->stats, DD_STATS_SUBMIT, t);
+    }
+
+    t = dd_stats_clock_ns ();
+    meta = gst_buffer_acquire_defect_meta ((GstBuffer *)outframe->app_priv);
+    if (meta == NULL) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Meta data is not available");
+        if (kernel_priv->pending) {
+            otsu_wait_fpga (handle, kernel_priv);
+            dd_cu_pool_release (&otsu_cu_pool);
+        }
+        kernel_priv->pending = FALSE;
+        return FALSE;
+    }
+    /* first stage of the chain, drop what a pooled buffer still carries */
+    gst_defect_meta_reset (meta);
+    kernel_priv->meta = meta;
+    t = dd_stats_frame_add (&kernel_priv->stats, DD_STATS_META, t);
 
-    gst_inference_prediction_append (infer_meta->prediction, predict);
+    if (!kernel_priv->on_cu) {
+        if (otsu_start_cpu (kernel_priv, input[0], outframe) < 0) {
+            kernel_priv->meta = NULL;
+            return FALSE;
+        }
+        dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, t);
+    }
 
     return TRUE;
 }
 
 int32_t xlnx_kernel_done(VVASKernel *handle)
 {
-    /* dummy */
+    PreProcessingKernelPriv *kernel_priv;
+    GstDefectMeta *meta;
+    VVASFrame *outframe;
+    uint32_t *thr;
+    uint64_t t;
+    int ret = 0, own_split;
+    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
+    meta = kernel_priv->meta;
+
+    if (!meta)
+        return -1;
+    kernel_priv->meta = NULL;
+    outframe = kernel_priv->outframe;
+    /*
+     * The accelerator splits the histogram of the band it blurred, the
+     * threshold is taken from the ROI only, like the CPU backend does
+     */
+    own_split = outframe->vaddr[0] &&
+                (kernel_priv->temporal ||
+                 kernel_priv->area.x != kernel_priv->roi.x || kernel_priv->area.y != kernel_priv->roi.y ||
+                 kernel_priv->area.width != kernel_priv->roi.width ||
+                 kernel_priv->area.height != kernel_priv->roi.height);
+
+    if (kernel_priv->pending) {
+        kernel_priv->pending = FALSE;
+        ret = otsu_wait_fpga (handle, kernel_priv);
+        if (ret == 0 && kernel_priv->n_bands > 1) {
+            ret = otsu_finish_bands (handle, kernel_priv);
+        } else if (ret == 0 && own_split) {
+            uint32_t hist[DD_HIST_BINS];
+            otsu_output_hist (kernel_priv, outframe, hist);
+            kernel_priv->sw_thr = otsu_split (kernel_priv, hist);
+        }
+        dd_cu_pool_release (&otsu_cu_pool);
+        if (ret < 0 && kernel_priv->backend != DD_BACKEND_FPGA) {
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Accelerator failed, switching to CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+            kernel_priv->on_cu = FALSE;
+            ret = otsu_start_cpu (kernel_priv, kernel_priv->inframe, kernel_priv->outframe);
+        }
+        dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, kernel_priv->exec_ns);
+    }
+    if (ret < 0)
+        return -1;
+
+    if (!kernel_priv->on_cu || kernel_priv->n_bands > 1 || own_split)
+        thr = &kernel_priv->sw_thr;
+    else
+        thr = kernel_priv->mem->vaddr[0];
+    if (kernel_priv->on_cu) {
+        t = dd_stats_clock_ns ();
+        if (!dd_roi_is_full (&kernel_priv->roi, outframe->props.width, outframe->props.height) &&
+            outframe->vaddr[0])
+            dd_cpu_clear_outside ((uint8_t *) outframe->vaddr[0], outframe->props.stride,
+                                  outframe->props.width, outframe->props.height, &kernel_priv->roi);
+        dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, t);
+    }
+
+    /* frames are processed whole while the ROI is being learnt */
+    if (outframe->vaddr[0] &&
+        dd_roi_config_learn (&kernel_priv->roi_cfg, (const uint8_t *) outframe->vaddr[0], outframe->props.stride,
+                             outframe->props.width, outframe->props.height, *thr) > 0)
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "VVAS PPE: learnt roi [%u, %u, %u, %u]",
+                     kernel_priv->roi_cfg.roi.x, kernel_priv->roi_cfg.roi.y,
+                     kernel_priv->roi_cfg.roi.width, kernel_priv->roi_cfg.roi.height);
+
+    meta->otsu_thr = *thr;
+    meta->roi_x = kernel_priv->roi.x;
+    meta->roi_y = kernel_priv->roi.y;
+    meta->roi_width = kernel_priv->roi.width;
+    meta->roi_height = kernel_priv->roi.height;
+    meta->flags |= GST_DEFECT_META_HAS_THRESHOLD | GST_DEFECT_META_HAS_ROI;
+    meta->stage_ns[GST_DEFECT_STAGE_OTSU] = dd_stats_clock_ns () - kernel_priv->stats.start_ns;
+    dd_stats_frame_commit (&kernel_priv->stats, DD_STATS_OTSU);
     return 0;
 }
@@ -14,18 +14,52 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include <vvas/vvaslogs.h>
 #include <vvas/vvas_kernel.h>
-#include <gst/vvas/gstinferencemeta.h>
+#include "gstdefectmeta.h"
+#include "dd_cpu_kernels.h"
+#include "dd_stats.h"
+#include "dd_config.h"
 
 #define DEFAULT_MAX_VALUE	255
 #define NORMALIZE_THRESHOLD 13
+#define KERNEL_DONE_TIMEOUT_MS  1000
+#define DEFAULT_NUM_CU          1
+#define DEFAULT_TILE_THREADS    0
+#define DEFAULT_TILE_ROWS       0
 
 typedef struct _kern_priv
 {
     int threshold;
     int max_value;
     int log_level;
+    DDBackend backend;
+    int num_cu;
+    /* command in flight between xlnx_kernel_start and xlnx_kernel_done */
+    gboolean pending;
+    /* the frame went to the accelerator and holds a CU of preprocess_cu_pool */
+    gboolean on_cu;
+    VVASFrame *inframe;
+    VVASFrame *outframe;
+    /* rectangle set by otsu, the rest of the mask is cleared */
+    DDRoi roi;
+    /* accelerator bands of the frame in flight, see dd_accel_bands() */
+    DDRoi area;
+    uint32_t n_bands;
+    /* frames larger than the accelerator are cut into strips on the CPU, started on the first */
+    DDTiler *tiler;
+    uint32_t tile_threads;
+    uint32_t tile_rows;
+    /* mask_format "bits": the CPU writes the mask at 1 bit per pixel */
+    gboolean mask_bits;
+    /* the frame in flight got a bit mask */
+    gboolean out_bits;
+    /* last config update taken from dd_config */
+    uint64_t config_gen;
+    DDStatsFrame stats;
+    /* end of the submit, the accelerator runs from here to the wait */
+    uint64_t exec_ns;
 } PreProcessingKernelPriv;
 
 int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT]);
@@ -33,10 +67,17 @@ int32_t xlnx_kernel_done(VVASKernel *handle);
 int32_t xlnx_kernel_init(VVASKernel *handle);
 uint32_t xlnx_kernel_deinit(VVASKernel *handle);
 
+/* shared by the pre-process elements of all streams */
+static DDCuPool preprocess_cu_pool = DD_CU_POOL_INIT;
+/* one per stream, their tilers share the CPUs */
+static uint32_t preprocess_elements;
+
 uint32_t xlnx_kernel_deinit(VVASKernel *handle)
 {
     PreProcessingKernelPriv *kernel_priv;
     kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
+    dd_tiler_free (kernel_priv->tiler);
+    __atomic_sub_fetch (&preprocess_elements, 1, __ATOMIC_RELAXED);
     free(kernel_priv);
     return 0;
 }
@@ -66,57 +107,280 @@ int32_t xlnx_kernel_init(VVASKernel *handle)
     else
 	    kernel_priv->max_value = json_integer_value (val);
     LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Max value %d", kernel_priv->max_value);
+
+    val = json_object_get (jconfig, "backend");
+    if (!val || !json_is_string (val) || dd_backend_from_string (json_string_value (val)) < 0)
+	    kernel_priv->backend = DD_BACKEND_FPGA;
+    else
+	    kernel_priv->backend = dd_backend_from_string (json_string_value (val));
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Backend %s, cpu simd %s",
+                 dd_backend_to_string (kernel_priv->backend), dd_cpu_simd_name ());
+
+    val = json_object_get (jconfig, "num_cu");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 1)
+	    kernel_priv->num_cu = DEFAULT_NUM_CU;
+    else
+	    kernel_priv->num_cu = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Compute units %d", kernel_priv->num_cu);
+
+    val = json_object_get (jconfig, "tile_threads");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->tile_threads = DEFAULT_TILE_THREADS;
+    else
+	    kernel_priv->tile_threads = json_integer_value (val);
+
+    val = json_object_get (jconfig, "tile_rows");
+    if (!val || !json_is_integer (val) || json_integer_value (val) < 0)
+	    kernel_priv->tile_rows = DEFAULT_TILE_ROWS;
+    else
+	    kernel_priv->tile_rows = json_integer_value (val);
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Tile threads %u", kernel_priv->tile_threads);
+
+    val = json_object_get (jconfig, "mask_format");
+    if (!val || !json_is_string (val) || strcmp (json_string_value (val), "bits"))
+	    kernel_priv->mask_bits = FALSE;
+    else
+	    kernel_priv->mask_bits = TRUE;
+    LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Mask format %s", kernel_priv->mask_bits ? "bits" : "bytes");
+    __atomic_add_fetch (&preprocess_elements, 1, __ATOMIC_RELAXED);
     handle->kernel_priv = (void *)kernel_priv;
     handle->is_multiprocess = 1;
     return 0;
 }
 
+static int32_t
+preprocess_submit_fpga (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe, VVASFrame *outframe,
+                        uint32_t index)
+{
+    int ret;
+    DDRoi band = dd_accel_band_at (&kernel_priv->area, index);
+
+    ret = vvas_kernel_start (handle, "ppiiuu", inframe->paddr[0] + (uint64_t) band.y * inframe->props.stride,
+                             outframe->paddr[0] + (uint64_t) band.y * outframe->props.stride, \
+                             kernel_priv->threshold, kernel_priv->max_value, band.height, \
+                             band.width);
+    if (ret < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to issue execute command");
+        return -1;
+    }
+    return 0;
+}
+
+static int32_t
+preprocess_wait_fpga (VVASKernel *handle, PreProcessingKernelPriv *kernel_priv)
+{
+    int ret;
+    /* wait for kernel completion */
+    ret = vvas_kernel_done (handle, KERNEL_DONE_TIMEOUT_MS);
+    if (ret < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to receive response from kernel");
+        dd_stats_timeout (DD_STATS_PREPROCESS);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+preprocess_clear_outside (PreProcessingKernelPriv *kernel_priv, VVASFrame *outframe)
+{
+    if (!dd_roi_is_full (&kernel_priv->roi, outframe->props.width, outframe->props.height) &&
+        outframe->vaddr[0])
+        dd_cpu_clear_outside ((uint8_t *) outframe->vaddr[0], outframe->props.stride,
+                              outframe->props.width, outframe->props.height, &kernel_priv->roi);
+}
+
+/* Strips in parallel, see dd_tiler_for() */
+static gboolean
+preprocess_tiled (PreProcessingKernelPriv *kernel_priv, const DDRoi *roi)
+{
+    return dd_tiler_for (&kernel_priv->tiler, kernel_priv->tile_threads, kernel_priv->tile_rows,
+                         __atomic_load_n (&preprocess_elements, __ATOMIC_RELAXED), roi->width, roi->height) != NULL;
+}
+
+/*
+ * The ROI's mask at 1 bit per pixel from the start of the output buffer.
+ * Nothing around it is written, CCA reads only the ROI.
+ */
+static void
+preprocess_bits_cpu (PreProcessingKernelPriv *kernel_priv, const uint8_t *src, uint32_t src_stride,
+                     uint8_t *bits)
+{
+    const DDRoi *roi = &kernel_priv->roi;
+    uint32_t bits_stride = DD_MASK_BITS_STRIDE (roi->width);
+
+    if (preprocess_tiled (kernel_priv, roi))
+        dd_tiler_threshold_bits (kernel_priv->tiler, src, src_stride, bits, bits_stride,
+                                 roi->width, roi->height, kernel_priv->threshold);
+    else
+        dd_cpu_threshold_bits (src, src_stride, bits, bits_stride, roi->width, roi->height,
+                               kernel_priv->threshold);
+}
+
+static int32_t
+preprocess_start_cpu (PreProcessingKernelPriv *kernel_priv, VVASFrame *inframe, VVASFrame *outframe)
+{
+    const DDRoi *roi = &kernel_priv->roi;
+    const uint8_t *src;
+    uint8_t *dst;
+
+    if (!inframe->vaddr[0] || !outframe->vaddr[0]) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Frames are not mapped for CPU access");
+        return -1;
+    }
+    src = (const uint8_t *) inframe->vaddr[0] + (size_t) roi->y * inframe->props.stride + roi->x;
+    /* words are stored whole, the rows must fit the buffer's and start aligned */
+    kernel_priv->out_bits = kernel_priv->mask_bits &&
+                            DD_MASK_BITS_STRIDE (roi->width) <= outframe->props.stride &&
+                            !((uintptr_t) outframe->vaddr[0] & 7);
+    if (kernel_priv->out_bits) {
+        preprocess_bits_cpu (kernel_priv, src, inframe->props.stride, (uint8_t *) outframe->vaddr[0]);
+        return 0;
+    }
+    dst = (uint8_t *) outframe->vaddr[0] + (size_t) roi->y * outframe->props.stride + roi->x;
+    if (preprocess_tiled (kernel_priv, roi))
+        dd_tiler_threshold (kernel_priv->tiler, src, inframe->props.stride, dst, outframe->props.stride,
+                            roi->width, roi->height, kernel_priv->threshold, kernel_priv->max_value);
+    else
+        dd_cpu_threshold (src, inframe->props.stride, dst, outframe->props.stride, roi->width, roi->height,
+                          kernel_priv->threshold, kernel_priv->max_value);
+    preprocess_clear_outside (kernel_priv, outframe);
+    return 0;
+}
+
+/* Takes debug_level and max_value of a published config */
+static void
+preprocess_reload (PreProcessingKernelPriv *kernel_priv)
+{
+    json_t *jconfig = dd_config_update (DD_CONFIG_PREPROCESS, &kernel_priv->config_gen);
+    int64_t log_level = kernel_priv->log_level, max_value = kernel_priv->max_value;
+
+    if (!jconfig)
+        return;
+    if (dd_config_int (jconfig, "debug_level", 0, INT32_MAX, &log_level) < 0 ||
+        dd_config_int (jconfig, "max_value", 1, 255, &max_value) < 0) {
+        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Config update rejected, keeping the running values");
+    } else {
+        kernel_priv->log_level = log_level;
+        kernel_priv->max_value = max_value;
+        LOG_MESSAGE (LOG_LEVEL_INFO, kernel_priv->log_level, "Config updated: max_value %d", kernel_priv->max_value);
+    }
+    json_decref (jconfig);
+}
+
 int32_t xlnx_kernel_start(VVASKernel *handle, int start, VVASFrame *input[MAX_NUM_OBJECT], VVASFrame *output[MAX_NUM_OBJECT])
 {
     PreProcessingKernelPriv *kernel_priv;
     int ret;
-    uint32_t *thr;
     VVASFrame *inframe = input[0];
     kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
-    GstInferenceMeta *infer_meta = ((GstInferenceMeta *)gst_buffer_get_meta((GstBuffer *)
-                                                                inframe->app_priv,
-                                                                gst_inference_meta_api_get_type()));
-    if (infer_meta == NULL)
+    /* a start that bails out leaves nothing for xlnx_kernel_done to record */
+    kernel_priv->outframe = NULL;
+    kernel_priv->pending = FALSE;
+    preprocess_reload (kernel_priv);
+    uint64_t t = dd_stats_frame_begin (&kernel_priv->stats);
+    GstDefectMeta *meta = gst_buffer_get_defect_meta ((GstBuffer *)inframe->app_priv);
+    if (meta == NULL || !(meta->flags & GST_DEFECT_META_HAS_THRESHOLD))
     {
-        LOG_MESSAGE(LOG_LEVEL_INFO, kernel_priv->log_level, "vvas meta data is not available for crop");
+        LOG_MESSAGE(LOG_LEVEL_INFO, kernel_priv->log_level, "Otsu threshold is not available");
         return FALSE;
     }
-    GstInferencePrediction *root = infer_meta->prediction;
-    /* Iterate through the immediate child predictions */
-    GSList *tmp = gst_inference_prediction_get_children(root);
-    for (GSList *child_predictions = tmp; child_predictions; child_predictions = g_slist_next(child_predictions))
-    {
-        GstInferencePrediction *child = (GstInferencePrediction *)child_predictions->data;
-        thr = (uint32_t *)child->reserved_1;
-    }
+    t = dd_stats_frame_add (&kernel_priv->stats, DD_STATS_META, t);
 
-    kernel_priv->threshold = *thr - NORMALIZE_THRESHOLD;
-
-    ret = vvas_kernel_start (handle, "ppiiuu", input[0]->paddr[0], output[0]->paddr[0], \
-                             kernel_priv->threshold, kernel_priv->max_value, input[0]->props.height, \
-                             input[0]->props.width);
-    if (ret < 0) {
-        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to issue execute command");
-        return FALSE;
+    kernel_priv->threshold = (int32_t) meta->otsu_thr - NORMALIZE_THRESHOLD;
+    if (meta->flags & GST_DEFECT_META_HAS_ROI) {
+        kernel_priv->roi.x = meta->roi_x;
+        kernel_priv->roi.y = meta->roi_y;
+        kernel_priv->roi.width = meta->roi_width;
+        kernel_priv->roi.height = meta->roi_height;
+    } else {
+        memset (&kernel_priv->roi, 0, sizeof (kernel_priv->roi));
     }
+    dd_roi_clamp (&kernel_priv->roi, inframe->props.width, inframe->props.height);
+    kernel_priv->n_bands = dd_accel_bands (&kernel_priv->roi, inframe->props.width, inframe->props.height,
+                                           inframe->props.stride == inframe->props.width &&
+                                           output[0]->props.stride == output[0]->props.width, &kernel_priv->area);
+    kernel_priv->out_bits = FALSE;
 
-    /* wait for kernel completion */
-    ret = vvas_kernel_done (handle, 1000);
-    if (ret < 0) {
-        LOG_MESSAGE (LOG_LEVEL_ERROR, kernel_priv->log_level, "Failed to receive response from kernel");
-        return FALSE;
+    /* too wide for the accelerator, the CPU strips it */
+    kernel_priv->on_cu = kernel_priv->n_bands &&
+                         dd_cu_pool_acquire (&preprocess_cu_pool, kernel_priv->backend, kernel_priv->num_cu);
+    if (kernel_priv->on_cu) {
+        ret = preprocess_submit_fpga (handle, kernel_priv, input[0], output[0], 0);
+        if (ret < 0) {
+            dd_cu_pool_release (&preprocess_cu_pool);
+            kernel_priv->on_cu = FALSE;
+            if (kernel_priv->backend == DD_BACKEND_FPGA)
+                return FALSE;
+            LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Accelerator failed, switching to CPU backend");
+            kernel_priv->backend = DD_BACKEND_CPU;
+        } else {
+            kernel_priv->pending = TRUE;
+        }
+        t = kernel_priv->exec_ns = dd_stats_frame_add (&kernel_priv->stats, DD_STATS_SUBMIT, t);
+    }
+    if (!kernel_priv->on_cu) {
+        if (preprocess_start_cpu (kernel_priv, input[0], output[0]) < 0)
+            return FALSE;
+        dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, t);
     }
-    g_slist_free(tmp);
+    kernel_priv->inframe = input[0];
+    kernel_priv->outframe = output[0];
     return TRUE;
 }
 
+/* The output buffer carries a copy of the input meta, add this stage's time */
+static void
+preprocess_record_time (PreProcessingKernelPriv *kernel_priv)
+{
+    GstDefectMeta *meta;
+    uint64_t t = dd_stats_clock_ns ();
+    meta = gst_buffer_get_defect_meta ((GstBuffer *)kernel_priv->outframe->app_priv);
+    if (meta) {
+        meta->stage_ns[GST_DEFECT_STAGE_PREPROCESS] = t - kernel_priv->stats.start_ns;
+        if (kernel_priv->out_bits) {
+            meta->flags |= GST_DEFECT_META_MASK_BITS;
+            meta->mask_stride = DD_MASK_BITS_STRIDE (kernel_priv->roi.width);
+            meta->mask_value = kernel_priv->max_value;
+        } else {
+            meta->flags &= ~GST_DEFECT_META_MASK_BITS;
+        }
+    }
+    dd_stats_frame_add (&kernel_priv->stats, DD_STATS_META, t);
+    dd_stats_frame_commit (&kernel_priv->stats, DD_STATS_PREPROCESS);
+}
+
 int32_t xlnx_kernel_done(VVASKernel *handle)
 {
-    /* dummy */
-    return 0;
+    PreProcessingKernelPriv *kernel_priv;
+    uint32_t i;
+    int ret;
+    kernel_priv = (PreProcessingKernelPriv *)handle->kernel_priv;
+
+    if (!kernel_priv->outframe)
+        return -1;
+    if (!kernel_priv->pending) {
+        preprocess_record_time (kernel_priv);
+        return 0;
+    }
+    kernel_priv->pending = FALSE;
+    ret = preprocess_wait_fpga (handle, kernel_priv);
+    /* a frame taller than the accelerator, the threshold needs no seam handling */
+    for (i = 1; ret == 0 && i < kernel_priv->n_bands; i++) {
+        ret = preprocess_submit_fpga (handle, kernel_priv, kernel_priv->inframe, kernel_priv->outframe, i);
+        if (ret == 0)
+            ret = preprocess_wait_fpga (handle, kernel_priv);
+    }
+    dd_cu_pool_release (&preprocess_cu_pool);
+    if (ret < 0 && kernel_priv->backend != DD_BACKEND_FPGA) {
+        LOG_MESSAGE (LOG_LEVEL_WARNING, kernel_priv->log_level, "Accelerator failed, switching to CPU backend");
+        kernel_priv->backend = DD_BACKEND_CPU;
+        kernel_priv->on_cu = FALSE;
+        ret = preprocess_start_cpu (kernel_priv, kernel_priv->inframe, kernel_priv->outframe);
+    } else if (ret == 0) {
+        preprocess_clear_outside (kernel_priv, kernel_priv->outframe);
+    }
+    dd_stats_frame_add (&kernel_priv->stats, DD_STATS_EXEC, kernel_priv->exec_ns);
+    if (ret == 0)
+        preprocess_record_time (kernel_priv);
+    return ret;
 }
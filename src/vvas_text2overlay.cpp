@@ -14,16 +14,26 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <vvas/vvas_kernel.h>
-#include <gst/vvas/gstinferencemeta.h>
+#include "gstdefectmeta.h"
+#include "dd_stats.h"
+#include "dd_config.h"
 
 int log_level;
 using namespace cv;
 using namespace std;
 
 #define DEFAULT_DEFECT_THRESHOLD  0.14
+#define OVERLAY_FIRST_GLYPH       32
+#define OVERLAY_NUM_GLYPHS        95
+#define OVERLAY_GLYPH_PAD         2
+#define OVERLAY_MAX_LINES         3
+#define OVERLAY_LINE_CHARS        64
+#define OVERLAY_LINE_SPACING      30
 
 enum
 {
@@ -54,10 +64,39 @@ enum
 }
 
 
-struct overlayframe_info
+/*
+ * Text is drawn from a glyph atlas rasterized once with cv::putText at init,
+ * so the result looks exactly as before but OpenCV is out of the per-frame
+ * path. Every printable ASCII character gets a cell_w x cell_h 0/255 mask
+ * whose pen origin is OVERLAY_GLYPH_PAD columns in and ascent rows down.
+ */
+struct overlay_glyph
+{
+  int advance;
+  size_t offset;
+};
+
+struct overlay_atlas
+{
+  int cell_w;
+  int cell_h;
+  int ascent;
+  struct overlay_glyph glyphs[OVERLAY_NUM_GLYPHS];
+  std::vector<uint8_t> pixels;
+};
+
+/*
+ * One text line composed into its own bitmap. When the string changes only
+ * the glyphs from the first differing character on are redrawn, which for
+ * the counters below is just the trailing digits.
+ */
+struct overlay_line
 {
-  VVASFrame *inframe;
-  Mat lumaImg;
+  char text[OVERLAY_LINE_CHARS];
+  int len;
+  int pen_x[OVERLAY_LINE_CHARS + 1];
+  int stride;
+  std::vector<uint8_t> bitmap;
 };
 
 struct vvas_xoverlaypriv
@@ -69,9 +108,159 @@ struct vvas_xoverlaypriv
   unsigned int y_offset;
   unsigned int x_offset;
   unsigned int total_defect;
-  struct overlayframe_info frameinfo;
+  struct overlay_atlas atlas;
+  struct overlay_line lines[OVERLAY_MAX_LINES];
+  /* last config update taken from dd_config */
+  uint64_t config_gen;
 };
 
+static void
+overlay_build_atlas (struct overlay_atlas *atlas, int font, double scale)
+{
+  int baseline = 0, ascent = 0, descent = 0, max_advance = 0;
+  int i;
+
+  for (i = 0; i < OVERLAY_NUM_GLYPHS; i++) {
+    std::string ch (1, (char) (OVERLAY_FIRST_GLYPH + i));
+    Size sz = getTextSize (ch, font, scale, 1, &baseline);
+    ascent = std::max (ascent, sz.height);
+    descent = std::max (descent, baseline);
+    max_advance = std::max (max_advance, sz.width);
+    atlas->glyphs[i].advance = sz.width;
+  }
+  atlas->cell_w = max_advance + 2 * OVERLAY_GLYPH_PAD;
+  atlas->cell_h = ascent + descent + 2 * OVERLAY_GLYPH_PAD;
+  atlas->ascent = ascent + OVERLAY_GLYPH_PAD;
+  atlas->pixels.assign ((size_t) OVERLAY_NUM_GLYPHS * atlas->cell_w * atlas->cell_h, 0);
+
+  for (i = 0; i < OVERLAY_NUM_GLYPHS; i++) {
+    std::string ch (1, (char) (OVERLAY_FIRST_GLYPH + i));
+    atlas->glyphs[i].offset = (size_t) i * atlas->cell_w * atlas->cell_h;
+    /* draw straight into the atlas storage */
+    Mat cell (atlas->cell_h, atlas->cell_w, CV_8U, &atlas->pixels[atlas->glyphs[i].offset]);
+    putText (cell, ch, cv::Point (OVERLAY_GLYPH_PAD, atlas->ascent), font, scale,
+             Scalar (255.0), 1, 1);
+  }
+}
+
+static void
+overlay_init_line (const struct overlay_atlas *atlas, struct overlay_line *line)
+{
+  line->len = 0;
+  line->text[0] = '\0';
+  line->pen_x[0] = 0;
+  line->stride = (OVERLAY_LINE_CHARS - 1) * (atlas->cell_w - 2 * OVERLAY_GLYPH_PAD) + atlas->cell_w;
+  line->bitmap.assign ((size_t) line->stride * atlas->cell_h, 0);
+}
+
+static void
+overlay_set_text (const struct overlay_atlas *atlas, struct overlay_line *line, const char *text)
+{
+  int i = 0, first, k, r;
+
+  while (i < line->len && text[i] == line->text[i])
+    i++;
+  if (i == line->len && text[i] == '\0')
+    return;
+
+  /* clear from the first changed glyph on, then redraw every glyph whose cell reaches it */
+  first = i;
+  for (r = 0; r < atlas->cell_h; r++) {
+    uint8_t *row = &line->bitmap[(size_t) r * line->stride];
+    memset (row + line->pen_x[first], 0, line->stride - line->pen_x[first]);
+  }
+
+  k = first;
+  while (k > 0 && line->pen_x[k - 1] + atlas->cell_w > line->pen_x[first])
+    k--;
+  for (; k < OVERLAY_LINE_CHARS - 1 && text[k]; k++) {
+    unsigned char c = (unsigned char) text[k];
+    const struct overlay_glyph *g;
+    if (c < OVERLAY_FIRST_GLYPH || c >= OVERLAY_FIRST_GLYPH + OVERLAY_NUM_GLYPHS)
+      c = '?';
+    g = &atlas->glyphs[c - OVERLAY_FIRST_GLYPH];
+    if (k >= first) {
+      line->text[k] = text[k];
+      line->pen_x[k + 1] = line->pen_x[k] + g->advance;
+    }
+    for (r = 0; r < atlas->cell_h; r++) {
+      const uint8_t *src = &atlas->pixels[g->offset + (size_t) r * atlas->cell_w];
+      uint8_t *dst = &line->bitmap[(size_t) r * line->stride + line->pen_x[k]];
+      for (int x = 0; x < atlas->cell_w; x++)
+        dst[x] = std::max (dst[x], src[x]);
+    }
+  }
+  line->len = k;
+  line->text[k] = '\0';
+}
+
+/* ORs the line into the luma plane with its baseline at (x, y), clipped to the frame */
+static void
+overlay_blit_line (const struct overlay_atlas *atlas, const struct overlay_line *line,
+    uint8_t *luma, int stride, int width, int height, int x, int y)
+{
+  int x0 = x - OVERLAY_GLYPH_PAD;
+  int y0 = y - atlas->ascent;
+  int w = line->pen_x[line->len] + 2 * OVERLAY_GLYPH_PAD;
+  int skip = x0 < 0 ? -x0 : 0;
+  int r;
+
+  if (x0 + w > width)
+    w = width - x0;
+  if (w <= skip)
+    return;
+  for (r = 0; r < atlas->cell_h; r++) {
+    if (y0 + r < 0 || y0 + r >= height)
+      continue;
+    const uint8_t *src = &line->bitmap[(size_t) r * line->stride];
+    uint8_t *dst = luma + (size_t) (y0 + r) * stride + x0;
+    for (int i = skip; i < w; i++)
+      dst[i] = std::max (dst[i], src[i]);
+  }
+}
+
+/*
+ * Takes debug_level, defect_threshold, is_acc_result, x_offset, y_offset,
+ * font and font_size of a published config. A new font is rasterized here,
+ * between frames.
+ */
+static void
+overlay_reload (vvas_xoverlaypriv *kpriv)
+{
+  json_t *jconfig = dd_config_update (DD_CONFIG_OVERLAY, &kpriv->config_gen);
+  int64_t level = log_level, is_acc_result = kpriv->is_acc_result, font = kpriv->font;
+  int64_t x_offset = kpriv->x_offset, y_offset = kpriv->y_offset;
+  double defect_threshold = kpriv->defect_threshold, font_size = kpriv->font_size;
+
+  if (!jconfig)
+    return;
+  /* Hershey fonts 0 to 7, 16 makes them italic */
+  if (dd_config_int (jconfig, "debug_level", 0, INT32_MAX, &level) < 0 ||
+      dd_config_number (jconfig, "defect_threshold", 0.0, 100.0, &defect_threshold) < 0 ||
+      dd_config_int (jconfig, "is_acc_result", 0, 1, &is_acc_result) < 0 ||
+      dd_config_int (jconfig, "x_offset", 0, INT32_MAX, &x_offset) < 0 ||
+      dd_config_int (jconfig, "y_offset", 0, INT32_MAX, &y_offset) < 0 ||
+      dd_config_int (jconfig, "font", 0, 23, &font) < 0 || (font & ~16) > 7 ||
+      dd_config_number (jconfig, "font_size", 0.1, 10.0, &font_size) < 0) {
+    LOG_MESSAGE (LOG_LEVEL_ERROR, "config update rejected, keeping the running values");
+    json_decref (jconfig);
+    return;
+  }
+  log_level = level;
+  kpriv->defect_threshold = defect_threshold;
+  kpriv->is_acc_result = is_acc_result;
+  kpriv->x_offset = x_offset;
+  kpriv->y_offset = y_offset;
+  if (font != kpriv->font || (float) font_size != kpriv->font_size) {
+    kpriv->font = font;
+    kpriv->font_size = font_size;
+    overlay_build_atlas (&kpriv->atlas, kpriv->font, kpriv->font_size);
+    for (int i = 0; i < OVERLAY_MAX_LINES; i++)
+      overlay_init_line (&kpriv->atlas, &kpriv->lines[i]);
+  }
+  LOG_MESSAGE (LOG_LEVEL_INFO, "config updated, defect threshold %lf", kpriv->defect_threshold);
+  json_decref (jconfig);
+}
 
 extern "C"
 {
@@ -79,9 +268,7 @@ extern "C"
   {
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "enter");
 
-    vvas_xoverlaypriv *kpriv =
-        (vvas_xoverlaypriv *) malloc (sizeof (vvas_xoverlaypriv));
-    memset (kpriv, 0, sizeof (vvas_xoverlaypriv));
+    vvas_xoverlaypriv *kpriv = new vvas_xoverlaypriv ();
 
     json_t *jconfig = handle->kernel_config;
     json_t *val;
@@ -138,6 +325,11 @@ extern "C"
         kpriv->x_offset = json_integer_value (val);
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "X Offset %u", kpriv->x_offset);
 
+    overlay_build_atlas (&kpriv->atlas, kpriv->font, kpriv->font_size);
+    for (int i = 0; i < OVERLAY_MAX_LINES; i++)
+        overlay_init_line (&kpriv->atlas, &kpriv->lines[i]);
+    LOG_MESSAGE (LOG_LEVEL_DEBUG, "glyph cell %dx%d", kpriv->atlas.cell_w, kpriv->atlas.cell_h);
+
     handle->kernel_priv = (void *) kpriv;
     return 0;
   }
@@ -147,8 +339,7 @@ extern "C"
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "enter");
     vvas_xoverlaypriv *kpriv = (vvas_xoverlaypriv *) handle->kernel_priv;
 
-    if (kpriv)
-        free (kpriv);
+    delete kpriv;
 
     return 0;
   }
@@ -157,66 +348,62 @@ extern "C"
       VVASFrame * input[MAX_NUM_OBJECT], VVASFrame * output[MAX_NUM_OBJECT])
   {
     vvas_xoverlaypriv *kpriv = (vvas_xoverlaypriv *) handle->kernel_priv;
-    struct overlayframe_info *frameinfo = &(kpriv->frameinfo);
-    frameinfo->inframe = input[0];
-
-    char *lumaBuf = (char *) frameinfo->inframe->vaddr[0];
-
-    frameinfo->lumaImg.create (input[0]->props.height, input[0]->props.stride, CV_8U);
-    frameinfo->lumaImg.data = (unsigned char *) lumaBuf;
-    GstInferenceMeta *infer_meta;
-    infer_meta = ((GstInferenceMeta *) gst_buffer_get_meta((GstBuffer *)frameinfo->inframe->app_priv,
-                                                                 gst_inference_meta_api_get_type()));
-    if (infer_meta == NULL) {
-        LOG_MESSAGE(LOG_LEVEL_INFO, "vvas meta data is not available for crop");
+    overlay_reload (kpriv);
+    VVASFrame *inframe = input[0];
+    uint8_t *luma = (uint8_t *) inframe->vaddr[0];
+    int width = inframe->props.width;
+    int height = inframe->props.height;
+    int stride = inframe->props.stride;
+    DDStatsFrame stats;
+    uint64_t t = dd_stats_frame_begin (&stats);
+
+    GstDefectMeta *meta = gst_buffer_get_defect_meta ((GstBuffer *)inframe->app_priv);
+    if (meta == NULL || !(meta->flags & GST_DEFECT_META_HAS_COUNTS)) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "defect counts are not available");
         return FALSE;
     }
-    uint32_t *mango_pixel, *defect_pixel;
-    GstInferencePrediction *root = infer_meta->prediction;
-    /* Iterate through the immediate child predictions */
-    GSList *tmp = gst_inference_prediction_get_children(root);
-
-    for (GSList *child_predictions = tmp; child_predictions; child_predictions = g_slist_next(child_predictions)) {
-        GstInferencePrediction *child = (GstInferencePrediction *)child_predictions->data;
-        mango_pixel = (uint32_t *)child->reserved_1;
-        defect_pixel = (uint32_t *)child->reserved_2;
-    }
 
-    double defect_density = ((double)*defect_pixel / *mango_pixel) * 100.0;
+    double defect_density = meta->mango_pix ? ((double)meta->defect_pix / meta->mango_pix) * 100.0 : 0.0;
     bool defect_decision = (defect_density > kpriv->defect_threshold);
+    t = dd_stats_frame_add (&stats, DD_STATS_META, t);
 
-    char text_buffer[512] = {0,};
+    char text_buffer[OVERLAY_LINE_CHARS] = {0,};
     int y_point = kpriv->y_offset;
     if (defect_decision) {
         kpriv->total_defect++;
+        meta->flags |= GST_DEFECT_META_DEFECTIVE;
+    } else {
+        meta->flags &= ~GST_DEFECT_META_DEFECTIVE;
     }
 
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "Defect Density: %.2lf %%", defect_density);
-    sprintf(text_buffer, "Defect Density: %.2lf %%", defect_density);
+    snprintf(text_buffer, sizeof (text_buffer), "Defect Density: %.2lf %%", defect_density);
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "text buffer : %s", text_buffer);
-    /* Draw label text on the filled rectanngle */
-    putText(frameinfo->lumaImg, text_buffer, cv::Point(kpriv->x_offset, y_point), kpriv->font,
-            kpriv->font_size, Scalar (255.0, 255.0, 255.0), 1, 1);
-    y_point += 30;
-    text_buffer[0] = '\0';
+    /* Only the glyphs that changed since the last frame are re-rendered */
+    overlay_set_text (&kpriv->atlas, &kpriv->lines[0], text_buffer);
+    overlay_blit_line (&kpriv->atlas, &kpriv->lines[0], luma, stride, width, height,
+                       kpriv->x_offset, y_point);
+    y_point += OVERLAY_LINE_SPACING;
+
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "Is Defected: %s", defect_decision ? "Yes": "No");
-    sprintf(text_buffer, "Is Defected: %s", defect_decision ? "Yes": "No");
+    snprintf(text_buffer, sizeof (text_buffer), "Is Defected: %s", defect_decision ? "Yes": "No");
     LOG_MESSAGE (LOG_LEVEL_DEBUG, "text buffer : %s", text_buffer);
-    /* Draw label text on the filled rectanngle */
-    putText(frameinfo->lumaImg, text_buffer, cv::Point(kpriv->x_offset, y_point), kpriv->font,
-            kpriv->font_size, Scalar (255.0, 255.0, 255.0), 1, 1);
-    y_point += 30;
+    overlay_set_text (&kpriv->atlas, &kpriv->lines[1], text_buffer);
+    overlay_blit_line (&kpriv->atlas, &kpriv->lines[1], luma, stride, width, height,
+                       kpriv->x_offset, y_point);
+    y_point += OVERLAY_LINE_SPACING;
 
     if (kpriv->is_acc_result) {
         LOG_MESSAGE (LOG_LEVEL_DEBUG, "Accumulated Defects: %u", kpriv->total_defect);
-        sprintf(text_buffer, "Accumulated defects: %u", kpriv->total_defect);
+        snprintf(text_buffer, sizeof (text_buffer), "Accumulated defects: %u", kpriv->total_defect);
         LOG_MESSAGE (LOG_LEVEL_DEBUG, "text buffer : %s", text_buffer);
-         /* Draw label text on the filled rectanngle */
-        putText(frameinfo->lumaImg, text_buffer, cv::Point(kpriv->x_offset, y_point), kpriv->font,
-                kpriv->font_size, Scalar (255.0, 255.0, 255.0), 1, 1);
+        overlay_set_text (&kpriv->atlas, &kpriv->lines[2], text_buffer);
+        overlay_blit_line (&kpriv->atlas, &kpriv->lines[2], luma, stride, width, height,
+                           kpriv->x_offset, y_point);
     }
-    g_slist_free(tmp);
 
+    dd_stats_frame_add (&stats, DD_STATS_EXEC, t);
+    dd_stats_frame_commit (&stats, DD_STATS_OVERLAY);
     return 0;
   }
 